@@ -1,9 +1,12 @@
-SOURCES += $$PWD/src/libusby.c
+SOURCES += $$PWD/src/libusby.c \
+    $$PWD/src/stream.c \
+    $$PWD/src/writer.c
 HEADERS += $$PWD/src/libusb.h \
     $$PWD/src/libusby.h \
     $$PWD/src/libusby.hpp \
     $$PWD/src/libusbyi.h \
     $$PWD/src/libusbyi_fwd.h \
+    $$PWD/src/libusbyi_sync.h \
     $$PWD/src/os/os.h
 INCLUDEPATH += $$PWD/src
 
@@ -13,5 +16,7 @@ win32 {
 }
 
 linux-* {
-    SOURCES += $$PWD/src/os/linux_usbfs.c
+    SOURCES += $$PWD/src/os/linux_usbfs.c \
+        $$PWD/src/os/linux_uring.c
+    HEADERS += $$PWD/src/os/linux_uring.h
 }
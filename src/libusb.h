@@ -48,6 +48,7 @@
 #define libusb_get_active_config_descriptor libusby_get_active_config_descriptor
 #define libusb_get_config_descriptor libusby_get_config_descriptor
 #define libusb_get_config_descriptor_by_value libusby_get_config_descriptor_by_value
+#define libusb_get_max_packet_size libusby_get_max_packet_size
 #define libusb_free_config_descriptor libusby_free_config_descriptor
 #define libusb_get_string_descriptor_ascii libusby_get_string_descriptor_ascii
 #define libusb_get_descriptor libusby_get_descriptor
@@ -56,6 +57,8 @@
 /* Asynchronous device I/O */
 #define libusb_alloc_transfer libusby_alloc_transfer
 #define libusb_free_transfer libusby_free_transfer
+#define libusb_dev_mem_alloc libusby_dev_mem_alloc
+#define libusb_dev_mem_free libusby_dev_mem_free
 #define libusb_submit_transfer libusby_submit_transfer
 #define libusb_cancel_transfer libusby_cancel_transfer
 #define libusb_control_transfer_get_data libusby_control_transfer_get_data
@@ -63,6 +66,9 @@
 #define libusb_fill_control_transfer libusby_fill_control_transfer
 #define libusb_fill_bulk_transfer libusby_fill_bulk_transfer
 #define libusb_fill_interrupt_transfer libusby_fill_interrupt_transfer
+#define libusb_fill_iso_transfer libusby_fill_iso_transfer
+#define libusb_set_iso_packet_lengths libusby_set_iso_packet_lengths
+#define libusb_get_iso_packet_buffer libusby_get_iso_packet_buffer
 
 /* Synchronous device I/O */
 #define libusb_control_transfer libusby_control_transfer
@@ -75,6 +81,14 @@
 #define libusb_reset_event_loop libusby_reset_event_loop
 #define libusb_wait_for_transfer libusby_wait_for_transfer
 
+/* Hotplug */
+#define libusb_hotplug_event libusby_hotplug_event
+#define libusb_hotplug_flag libusby_hotplug_flag
+#define libusb_hotplug_callback_handle libusby_hotplug_callback_handle
+#define libusb_hotplug_callback_fn libusby_hotplug_callback_fn
+#define libusb_hotplug_register_callback libusby_hotplug_register_callback
+#define libusb_hotplug_deregister_callback libusby_hotplug_deregister_callback
+
 #define LIBUSB_CALL
 
 #define LIBUSB_TRANSFER_COMPLETED LIBUSBY_TRANSFER_COMPLETED
@@ -85,6 +99,12 @@
 #define LIBUSB_TRANSFER_NO_DEVICE LIBUSBY_TRANSFER_NO_DEVICE
 #define LIBUSB_TRANSFER_OVERFLOW LIBUSBY_TRANSFER_OVERFLOW
 
+#define LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED LIBUSBY_HOTPLUG_EVENT_DEVICE_ARRIVED
+#define LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT LIBUSBY_HOTPLUG_EVENT_DEVICE_LEFT
+#define LIBUSB_HOTPLUG_NO_FLAGS LIBUSBY_HOTPLUG_NO_FLAGS
+#define LIBUSB_HOTPLUG_ENUMERATE LIBUSBY_HOTPLUG_ENUMERATE
+#define LIBUSB_HOTPLUG_MATCH_ANY LIBUSBY_HOTPLUG_MATCH_ANY
+
 #define LIBUSB_SUCCESS LIBUSBY_SUCCESS
 #define LIBUSB_ERROR_IO LIBUSBY_ERROR_IO
 #define LIBUSB_ERROR_INVALID_PARAM LIBUSBY_ERROR_INVALID_PARAM
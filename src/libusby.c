@@ -85,33 +85,57 @@ void libusby_exit(libusby_context * ctx)
 	free(ctx);
 }
 
+int libusby_set_option(libusby_context * ctx, libusby_option option, int value)
+{
+	return usbyb_set_option((usbyb_context *)ctx, option, value);
+}
+
 libusby_transfer * libusby_alloc_transfer(libusby_context * ctx, int iso_packets)
 {
 	size_t alloc_size = usbyb_transfer_size + (sizeof(libusby_iso_packet_descriptor)*(iso_packets-1));
-	usbyb_transfer * res = malloc(alloc_size);
-	usbyi_transfer * resi = (usbyi_transfer *)res;
+	usbyb_transfer * res;
+	usbyi_transfer * resi;
+
+	int r = usbyb_alloc_transfer((usbyb_context *)ctx, iso_packets, &res);
+	if (r == LIBUSBY_SUCCESS)
+		return usbyi_get_pub_tran(res);
+	if (r != LIBUSBY_ERROR_NOT_SUPPORTED)
+		return NULL;
+
+	res = malloc(alloc_size);
+	resi = (usbyi_transfer *)res;
 	if (!res)
 		return NULL;
 	memset(res, 0, alloc_size);
 
+	/* The backend may preallocate its own per-packet state. */
+	resi->ctx = (usbyb_context *)ctx;
+	resi->num_iso_packets = iso_packets;
+
 	if (usbyb_init_transfer(res) < 0)
 	{
 		free(res);
 		return NULL;
 	}
 
-	resi->ctx = (usbyb_context *)ctx;
-	resi->num_iso_packets = iso_packets;
 	return usbyi_get_pub_tran(res);
 }
 
 void libusby_free_transfer(libusby_transfer * transfer)
 {
 	usbyb_transfer * trani = usbyi_get_tran(transfer);
+	if (usbyb_free_transfer(trani) != LIBUSBY_ERROR_NOT_SUPPORTED)
+		return;
+
 	usbyb_clear_transfer(trani);
 	free(trani);
 }
 
+int libusby_get_transfer_pool_stats(libusby_context * ctx, libusby_transfer_pool_stats * stats)
+{
+	return usbyb_get_transfer_pool_stats((usbyb_context *)ctx, stats);
+}
+
 void libusby_fill_bulk_transfer(libusby_transfer * transfer, libusby_device_handle * dev_handle, libusby_endpoint_t endpoint, uint8_t * buffer, int length,
 	libusby_transfer_cb_fn callback, void * user_data, libusby_timeout_t timeout)
 {
@@ -130,6 +154,43 @@ void libusby_fill_bulk_transfer(libusby_transfer * transfer, libusby_device_hand
 		memset(transfer->iso_packet_desc, 0, sizeof(libusby_iso_packet_descriptor)*transfer->num_iso_packets);
 }
 
+void libusby_fill_iso_transfer(libusby_transfer * transfer, libusby_device_handle * dev_handle, libusby_endpoint_t endpoint, uint8_t * buffer, int length,
+	int num_iso_packets, libusby_transfer_cb_fn callback, void * user_data, libusby_timeout_t timeout)
+{
+	transfer->dev_handle = dev_handle;
+	transfer->flags = 0;
+	transfer->endpoint = endpoint;
+	transfer->type = LIBUSBY_TRANSFER_TYPE_ISOCHRONOUS;
+	transfer->status = LIBUSBY_TRANSFER_COMPLETED;
+	transfer->length = length;
+	transfer->actual_length = 0;
+	transfer->callback = callback;
+	transfer->user_data = user_data;
+	transfer->buffer = buffer;
+	transfer->timeout = timeout;
+	transfer->num_iso_packets = num_iso_packets;
+}
+
+void libusby_set_iso_packet_lengths(libusby_transfer * transfer, int length)
+{
+	int i;
+	for (i = 0; i < transfer->num_iso_packets; ++i)
+		transfer->iso_packet_desc[i].length = length;
+}
+
+uint8_t * libusby_get_iso_packet_buffer(libusby_transfer * transfer, int packet)
+{
+	uint8_t * res = transfer->buffer;
+	int i;
+
+	if (packet < 0 || packet >= transfer->num_iso_packets)
+		return NULL;
+
+	for (i = 0; i < packet; ++i)
+		res += transfer->iso_packet_desc[i].length;
+	return res;
+}
+
 int libusby_perform_transfer(libusby_transfer * tran)
 {
 	usbyb_transfer * tranb = usbyi_get_tran(tran);
@@ -167,12 +228,48 @@ int libusby_submit_transfer(libusby_transfer * transfer)
 	return usbyb_submit_transfer(tranb);
 }
 
+int libusby_submit_transfers(libusby_transfer ** transfers, int count, int * submitted)
+{
+	return usbyb_submit_transfers(transfers, count, submitted);
+}
+
 int libusby_cancel_transfer(libusby_transfer * transfer)
 {
 	usbyb_transfer * tranb = usbyi_get_tran(transfer);
 	return usbyb_cancel_transfer(tranb);
 }
 
+int libusby_cancel_endpoint(libusby_device_handle * dev_handle, libusby_endpoint_t endpoint)
+{
+	return usbyb_cancel_endpoint((usbyb_device_handle *)dev_handle, endpoint);
+}
+
+int libusby_cancel_all(libusby_device_handle * dev_handle)
+{
+	return usbyb_cancel_all((usbyb_device_handle *)dev_handle);
+}
+
+int libusby_completion_queue_open(libusby_completion_queue ** queue, libusby_context * ctx, int capacity)
+{
+	return usbyb_completion_queue_open(queue, (usbyb_context *)ctx, capacity);
+}
+
+void libusby_completion_queue_close(libusby_completion_queue * queue)
+{
+	usbyb_completion_queue_close(queue);
+}
+
+int libusby_set_transfer_queue(libusby_transfer * transfer, libusby_completion_queue * queue)
+{
+	usbyb_transfer * tranb = usbyi_get_tran(transfer);
+	return usbyb_set_transfer_queue(tranb, queue);
+}
+
+int libusby_poll_completions(libusby_completion_queue * queue, libusby_transfer ** transfers, int max, int timeout)
+{
+	return usbyb_poll_completions(queue, transfers, max, timeout);
+}
+
 int libusby_claim_interface(libusby_device_handle * dev_handle, int interface_number)
 {
 	return usbyb_claim_interface((usbyb_device_handle *)dev_handle, interface_number);
@@ -188,6 +285,39 @@ libusby_device * libusby_get_device(libusby_device_handle * dev_handle)
 	return (libusby_device *)dev_handle->dev;
 }
 
+int libusby_set_handle_shard(libusby_device_handle * dev_handle, int shard)
+{
+	return usbyb_set_handle_shard((usbyb_device_handle *)dev_handle, shard);
+}
+
+int libusby_get_handle_shard(libusby_device_handle * dev_handle)
+{
+	return usbyb_get_handle_shard((usbyb_device_handle *)dev_handle);
+}
+
+uint8_t * libusby_dev_mem_alloc(libusby_device_handle * dev_handle, size_t length)
+{
+	uint8_t * res;
+	int r = usbyb_dev_mem_alloc((usbyb_device_handle *)dev_handle, length, &res);
+	if (r == LIBUSBY_ERROR_NOT_SUPPORTED)
+		return malloc(length);
+	return r < 0? NULL: res;
+}
+
+int libusby_dev_mem_free(libusby_device_handle * dev_handle, uint8_t * buffer, size_t length)
+{
+	int r = usbyb_dev_mem_free((usbyb_device_handle *)dev_handle, buffer, length);
+
+	/* The backend keeps track of its buffers, including those it took from the heap,
+	 * so any buffer is from `libusby_dev_mem_alloc` only if the backend has none. */
+	if (r == LIBUSBY_ERROR_NOT_SUPPORTED)
+	{
+		free(buffer);
+		r = LIBUSBY_SUCCESS;
+	}
+	return r;
+}
+
 void libusby_free_device_list(libusby_device ** list, int unref_devices)
 {
 	if (list && unref_devices)
@@ -299,6 +429,13 @@ void libusby_close(libusby_device_handle * dev_handle)
 	free(dev_handle);
 }
 
+int libusby_close_drain(libusby_device_handle * dev_handle)
+{
+	int r = usbyb_drain((usbyb_device_handle *)dev_handle);
+	libusby_close(dev_handle);
+	return r;
+}
+
 int libusby_get_device_list(libusby_context * ctx, libusby_device *** list)
 {
 	return usbyb_get_device_list((usbyb_context *)ctx, list);
@@ -339,8 +476,15 @@ int libusby_control_transfer(libusby_device_handle * dev_handle, uint8_t bmReque
 	int r;
 
 	uint8_t * buffer = 0;
-	libusby_device * dev = libusby_get_device(dev_handle);
-	libusby_transfer * tran = libusby_alloc_transfer(dev->ctx, 0);
+	libusby_device * dev;
+	libusby_transfer * tran;
+
+	r = usbyb_control_transfer((usbyb_device_handle *)dev_handle, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
+	if (r != LIBUSBY_ERROR_NOT_SUPPORTED)
+		return r;
+
+	dev = libusby_get_device(dev_handle);
+	tran = libusby_alloc_transfer(dev->ctx, 0);
 	if (!tran)
 		return LIBUSBY_ERROR_NO_MEM;
 
@@ -691,6 +835,40 @@ void libusby_free_config_descriptor(libusby_config_descriptor * config)
 	free(config);
 }
 
+int libusby_get_max_packet_size(libusby_device * dev, libusby_endpoint_t endpoint)
+{
+	int r = LIBUSBY_ERROR_NOT_FOUND;
+	int i, j, k, l;
+
+	for (i = 0; r == LIBUSBY_ERROR_NOT_FOUND && i < dev->device_desc.bNumConfigurations; ++i)
+	{
+		libusby_config_descriptor * config;
+		int cr = libusby_get_config_descriptor_cached(dev, i, &config);
+		if (cr < 0)
+			return cr;
+
+		for (j = 0; r == LIBUSBY_ERROR_NOT_FOUND && j < config->bNumInterfaces; ++j)
+		{
+			for (k = 0; r == LIBUSBY_ERROR_NOT_FOUND && k < config->interface[j].num_altsetting; ++k)
+			{
+				libusby_interface_descriptor * intf = &config->interface[j].altsetting[k];
+				for (l = 0; l < intf->bNumEndpoints; ++l)
+				{
+					if (intf->endpoint[l].bEndpointAddress == endpoint)
+					{
+						r = intf->endpoint[l].wMaxPacketSize & 0x7ff;
+						break;
+					}
+				}
+			}
+		}
+
+		libusby_free_config_descriptor(config);
+	}
+
+	return r;
+}
+
 int libusby_get_active_config_descriptor(libusby_device_handle * dev_handle, libusby_config_descriptor ** config)
 {
 	int active_config;
@@ -780,6 +958,11 @@ int libusby_run_event_loop(libusby_context * ctx)
 	return usbyb_run_event_loop((usbyb_context *)ctx);
 }
 
+int libusby_start_event_thread(libusby_context * ctx, libusby_thread_attrs const * attrs)
+{
+	return usbyb_start_event_thread((usbyb_context *)ctx, attrs);
+}
+
 void libusby_stop_event_loop(libusby_context * ctx)
 {
 	usbyb_stop_event_loop((usbyb_context *)ctx);
@@ -790,6 +973,37 @@ void libusby_reset_event_loop(libusby_context * ctx)
 	usbyb_reset_event_loop((usbyb_context *)ctx);
 }
 
+void libusby_set_batch_callback(libusby_context * ctx, libusby_batch_cb_fn callback, void * user_data)
+{
+	usbyb_set_batch_callback((usbyb_context *)ctx, callback, user_data);
+}
+
+int libusby_get_event_loop_stats(libusby_context * ctx, libusby_event_loop_stats * stats)
+{
+	return usbyb_get_event_loop_stats((usbyb_context *)ctx, stats);
+}
+
+int libusby_set_clock(libusby_context * ctx, libusby_clock_fn clock, void * user_data)
+{
+	return usbyb_set_clock((usbyb_context *)ctx, clock, user_data);
+}
+
+int libusby_clock_advanced(libusby_context * ctx)
+{
+	return usbyb_clock_advanced((usbyb_context *)ctx);
+}
+
+int libusby_hotplug_register_callback(libusby_context * ctx, int events, int flags, int vendor_id, int product_id, int dev_class,
+	libusby_hotplug_callback_fn callback, void * user_data, libusby_hotplug_callback_handle * handle)
+{
+	return usbyb_hotplug_register_callback((usbyb_context *)ctx, events, flags, vendor_id, product_id, dev_class, callback, user_data, handle);
+}
+
+void libusby_hotplug_deregister_callback(libusby_context * ctx, libusby_hotplug_callback_handle handle)
+{
+	usbyb_hotplug_deregister_callback((usbyb_context *)ctx, handle);
+}
+
 libusby_transfer * usbyi_get_pub_tran(usbyb_transfer * tran)
 {
 	return (libusby_transfer *)((char *)tran + usbyb_transfer_pub_offset);
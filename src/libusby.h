@@ -2,6 +2,7 @@
 #define LIBUSBY_LIBUSBY_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 /* A workaround (`<windows.h>` defines `interface`). */
 #ifdef interface
@@ -70,6 +71,9 @@ typedef struct libusby_transfer libusby_transfer;
 
 typedef void (* libusby_transfer_cb_fn)(libusby_transfer * transfer);
 
+/* Called by the event loop with all the transfers reaped in a single pass. */
+typedef void (* libusby_batch_cb_fn)(libusby_transfer ** transfers, int count, void * user_data);
+
 struct libusby_transfer
 {
 	libusby_device_handle * dev_handle;
@@ -87,6 +91,90 @@ struct libusby_transfer
 	libusby_iso_packet_descriptor iso_packet_desc[1];
 };
 
+/* Returns a monotonic time in milliseconds. Only differences between readings matter. */
+typedef uint64_t (* libusby_clock_fn)(void * user_data);
+
+typedef struct libusby_event_loop_stats
+{
+	/* Wakeups asked for by other threads, including those that were coalesced. */
+	uint64_t wakeups_requested;
+	/* Wakeups that actually had to be signalled to the loop. */
+	uint64_t wakeups_signalled;
+	/* Wakeups observed by the loop. */
+	uint64_t wakeups_received;
+} libusby_event_loop_stats;
+
+typedef enum libusby_sched_policy
+{
+	LIBUSBY_SCHED_OTHER,
+	LIBUSBY_SCHED_FIFO,
+} libusby_sched_policy;
+
+typedef struct libusby_thread_attrs
+{
+	/* The CPUs 0 to 63 the thread may run on, zero to leave the affinity unchanged. */
+	uint64_t cpu_mask;
+	/* One of `libusby_sched_policy`, with the priority the policy expects. */
+	int sched_policy;
+	int sched_priority;
+	/* Nonzero to lock the process's current and future pages in memory
+	 * until the thread is stopped. Stopping it unlocks all of the process's
+	 * memory, unless some was locked already when the thread was started. */
+	int lock_memory;
+} libusby_thread_attrs;
+
+typedef struct libusby_transfer_pool_stats
+{
+	/* Transfers allocated by recycling a previously freed one. */
+	uint64_t hits;
+	/* Transfers that had to be allocated anew. */
+	uint64_t misses;
+} libusby_transfer_pool_stats;
+
+typedef struct libusby_completion_queue libusby_completion_queue;
+
+typedef enum libusby_hotplug_event
+{
+	LIBUSBY_HOTPLUG_EVENT_DEVICE_ARRIVED = (1<<0),
+	LIBUSBY_HOTPLUG_EVENT_DEVICE_LEFT = (1<<1),
+} libusby_hotplug_event;
+
+typedef enum libusby_hotplug_flag
+{
+	LIBUSBY_HOTPLUG_NO_FLAGS = 0,
+	/* Report the devices already present as arrived before the registration returns. */
+	LIBUSBY_HOTPLUG_ENUMERATE = (1<<0),
+} libusby_hotplug_flag;
+
+#define LIBUSBY_HOTPLUG_MATCH_ANY -1
+
+typedef int libusby_hotplug_callback_handle;
+
+/* Called by the event loop as devices come and go. The device is valid until the callback
+ * returns unless referenced. Returning nonzero deregisters the callback. */
+typedef int (* libusby_hotplug_callback_fn)(libusby_context * ctx, libusby_device * dev, libusby_hotplug_event event, void * user_data);
+
+typedef struct libusby_stream libusby_stream;
+
+typedef struct libusby_writer libusby_writer;
+
+typedef struct libusby_stream_buffer
+{
+	uint8_t * data;
+	int length;
+	libusby_transfer_status status;
+} libusby_stream_buffer;
+
+typedef struct libusby_stream_stats
+{
+	uint64_t transfers;
+	uint64_t bytes;
+	/* Completions after which no released buffer was available to resubmit with. */
+	uint64_t overflows;
+	/* Non-blocking reads that found no completed buffer. */
+	uint64_t underruns;
+} libusby_stream_stats;
+
 typedef struct libusby_device_descriptor
 {
 	uint8_t  bLength;
@@ -150,17 +238,62 @@ typedef struct libusby_config_descriptor
 	libusby_interface * interface;
 } libusby_config_descriptor;
 
-/*typedef enum libusby_transfer_flags
+typedef enum libusby_option
+{
+	/* The number of event loops (reaper shards) the context runs, 1 by default.
+	 * Each open handle is reaped by exactly one of them. Can only be changed
+	 * while no handle is open and no event loop is running. */
+	LIBUSBY_OPTION_EVENT_LOOP_SHARDS,
+
+	/* The mechanism the event loops use to wait for completions, one of
+	 * `libusby_event_engine`. The same restrictions as for the shard count apply. */
+	LIBUSBY_OPTION_EVENT_ENGINE,
+
+	/* Preallocates the given number of transfers without isochronous packets,
+	 * so that `libusby_alloc_transfer` can recycle them instead of allocating. */
+	LIBUSBY_OPTION_TRANSFER_POOL_PREWARM,
+
+	/* Microseconds `libusby_wait_for_transfer` busy-polls the transfer's device
+	 * before it blocks, 0 (never) by default. Applies only to a thread that runs
+	 * the event loop itself, and trades CPU time for lower wakeup latency. */
+	LIBUSBY_OPTION_SPIN_WAIT_US,
+
+	/* The number of threads that run transfer callbacks instead of the event
+	 * loop, 0 (callbacks run on the loop) by default. Callbacks for the same
+	 * endpoint still run one at a time and in completion order. A batch
+	 * callback is always run by the loop. The same restrictions as for
+	 * the shard count apply. */
+	LIBUSBY_OPTION_CALLBACK_THREADS,
+
+	/* A socket hotplug monitoring reads kernel uevents from instead of opening
+	 * a netlink one, -1 by default. Meant for feeding it uevents through
+	 * a socketpair in tests, the caller keeps owning the socket. Can only
+	 * be set before the first hotplug callback is registered. */
+	LIBUSBY_OPTION_HOTPLUG_SOURCE_FD,
+} libusby_option;
+
+typedef enum libusby_event_engine
+{
+	LIBUSBY_EVENT_ENGINE_DEFAULT,
+	LIBUSBY_EVENT_ENGINE_EPOLL,
+	LIBUSBY_EVENT_ENGINE_IO_URING,
+} libusby_event_engine;
+
+typedef enum libusby_transfer_flags
 {
-	LIBUSBY_TRANSFER_SHORT_NOT_OK    = (1<<0),
+	/*LIBUSBY_TRANSFER_SHORT_NOT_OK    = (1<<0),
 	LIBUSBY_TRANSFER_FREE_BUFFER     = (1<<1),
-	LIBUSBY_TRANSFER_FREE_TRANSFER   = (1<<2),
+	LIBUSBY_TRANSFER_FREE_TRANSFER   = (1<<2),*/
+
+	/* Terminates a bulk OUT transfer whose length is a multiple
+	 * of the max packet size with a zero-length packet. */
 	LIBUSBY_TRANSFER_ADD_ZERO_PACKET = (1<<3),
-} libusby_transfer_flags;*/
+} libusby_transfer_flags;
 
 /* Library initialization/exit */
 int libusby_init(libusby_context ** ctx);
 void libusby_exit(libusby_context * ctx);
+int libusby_set_option(libusby_context * ctx, libusby_option option, int value);
 
 /* Device handling and enumeration */
 int libusby_get_device_list(libusby_context * ctx, libusby_device *** list);
@@ -171,9 +304,29 @@ void libusby_unref_device(libusby_device * dev);
 
 int libusby_open(libusby_device * dev, libusby_device_handle ** dev_handle);
 libusby_device_handle * libusby_open_device_with_vid_pid(libusby_context * ctx, uint16_t vendor_id, uint16_t product_id);
+/* May be called from a transfer's callback, once no other transfer of the handle is pending. */
 void libusby_close(libusby_device_handle * dev_handle);
+/* Refuses further submissions on the handle, cancels all its transfers and waits
+ * until each has been handed back with its callback returned or through its queue,
+ * running the event loop if no one else does. The handle is closed even if that
+ * fails. Must not be called from a callback of one of the handle's transfers. */
+int libusby_close_drain(libusby_device_handle * dev_handle);
 libusby_device * libusby_get_device(libusby_device_handle * dev_handle);
 
+/* Handles are spread over the shards as they are opened. A handle can be moved
+ * to another shard as long as it has no transfers in flight, submissions made
+ * while it is being moved fail with `LIBUSBY_ERROR_BUSY`. */
+int libusby_set_handle_shard(libusby_device_handle * dev_handle, int shard);
+int libusby_get_handle_shard(libusby_device_handle * dev_handle);
+
+/* Allocates a buffer the device can transfer to and from without an intermediate copy.
+ * Plain heap memory is returned if the backend cannot provide one. Buffers are freed
+ * with `libusby_dev_mem_free` through any open handle of the context. A buffer the
+ * device provided is released as its handle is closed, freeing it afterwards
+ * fails with `LIBUSBY_ERROR_NOT_FOUND`. */
+uint8_t * libusby_dev_mem_alloc(libusby_device_handle * dev_handle, size_t length);
+int libusby_dev_mem_free(libusby_device_handle * dev_handle, uint8_t * buffer, size_t length);
+
 int libusby_get_configuration(libusby_device_handle * dev_handle, int * config_value);
 int libusby_get_configuration_cached(libusby_device_handle * dev_handle, int * config_value);
 int libusby_set_configuration(libusby_device_handle * dev_handle, int config_value);
@@ -188,6 +341,7 @@ int libusby_reset_device(libusby_device_handle * dev_handle);
 /* USB descriptors */
 int libusby_get_device_descriptor_cached(libusby_device * dev, libusby_device_descriptor * desc);
 int libusby_get_config_descriptor_cached(libusby_device * dev, uint8_t config_index, libusby_config_descriptor ** config);
+int libusby_get_max_packet_size(libusby_device * dev, libusby_endpoint_t endpoint);
 
 int libusby_get_device_descriptor(libusby_device_handle * dev_handle, libusby_device_descriptor * desc);
 int libusby_get_active_config_descriptor(libusby_device_handle * dev_handle, libusby_config_descriptor ** config);
@@ -202,10 +356,37 @@ int libusby_get_string_descriptor_utf8(libusby_device_handle * dev_handle, uint8
 /* Asynchronous device I/O */
 libusby_transfer * libusby_alloc_transfer(libusby_context * ctx, int iso_packets);
 void libusby_free_transfer(libusby_transfer * transfer);
+int libusby_get_transfer_pool_stats(libusby_context * ctx, libusby_transfer_pool_stats * stats);
 int libusby_submit_transfer(libusby_transfer * transfer);
+
+/* Submits the transfers in order, stopping at the first failure, whose error
+ * is returned; `submitted` receives the number of transfers submitted before it.
+ * The usbfs backend validates all of them first and submits none if any is invalid. */
+int libusby_submit_transfers(libusby_transfer ** transfers, int count, int * submitted);
+
+/* Completion queues collect finished transfers for the application to pick up,
+ * so that no callback runs on the event loop. A queue should have room for all
+ * transfers posted to it that can complete before it is drained; completions
+ * that do not fit are kept in a slower overflow list. */
+int libusby_completion_queue_open(libusby_completion_queue ** queue, libusby_context * ctx, int capacity);
+void libusby_completion_queue_close(libusby_completion_queue * queue);
+
+/* Makes the transfer's completions go to the queue instead of its callback,
+ * pass NULL to restore the callback. A queued transfer is complete once it is
+ * retrieved and must not be waited for with `libusby_wait_for_transfer`. */
+int libusby_set_transfer_queue(libusby_transfer * transfer, libusby_completion_queue * queue);
+
+/* Retrieves up to `max` completed transfers and returns their number. Waits
+ * for at least one for up to `timeout` milliseconds, forever if negative.
+ * Can be called from any number of threads. */
+int libusby_poll_completions(libusby_completion_queue * queue, libusby_transfer ** transfers, int max, int timeout);
 int libusby_wait_for_transfer(libusby_transfer * transfer); // XXX: perhaps this shouldn't return error?
 int libusby_perform_transfer(libusby_transfer * transfer);
 int libusby_cancel_transfer(libusby_transfer * transfer);
+/* Cancel every transfer in flight on the endpoint or on the whole handle
+ * and return the number of transfers cancelled. */
+int libusby_cancel_endpoint(libusby_device_handle * dev_handle, libusby_endpoint_t endpoint);
+int libusby_cancel_all(libusby_device_handle * dev_handle);
 uint8_t * libusby_control_transfer_get_data(libusby_transfer * transfer);
 void libusby_fill_control_setup(uint8_t * buffer, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength);
 void libusby_fill_control_transfer(libusby_transfer * transfer, libusby_device_handle * dev_handle, uint8_t * buffer, libusby_transfer_cb_fn callback, void * user_data, libusby_timeout_t timeout);
@@ -214,16 +395,94 @@ void libusby_fill_bulk_transfer(libusby_transfer * transfer, libusby_device_hand
 void libusby_fill_interrupt_transfer(libusby_transfer * transfer, libusby_device_handle * dev_handle, libusby_endpoint_t endpoint,
 	uint8_t * buffer, int length, libusby_transfer_cb_fn callback, void * user_data, libusby_timeout_t timeout);
 
+/* Isochronous transfers need a transfer allocated with at least `num_iso_packets` packets.
+ * The packets are laid out back to back in the buffer. */
+void libusby_fill_iso_transfer(libusby_transfer * transfer, libusby_device_handle * dev_handle, libusby_endpoint_t endpoint, uint8_t * buffer, int length,
+	int num_iso_packets, libusby_transfer_cb_fn callback, void * user_data, libusby_timeout_t timeout);
+void libusby_set_iso_packet_lengths(libusby_transfer * transfer, int length);
+uint8_t * libusby_get_iso_packet_buffer(libusby_transfer * transfer, int packet);
+
 /* Synchronous device I/O */
 int libusby_control_transfer(libusby_device_handle * dev_handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t * data, uint16_t wLength, libusby_timeout_t timeout);
 int libusby_bulk_transfer(libusby_device_handle * dev_handle, libusby_endpoint_t endpoint, uint8_t * data, int length, int * transferred, libusby_timeout_t timeout);
 int libusby_interrupt_transfer(libusby_device_handle * dev_handle, libusby_endpoint_t endpoint, uint8_t * data, int length, int * transferred, libusby_timeout_t timeout);
 
+/* Streaming from an IN endpoint. The stream keeps `transfer_count` transfers in flight
+ * over a pool of `buffer_count` buffers and resubmits them from the event loop.
+ * Completed buffers are read by a single consumer thread, which gives them back
+ * with `libusby_stream_release`. A buffer whose status isn't `LIBUSBY_TRANSFER_COMPLETED`
+ * means its transfer stopped. The stream relies on per-transfer callbacks,
+ * so a batch callback must forward to them. */
+int libusby_stream_open(libusby_stream ** stream, libusby_device_handle * dev_handle, libusby_endpoint_t endpoint, int buffer_length, int buffer_count, int transfer_count);
+void libusby_stream_close(libusby_stream * stream);
+int libusby_stream_start(libusby_stream * stream);
+void libusby_stream_stop(libusby_stream * stream);
+
+/* Returns `LIBUSBY_ERROR_TIMEOUT` if `block` is zero and no buffer is ready, and
+ * `LIBUSBY_ERROR_INTERRUPTED` if blocking but no transfer is left in flight. */
+int libusby_stream_read(libusby_stream * stream, libusby_stream_buffer ** buffer, int block);
+void libusby_stream_release(libusby_stream * stream, libusby_stream_buffer * buffer);
+void libusby_stream_get_stats(libusby_stream * stream, libusby_stream_stats * stats);
+
+/* Writing to an OUT endpoint. Small writes are gathered into buffers of `buffer_length`,
+ * rounded down to a multiple of the max packet size, and up to `buffer_count` of them
+ * are kept in flight. A buffer is submitted when it is full, when nothing else is in flight,
+ * when its oldest data is `flush_timeout` ms old (zero disables it), or when explicitly
+ * flushed. Writers are meant for a single producer thread. */
+int libusby_writer_open(libusby_writer ** writer, libusby_device_handle * dev_handle, libusby_endpoint_t endpoint, int buffer_length, int buffer_count,
+	libusby_timeout_t flush_timeout);
+
+/* Drains the writer before closing it. */
+void libusby_writer_close(libusby_writer * writer);
+
+/* Never blocks. Returns the number of bytes accepted, which is less than `length`
+ * when every buffer is in flight, or an error if a previous transfer failed. */
+int libusby_writer_write(libusby_writer * writer, uint8_t const * data, int length);
+
+/* Submits the gathered data, terminated with a zero-length packet if needed.
+ * Returns `LIBUSBY_ERROR_BUSY` if no buffer is available for that packet. */
+int libusby_writer_flush(libusby_writer * writer);
+
+/* Flushes and waits for everything written to be transferred. */
+int libusby_writer_drain(libusby_writer * writer);
+
 /* Event loop */
+
+/* Runs the event loops of all shards until `libusby_stop_event_loop` is called.
+ * The calling thread serves the first shard, a thread is started for each of the others. */
 int libusby_run_event_loop(libusby_context * ctx);
+
+/* Starts a thread that runs `libusby_run_event_loop` with the given affinity
+ * and scheduling, which the threads of further shards inherit.
+ * `libusby_stop_event_loop` stops and joins it. Returns `LIBUSBY_ERROR_ACCESS`
+ * if the process lacks the privilege for the requested policy or memory locking,
+ * and `LIBUSBY_ERROR_BUSY` if the thread is already running. */
+int libusby_start_event_thread(libusby_context * ctx, libusby_thread_attrs const * attrs);
 void libusby_stop_event_loop(libusby_context * ctx);
 void libusby_reset_event_loop(libusby_context * ctx);
 
+/* When set, the batch callback is invoked instead of the callbacks of individual transfers.
+ * Pass NULL to restore the per-transfer callbacks. */
+void libusby_set_batch_callback(libusby_context * ctx, libusby_batch_cb_fn callback, void * user_data);
+int libusby_get_event_loop_stats(libusby_context * ctx, libusby_event_loop_stats * stats);
+
+/* Replaces the clock against which transfer timeouts are measured, pass NULL
+ * to restore the system's monotonic clock. Fails with `LIBUSBY_ERROR_BUSY` while
+ * transfers with a timeout are in flight. A clock set here is read when transfers
+ * are submitted and when `libusby_clock_advanced` is called, which must follow
+ * each change of its time for deadlines that have passed to expire. */
+int libusby_set_clock(libusby_context * ctx, libusby_clock_fn clock, void * user_data);
+int libusby_clock_advanced(libusby_context * ctx);
+
+/* The first registration starts monitoring kernel uevents, which continues until
+ * the context exits. The first shard's event loop must run for callbacks to be called.
+ * It also keeps the context's list of devices current, which `libusby_get_device_list`
+ * then returns without rescanning. Match arguments are either `LIBUSBY_HOTPLUG_MATCH_ANY`
+ * or a value of the device descriptor's field. */
+int libusby_hotplug_register_callback(libusby_context * ctx, int events, int flags, int vendor_id, int product_id, int dev_class,
+	libusby_hotplug_callback_fn callback, void * user_data, libusby_hotplug_callback_handle * handle);
+void libusby_hotplug_deregister_callback(libusby_context * ctx, libusby_hotplug_callback_handle handle);
+
 #ifdef __cplusplus
 }
 #endif
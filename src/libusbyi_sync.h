@@ -0,0 +1,191 @@
+#ifndef LIBUSBY_LIBUSBYI_SYNC_H
+#define LIBUSBY_LIBUSBYI_SYNC_H
+
+/* Threading primitives for the parts of the library built on the public transfer API,
+ * which run on top of every backend. */
+
+#include <stdint.h>
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+typedef CRITICAL_SECTION usbyi_mutex;
+typedef CONDITION_VARIABLE usbyi_cond;
+typedef HANDLE usbyi_thread;
+
+static __inline int usbyi_mutex_init(usbyi_mutex * mutex)
+{
+	InitializeCriticalSection(mutex);
+	return 0;
+}
+
+static __inline void usbyi_mutex_destroy(usbyi_mutex * mutex)
+{
+	DeleteCriticalSection(mutex);
+}
+
+static __inline void usbyi_mutex_lock(usbyi_mutex * mutex)
+{
+	EnterCriticalSection(mutex);
+}
+
+static __inline void usbyi_mutex_unlock(usbyi_mutex * mutex)
+{
+	LeaveCriticalSection(mutex);
+}
+
+static __inline int usbyi_cond_init(usbyi_cond * cond)
+{
+	InitializeConditionVariable(cond);
+	return 0;
+}
+
+static __inline void usbyi_cond_destroy(usbyi_cond * cond)
+{
+	(void)cond;
+}
+
+static __inline void usbyi_cond_wait(usbyi_cond * cond, usbyi_mutex * mutex)
+{
+	SleepConditionVariableCS(cond, mutex, INFINITE);
+}
+
+static __inline void usbyi_cond_timedwait(usbyi_cond * cond, usbyi_mutex * mutex, uint64_t timeout_ms)
+{
+	SleepConditionVariableCS(cond, mutex, (DWORD)timeout_ms);
+}
+
+static __inline void usbyi_cond_broadcast(usbyi_cond * cond)
+{
+	WakeAllConditionVariable(cond);
+}
+
+static __inline uint64_t usbyi_now_ms(void)
+{
+	return GetTickCount64();
+}
+
+static __inline int usbyi_thread_create(usbyi_thread * thread, DWORD (WINAPI * fn)(void *), void * arg)
+{
+	*thread = CreateThread(NULL, 0, fn, arg, 0, NULL);
+	return *thread? 0: -1;
+}
+
+static __inline void usbyi_thread_join(usbyi_thread thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+#define USBYI_THREAD_PROC(name, arg) DWORD WINAPI name(void * arg)
+#define USBYI_THREAD_RETURN return 0
+
+#define usbyi_atomic_load(ptr) InterlockedCompareExchange((LONG volatile *)(ptr), 0, 0)
+#define usbyi_atomic_store(ptr, value) InterlockedExchange((LONG volatile *)(ptr), (value))
+#define usbyi_atomic_add(ptr, value) (InterlockedExchangeAdd((LONG volatile *)(ptr), (value)) + (value))
+#define usbyi_atomic_load64(ptr) ((uint64_t)InterlockedCompareExchange64((LONGLONG volatile *)(ptr), 0, 0))
+#define usbyi_atomic_add64(ptr, value) InterlockedExchangeAdd64((LONGLONG volatile *)(ptr), (value))
+
+#else
+
+#include <pthread.h>
+#include <time.h>
+
+typedef pthread_mutex_t usbyi_mutex;
+typedef pthread_cond_t usbyi_cond;
+typedef pthread_t usbyi_thread;
+
+static __inline int usbyi_mutex_init(usbyi_mutex * mutex)
+{
+	return pthread_mutex_init(mutex, 0);
+}
+
+static __inline void usbyi_mutex_destroy(usbyi_mutex * mutex)
+{
+	pthread_mutex_destroy(mutex);
+}
+
+static __inline void usbyi_mutex_lock(usbyi_mutex * mutex)
+{
+	pthread_mutex_lock(mutex);
+}
+
+static __inline void usbyi_mutex_unlock(usbyi_mutex * mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
+/* The condition waits on the monotonic clock, like `usbyi_now_ms`. */
+static __inline int usbyi_cond_init(usbyi_cond * cond)
+{
+	pthread_condattr_t attr;
+	int r;
+
+	if (pthread_condattr_init(&attr) != 0)
+		return -1;
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	r = pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return r;
+}
+
+static __inline void usbyi_cond_destroy(usbyi_cond * cond)
+{
+	pthread_cond_destroy(cond);
+}
+
+static __inline void usbyi_cond_wait(usbyi_cond * cond, usbyi_mutex * mutex)
+{
+	pthread_cond_wait(cond, mutex);
+}
+
+static __inline void usbyi_cond_timedwait(usbyi_cond * cond, usbyi_mutex * mutex, uint64_t timeout_ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000)
+	{
+		++ts.tv_sec;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(cond, mutex, &ts);
+}
+
+static __inline void usbyi_cond_broadcast(usbyi_cond * cond)
+{
+	pthread_cond_broadcast(cond);
+}
+
+static __inline uint64_t usbyi_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static __inline int usbyi_thread_create(usbyi_thread * thread, void * (* fn)(void *), void * arg)
+{
+	return pthread_create(thread, 0, fn, arg);
+}
+
+static __inline void usbyi_thread_join(usbyi_thread thread)
+{
+	pthread_join(thread, 0);
+}
+
+#define USBYI_THREAD_PROC(name, arg) void * name(void * arg)
+#define USBYI_THREAD_RETURN return 0
+
+#define usbyi_atomic_load(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define usbyi_atomic_store(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_SEQ_CST)
+#define usbyi_atomic_add(ptr, value) __atomic_add_fetch((ptr), (value), __ATOMIC_SEQ_CST)
+#define usbyi_atomic_load64(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define usbyi_atomic_add64(ptr, value) __atomic_add_fetch((ptr), (value), __ATOMIC_RELAXED)
+
+#endif
+
+#endif // LIBUSBY_LIBUSBYI_SYNC_H
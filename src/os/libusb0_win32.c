@@ -34,6 +34,9 @@ struct libusby_context
 	HANDLE hReaperLock;
 	HANDLE hEventLoopStopped;
 	HANDLE hTransferListUpdated;
+
+	libusby_batch_cb_fn batch_callback;
+	void * batch_user_data;
 };
 
 struct usbyb_device
@@ -144,6 +147,21 @@ void usbyb_exit(usbyb_context * ctx)
 	FreeLibrary(ctx->hKernel32);
 }
 
+int usbyb_set_option(usbyb_context * ctx, libusby_option option, int value)
+{
+	(void)ctx;
+
+	switch (option)
+	{
+	case LIBUSBY_OPTION_EVENT_LOOP_SHARDS:
+		return value == 1? LIBUSBY_SUCCESS: LIBUSBY_ERROR_NOT_SUPPORTED;
+	case LIBUSBY_OPTION_EVENT_ENGINE:
+		return value == LIBUSBY_EVENT_ENGINE_DEFAULT? LIBUSBY_SUCCESS: LIBUSBY_ERROR_NOT_SUPPORTED;
+	default:
+		return LIBUSBY_ERROR_NOT_SUPPORTED;
+	}
+}
+
 static int usbyb_get_descriptor_with_handle(HANDLE hFile, uint8_t desc_type, uint8_t desc_index, uint16_t langid, unsigned char * data, int length)
 {
 	libusb0_win32_request req = { default_timeout };
@@ -383,6 +401,59 @@ int usbyb_perform_transfer(usbyb_transfer * tran)
 	return LIBUSBY_SUCCESS;
 }
 
+int usbyb_submit_transfers(libusby_transfer ** transfers, int count, int * submitted)
+{
+	for (*submitted = 0; *submitted < count; ++*submitted)
+	{
+		int r = usbyb_submit_transfer(usbyi_get_tran(transfers[*submitted]));
+		if (r < 0)
+			return r;
+	}
+	return LIBUSBY_SUCCESS;
+}
+
+int usbyb_completion_queue_open(libusby_completion_queue ** queue, usbyb_context * ctx, int capacity)
+{
+	(void)queue;
+	(void)ctx;
+	(void)capacity;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
+void usbyb_completion_queue_close(libusby_completion_queue * queue)
+{
+	(void)queue;
+}
+
+int usbyb_set_transfer_queue(usbyb_transfer * tran, libusby_completion_queue * queue)
+{
+	(void)tran;
+	(void)queue;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
+int usbyb_poll_completions(libusby_completion_queue * queue, libusby_transfer ** transfers, int max, int timeout)
+{
+	(void)queue;
+	(void)transfers;
+	(void)max;
+	(void)timeout;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
+int usbyb_control_transfer(usbyb_device_handle * dev_handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t * data, uint16_t wLength, libusby_timeout_t timeout)
+{
+	(void)dev_handle;
+	(void)bmRequestType;
+	(void)bRequest;
+	(void)wValue;
+	(void)wIndex;
+	(void)data;
+	(void)wLength;
+	(void)timeout;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
 int usbyb_submit_transfer(usbyb_transfer * tran)
 {
 	usbyb_device * dev = tran->pub.dev_handle->dev;
@@ -458,6 +529,19 @@ int usbyb_cancel_transfer(usbyb_transfer * tran)
 	return LIBUSBY_SUCCESS;
 }
 
+int usbyb_cancel_endpoint(usbyb_device_handle * dev_handle, libusby_endpoint_t endpoint)
+{
+	(void)dev_handle;
+	(void)endpoint;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
+int usbyb_cancel_all(usbyb_device_handle * dev_handle)
+{
+	(void)dev_handle;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
 void usbyb_reap_transfer(usbyb_transfer * tran)
 {
 	usbyb_device * dev = tran->pub.dev_handle->dev;
@@ -486,8 +570,15 @@ void usbyb_reap_transfer(usbyb_transfer * tran)
 	tran->submitted = 0;
 	LeaveCriticalSection(&ctx->ctx_mutex);
 
-	if (tran->pub.callback)
+	if (ctx->batch_callback)
+	{
+		libusby_transfer * batch = &tran->pub;
+		ctx->batch_callback(&batch, 1, ctx->batch_user_data);
+	}
+	else if (tran->pub.callback)
+	{
 		tran->pub.callback(&tran->pub);
+	}
 
 	EnterCriticalSection(&ctx->ctx_mutex);
 	if (!tran->submitted)
@@ -506,6 +597,40 @@ void usbyb_close(usbyb_device_handle * dev_handle)
 	(void)dev_handle;
 }
 
+int usbyb_drain(usbyb_device_handle * dev_handle)
+{
+	(void)dev_handle;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
+int usbyb_set_handle_shard(usbyb_device_handle * dev_handle, int shard)
+{
+	(void)dev_handle;
+	return shard == 0? LIBUSBY_SUCCESS: LIBUSBY_ERROR_INVALID_PARAM;
+}
+
+int usbyb_get_handle_shard(usbyb_device_handle * dev_handle)
+{
+	(void)dev_handle;
+	return 0;
+}
+
+int usbyb_dev_mem_alloc(usbyb_device_handle * dev_handle, size_t length, uint8_t ** buffer)
+{
+	(void)dev_handle;
+	(void)length;
+	(void)buffer;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
+int usbyb_dev_mem_free(usbyb_device_handle * dev_handle, uint8_t * buffer, size_t length)
+{
+	(void)dev_handle;
+	(void)buffer;
+	(void)length;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
 int usbyb_init_transfer(usbyb_transfer * tran)
 {
 	tran->hCompletionEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
@@ -529,6 +654,27 @@ void usbyb_clear_transfer(usbyb_transfer * tran)
 	CloseHandle(tran->hCompletionEvent);
 }
 
+int usbyb_alloc_transfer(usbyb_context * ctx, int iso_packets, usbyb_transfer ** tran)
+{
+	(void)ctx;
+	(void)iso_packets;
+	(void)tran;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
+int usbyb_free_transfer(usbyb_transfer * tran)
+{
+	(void)tran;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
+int usbyb_get_transfer_pool_stats(usbyb_context * ctx, libusby_transfer_pool_stats * stats)
+{
+	(void)ctx;
+	(void)stats;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
 static void usbyi_free_handle_list(usbyi_handle_list * handle_list)
 {
 	free(handle_list->handles);
@@ -641,6 +787,13 @@ int usbyb_run_event_loop(usbyb_context * ctx)
 	return usbyi_win32_reap_until(ctx, ctx->hEventLoopStopped);
 }
 
+int usbyb_start_event_thread(usbyb_context * ctx, libusby_thread_attrs const * attrs)
+{
+	(void)ctx;
+	(void)attrs;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
 void usbyb_stop_event_loop(usbyb_context * ctx)
 {
 	SetEvent(ctx->hEventLoopStopped);
@@ -650,3 +803,53 @@ void usbyb_reset_event_loop(usbyb_context * ctx)
 {
 	ResetEvent(ctx->hEventLoopStopped);
 }
+
+void usbyb_set_batch_callback(usbyb_context * ctx, libusby_batch_cb_fn callback, void * user_data)
+{
+	EnterCriticalSection(&ctx->ctx_mutex);
+	ctx->batch_callback = callback;
+	ctx->batch_user_data = user_data;
+	LeaveCriticalSection(&ctx->ctx_mutex);
+}
+
+int usbyb_get_event_loop_stats(usbyb_context * ctx, libusby_event_loop_stats * stats)
+{
+	(void)ctx;
+	(void)stats;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
+int usbyb_set_clock(usbyb_context * ctx, libusby_clock_fn clock, void * user_data)
+{
+	(void)ctx;
+	(void)clock;
+	(void)user_data;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
+int usbyb_clock_advanced(usbyb_context * ctx)
+{
+	(void)ctx;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
+int usbyb_hotplug_register_callback(usbyb_context * ctx, int events, int flags, int vendor_id, int product_id, int dev_class,
+	libusby_hotplug_callback_fn callback, void * user_data, libusby_hotplug_callback_handle * handle)
+{
+	(void)ctx;
+	(void)events;
+	(void)flags;
+	(void)vendor_id;
+	(void)product_id;
+	(void)dev_class;
+	(void)callback;
+	(void)user_data;
+	(void)handle;
+	return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
+void usbyb_hotplug_deregister_callback(usbyb_context * ctx, libusby_hotplug_callback_handle handle)
+{
+	(void)ctx;
+	(void)handle;
+}
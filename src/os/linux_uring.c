@@ -0,0 +1,271 @@
+#include "linux_uring.h"
+#include "../libusby.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdlib.h>
+
+/* Once removed, the token is cleared and the watch is only kept around
+ * until the kernel acknowledges the poll has been terminated. */
+struct usbfs_uring_watch
+{
+    void * token;
+    int fd;
+    unsigned events;
+
+    usbfs_uring_watch * next;
+    usbfs_uring_watch * prev;
+};
+
+static int usbfs_uring_setup(unsigned entries, struct io_uring_params * params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int usbfs_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int usbfs_uring_init(usbfs_uring * ring, unsigned entries)
+{
+    struct io_uring_params params;
+    char * sq_ring;
+    char * cq_ring;
+
+    memset(ring, 0, sizeof *ring);
+    memset(&params, 0, sizeof params);
+
+    ring->fd = usbfs_uring_setup(entries, &params);
+    if (ring->fd < 0)
+        return LIBUSBY_ERROR_NOT_SUPPORTED;
+
+    /* Multishot poll needs the ring to never drop completions. */
+    if ((params.features & IORING_FEAT_NODROP) == 0)
+        goto error_fd;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = 0;
+    }
+
+    ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto error_fd;
+
+    if (ring->cq_ring_size)
+    {
+        ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            goto error_sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+
+    ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto error_cq_ring;
+
+    if (pthread_mutex_init(&ring->sq_mutex, 0) != 0)
+        goto error_sqes;
+
+    sq_ring = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+
+    cq_ring = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+    return LIBUSBY_SUCCESS;
+
+error_sqes:
+    munmap(ring->sqes, ring->sqes_size);
+
+error_cq_ring:
+    if (ring->cq_ring_size)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+
+error_sq_ring:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+
+error_fd:
+    close(ring->fd);
+    return LIBUSBY_ERROR_NOT_SUPPORTED;
+}
+
+void usbfs_uring_exit(usbfs_uring * ring)
+{
+    while (ring->watches)
+    {
+        usbfs_uring_watch * watch = ring->watches;
+        ring->watches = watch->next;
+        free(watch);
+    }
+
+    pthread_mutex_destroy(&ring->sq_mutex);
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_size)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/* Must be called with `sq_mutex` held; the entry is submitted by `usbfs_uring_submit`. */
+static struct io_uring_sqe * usbfs_uring_get_sqe(usbfs_uring * ring)
+{
+    unsigned tail = *ring->sq_tail;
+    struct io_uring_sqe * sqe;
+
+    /* Entries are submitted one by one as they are queued, the ring is never full. */
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask)
+        return 0;
+
+    sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    return sqe;
+}
+
+static int usbfs_uring_submit(usbfs_uring * ring)
+{
+    int r;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+
+    do
+        r = usbfs_uring_enter(ring->fd, 1, 0, 0);
+    while (r < 0 && errno == EINTR);
+
+    return r < 0? LIBUSBY_ERROR_NO_MEM: LIBUSBY_SUCCESS;
+}
+
+/* Must be called with `sq_mutex` held. */
+static int usbfs_uring_poll_add(usbfs_uring * ring, usbfs_uring_watch * watch)
+{
+    struct io_uring_sqe * sqe = usbfs_uring_get_sqe(ring);
+    if (!sqe)
+        return LIBUSBY_ERROR_NO_MEM;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = watch->fd;
+    sqe->poll32_events = watch->events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = (uintptr_t)watch;
+    return usbfs_uring_submit(ring);
+}
+
+/* Must be called with `sq_mutex` held. */
+static void usbfs_uring_free_watch(usbfs_uring * ring, usbfs_uring_watch * watch)
+{
+    if (watch->next)
+        watch->next->prev = watch->prev;
+    if (watch->prev)
+        watch->prev->next = watch->next;
+    else
+        ring->watches = watch->next;
+    free(watch);
+}
+
+usbfs_uring_watch * usbfs_uring_watch_fd(usbfs_uring * ring, int fd, unsigned events, void * token)
+{
+    usbfs_uring_watch * watch = malloc(sizeof *watch);
+    if (!watch)
+        return 0;
+
+    watch->token = token;
+    watch->fd = fd;
+    watch->events = events;
+
+    pthread_mutex_lock(&ring->sq_mutex);
+    if (usbfs_uring_poll_add(ring, watch) < 0)
+    {
+        pthread_mutex_unlock(&ring->sq_mutex);
+        free(watch);
+        return 0;
+    }
+
+    watch->prev = 0;
+    watch->next = ring->watches;
+    if (ring->watches)
+        ring->watches->prev = watch;
+    ring->watches = watch;
+    pthread_mutex_unlock(&ring->sq_mutex);
+    return watch;
+}
+
+void usbfs_uring_unwatch(usbfs_uring * ring, usbfs_uring_watch * watch)
+{
+    struct io_uring_sqe * sqe;
+
+    pthread_mutex_lock(&ring->sq_mutex);
+    __atomic_store_n(&watch->token, 0, __ATOMIC_SEQ_CST);
+
+    /* The remove request itself completes with a zero `user_data`, which is ignored.
+     * Should the request fail to be queued, the poll lingers until the ring is destroyed. */
+    sqe = usbfs_uring_get_sqe(ring);
+    if (sqe)
+    {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)watch;
+        sqe->user_data = 0;
+        usbfs_uring_submit(ring);
+    }
+    pthread_mutex_unlock(&ring->sq_mutex);
+}
+
+int usbfs_uring_wait(usbfs_uring * ring, void ** tokens, int max)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    int count = 0;
+
+    if (head == tail)
+    {
+        if (usbfs_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+            return LIBUSBY_ERROR_IO;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    for (; head != tail && count < max; ++head)
+    {
+        struct io_uring_cqe * cqe = &ring->cqes[head & ring->cq_mask];
+        usbfs_uring_watch * watch = (usbfs_uring_watch *)(uintptr_t)cqe->user_data;
+        void * token;
+
+        if (!watch)
+            continue;
+
+        token = __atomic_load_n(&watch->token, __ATOMIC_SEQ_CST);
+        if (token && cqe->res > 0)
+            tokens[count++] = token;
+
+        /* The multishot poll has terminated; re-arm it, unless it was removed. */
+        if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+        {
+            pthread_mutex_lock(&ring->sq_mutex);
+            if (!watch->token)
+                usbfs_uring_free_watch(ring, watch);
+            else
+                usbfs_uring_poll_add(ring, watch);
+            pthread_mutex_unlock(&ring->sq_mutex);
+        }
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
@@ -0,0 +1,52 @@
+#ifndef LIBUSBY_OS_LINUX_URING_H
+#define LIBUSBY_OS_LINUX_URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+
+typedef struct usbfs_uring_watch usbfs_uring_watch;
+
+/* A minimal io_uring wrapper, just enough to get multishot poll
+ * notifications for a set of file descriptors. Watches may be added
+ * and removed from any thread, but only one thread may wait. */
+typedef struct usbfs_uring
+{
+    int fd;
+
+    /* Protects the submission queue and the list of watches. */
+    pthread_mutex_t sq_mutex;
+    usbfs_uring_watch * watches;
+
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned sq_mask;
+    unsigned * sq_array;
+    struct io_uring_sqe * sqes;
+
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe * cqes;
+
+    void * sq_ring;
+    size_t sq_ring_size;
+    void * cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} usbfs_uring;
+
+int usbfs_uring_init(usbfs_uring * ring, unsigned entries);
+void usbfs_uring_exit(usbfs_uring * ring);
+
+/* The token is reported by `usbfs_uring_wait` whenever the fd becomes ready. */
+usbfs_uring_watch * usbfs_uring_watch_fd(usbfs_uring * ring, int fd, unsigned events, void * token);
+void usbfs_uring_unwatch(usbfs_uring * ring, usbfs_uring_watch * watch);
+
+/* Blocks until at least one completion is available and stores the tokens
+ * of the ready watches. Returns their count, which is zero if interrupted
+ * or if only bookkeeping completions arrived. */
+int usbfs_uring_wait(usbfs_uring * ring, void ** tokens, int max);
+
+#endif // LIBUSBY_OS_LINUX_URING_H
@@ -1,42 +1,230 @@
+#define _GNU_SOURCE
 #include "os.h"
+#include "linux_uring.h"
 #include "../libusbyi.h"
 #include <assert.h>
 #include <string.h>
 #include <stdint.h>
 
-#define _GNU_SOURCE
-#include <poll.h>
+#include <sys/epoll.h>
 #include <stddef.h>
 #include <dirent.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <stdio.h>
 #include <linux/usbdevice_fs.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <limits.h>
 #include <pthread.h>
 
-struct watched_fd
+#ifndef USBDEVFS_CAP_MMAP
+#define USBDEVFS_CAP_MMAP 0x20
+#endif
+
+#define USBFS_MAX_EVENTS 64
+
+/* Bulk transfers larger than this are split into several URBs. Kernels
+ * without USBDEVFS_CAP_NO_PACKET_SIZE_LIM reject larger URBs outright. */
+#define USBFS_BULK_CHUNK (16 * 1024)
+#define USBFS_BULK_CHUNK_NO_LIMIT (256 * 1024)
+#define USBFS_URING_ENTRIES 64
+
+typedef struct usbfs_shard
 {
-    int fd;
-    int refcount;
+    usbyb_context * ctx;
+
+    /* Protects the ownership of the shard's event loop. */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int loop_locked;
+    pthread_t loop_thread;
+    usbyb_transfer * waiters;
+    /* The transfer the loop thread runs the loop for, if any. */
+    usbyb_transfer * loop_watch;
+    /* The number of threads waiting in `usbyb_drain` for a handle of the shard. */
+    int drainers;
+    /* Bumped by the loop thread before each wait, once the events of the previous
+     * one have been handled. `quiescers` threads wait for it to change. */
+    unsigned loop_epoch;
+    int quiescers;
+
+    /* Either `uring` is set, or the shard waits on `epfd`. */
+    int epfd;
+    usbfs_uring * uring;
+    int evfd;
+    int wakeup_pending;
+    int handle_count;
+    libusby_event_loop_stats stats;
+
+    libusby_transfer ** batch;
+    int batch_capacity;
+
+    /* A min-heap of the in-flight transfers that have a timeout, keyed
+     * by their deadline. The timerfd is armed for the earliest one. */
+    pthread_mutex_t timer_mutex;
+    usbyb_transfer ** timers;
+    int timer_count;
+    int timer_capacity;
+    int tfd;
+    /* Set instead of rearming the timerfd when the earliest deadline changes
+     * on the loop thread, which rearms it before it next waits. */
+    int timer_rearm;
+} usbfs_shard;
+
+/* A lock-free bounded multi-producer multi-consumer queue of transfers. */
+typedef struct usbfs_ring_cell
+{
+    size_t seq;
+    usbyb_transfer * tran;
+} usbfs_ring_cell;
+
+typedef struct usbfs_ring
+{
+    usbfs_ring_cell * cells;
+    size_t capacity;
+    size_t push_pos;
+    size_t pop_pos;
+} usbfs_ring;
+
+/* Freed transfers are recycled through rings, one for each size class
+ * of isochronous packet counts. Larger transfers are not pooled. */
+#define USBFS_POOL_CLASSES 4
+#define USBFS_POOL_CAPACITY 256
+
+static int const usbfs_pool_class_packets[USBFS_POOL_CLASSES] = { 0, 8, 32, 128 };
+
+/* Completions of one endpoint whose callbacks are waiting for a dispatcher
+ * thread. At most one thread runs them at a time, which keeps them in order. */
+typedef struct usbfs_serial_queue
+{
+    usbyb_transfer * first;
+    usbyb_transfer * last;
+    /* Set while the queue is on the ready list or being run. */
+    int scheduled;
+    pthread_t runner;
+    /* Points at the runner's flag, set when a callback closes the handle.
+     * The runner no longer touches the queue afterwards. */
+    int * runner_closed;
+    struct usbfs_serial_queue * next_ready;
+} usbfs_serial_queue;
+
+typedef struct usbfs_dispatcher
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t ready_cond;
+    pthread_cond_t idle_cond;
+    usbfs_serial_queue * ready_first;
+    usbfs_serial_queue * ready_last;
+    pthread_t * threads;
+    int thread_count;
+    int stopping;
+} usbfs_dispatcher;
+
+struct libusby_completion_queue
+{
+    usbfs_ring ring;
+
+    /* Completions that did not fit into the ring. */
+    pthread_mutex_t overflow_mutex;
+    usbyb_transfer * overflow_first;
+    usbyb_transfer * overflow_last;
+    int overflow_count;
+
+    /* A futex word bumped after each completion, and the number of threads
+     * sleeping on it in `usbyb_poll_completions`. */
+    int seq;
+    int waiters;
 };
 
+typedef struct usbfs_hotplug_callback
+{
+    libusby_hotplug_callback_handle handle;
+    int events;
+    int vendor_id;
+    int product_id;
+    int dev_class;
+    libusby_hotplug_callback_fn callback;
+    void * user_data;
+
+    /* Set instead of unlinking the callback while callbacks are being run. */
+    int deregistered;
+    struct usbfs_hotplug_callback * next;
+} usbfs_hotplug_callback;
+
+/* A buffer handed out by `usbyb_dev_mem_alloc`, either mapped from `handle`
+ * or, if it is null, taken from the heap. */
+typedef struct usbfs_dev_buffer
+{
+    uint8_t * buffer;
+    size_t length;
+    usbyb_device_handle * handle;
+    struct usbfs_dev_buffer * next;
+} usbfs_dev_buffer;
+
 struct libusby_context
 {
     usbyi_device_list_node devlist_head;
 
+    /* Protects the device list and the shard table. Transfers are
+     * submitted and reaped without taking it. */
     pthread_mutex_t ctx_mutex;
-    pthread_cond_t ctx_cond;
     int loop_enabled;
-    int loop_locked;
-
-    struct watched_fd * watched_fds;
-    int watched_fd_count;
-    int watched_fd_capacity;
-
-    int pipe[2];
+    int running_loops;
+    int open_handles;
+
+    /* The loop thread started by `usbyb_start_event_thread`, if any,
+     * and whether the process's memory was locked for it and is to be
+     * unlocked when it stops. */
+    pthread_t event_thread;
+    int event_thread_started;
+    int memory_locked;
+
+    usbfs_shard * shards;
+    int shard_count;
+    libusby_event_engine engine;
+
+    libusby_batch_cb_fn batch_callback;
+    void * batch_user_data;
+
+    libusby_clock_fn clock;
+    void * clock_user_data;
+
+    /* Microseconds a thread waiting for its own transfer polls
+     * the handle before blocking in the event loop. */
+    int spin_wait_us;
+
+    /* Runs transfer callbacks off the event loop when it has any threads. */
+    usbfs_dispatcher dispatcher;
+
+    usbfs_ring pools[USBFS_POOL_CLASSES];
+    usbfs_ring_cell pool_cells[USBFS_POOL_CLASSES][USBFS_POOL_CAPACITY];
+    uint64_t pool_hits;
+    uint64_t pool_misses;
+
+    /* The socket uevents are read from, -1 until the first hotplug callback
+     * is registered. It is watched by the first shard's loop. The rest
+     * is guarded by `ctx_mutex`. */
+    int hotplug_fd;
+    int hotplug_source_fd;
+    usbfs_uring_watch * hotplug_watch;
+    usbfs_hotplug_callback * hotplug_callbacks;
+    libusby_hotplug_callback_handle hotplug_last_handle;
+    int hotplug_dispatching;
+
+    /* The buffers of `usbyb_dev_mem_alloc`, guarded by `ctx_mutex`. */
+    usbfs_dev_buffer * dev_buffers;
 };
 
 struct usbyb_device
@@ -49,23 +237,89 @@ struct usbyb_device
     int fd;
 
     uint8_t * desc_cache;
+
+    /* Set while the context holds a reference to the device on behalf of hotplug
+     * monitoring, from the device's arrival until it leaves. */
+    int hotplug_ref;
 };
 
 struct usbyb_device_handle
 {
     libusby_device_handle pub;
 
+    usbfs_shard * shard;
     int wrfd;
     int active_config_value;
+    int watched;
+    usbfs_uring_watch * uring_watch;
+    int inflight;
+
+    uint32_t caps;
+
+    /* Indexed by endpoint number, IN endpoints in the upper half; zero if the active
+     * configuration doesn't describe the endpoint. Guarded by `inflight_mutex`. */
+    uint16_t max_packet_size[32];
+
+    /* Indexed like `max_packet_size`, guarded by the dispatcher's mutex. */
+    usbfs_serial_queue serial_queues[32];
+
+    /* Transfers with URBs in the kernel, listed per endpoint and indexed
+     * like `max_packet_size`. Set `closing` or `moving` refuses further submissions,
+     * `closing` synchronous ioctls too. `sync_calls` counts those in progress, and
+     * `sync_cond` is signalled when the last one of a closing handle returns. */
+    pthread_mutex_t inflight_mutex;
+    pthread_cond_t sync_cond;
+    usbyb_transfer * inflight_transfers[32];
+    int closing;
+    int moving;
+    int sync_calls;
+    /* The number of submitted transfers not yet handed back to the user,
+     * either by their callback being about to run or by being posted to a queue.
+     * Released before the callback runs, which may close the handle. */
+    int pending;
 };
 
 struct usbyb_transfer
 {
     usbyi_transfer intrn;
 
-    pthread_cond_t cond;
+    /* 1 while in flight, 2 while in its callback or in a completion queue,
+     * and 0 once handed back to the user. */
     int active;
-    struct usbdevfs_urb req;
+    int waiting;
+    int handoff;
+    /* A futex word bumped whenever `active` or `handoff` change
+     * for the benefit of a waiting thread. */
+    int wake_seq;
+    /* Points either to `urb`, or to a buffer preallocated with room
+     * for the transfer's isochronous packet descriptors. */
+    struct usbdevfs_urb * req;
+    struct usbdevfs_urb urb;
+
+    /* Large bulk transfers are submitted as a chain of `urb_count` URBs
+     * from `urbs` instead. The array is kept for the next submission. */
+    struct usbdevfs_urb * urbs;
+    int urb_capacity;
+    int urb_count;
+    int urbs_pending;
+    int split_status;
+    int split_short;
+
+    uint64_t deadline;
+    int timer_index;
+    int timed_out;
+
+    /* The size class of the pool the transfer returns to when freed, or -1. */
+    int pool_class;
+
+    /* Where the transfer's completion is posted instead of calling back. */
+    libusby_completion_queue * queue;
+    /* Links completions waiting in an overflow list or a serial queue. */
+    usbyb_transfer * completion_next;
+
+    /* Links the transfer into its handle's `inflight_transfers`. */
+    usbyb_transfer * inflight_prev;
+    usbyb_transfer * inflight_next;
 
     libusby_transfer pub;
 };
@@ -78,461 +332,3266 @@ int const usbyb_transfer_pub_offset = offsetof(usbyb_transfer, pub);
 
 int usbyb_init_transfer(usbyb_transfer * tran)
 {
-    if (pthread_cond_init(&tran->cond, 0) != 0)
-        return LIBUSBY_ERROR_NO_MEM;
+    int iso_packets = tran->intrn.num_iso_packets;
+
+    tran->req = &tran->urb;
+    if (iso_packets > 0)
+    {
+        tran->req = malloc(sizeof(struct usbdevfs_urb) + sizeof(struct usbdevfs_iso_packet_desc) * iso_packets);
+        if (!tran->req)
+            return LIBUSBY_ERROR_NO_MEM;
+    }
 
     tran->active = 0;
+    tran->waiting = 0;
+    tran->wake_seq = 0;
+    tran->timer_index = -1;
+    tran->pool_class = -1;
     return LIBUSBY_SUCCESS;
 }
 
 void usbyb_clear_transfer(usbyb_transfer * tran)
 {
-    pthread_cond_destroy(&tran->cond);
+    if (tran->req != &tran->urb)
+        free(tran->req);
+    free(tran->urbs);
 }
 
-static void usbfs_unwatch_fd(usbyb_context * ctx, int fdindex)
+static int usbfs_pool_class(int iso_packets)
 {
-    if (--ctx->watched_fds[fdindex].refcount == 0)
+    int i;
+    for (i = 0; i < USBFS_POOL_CLASSES; ++i)
     {
-        if (--ctx->watched_fd_count)
-            ctx->watched_fds[fdindex] = ctx->watched_fds[ctx->watched_fd_count];
+        if (iso_packets <= usbfs_pool_class_packets[i])
+            return i;
     }
+    return -1;
 }
 
-static int usbfs_run_event_loop_impl(usbyb_context * ctx, usbyb_transfer * watch_tran)
+static void usbfs_init_ring(usbfs_ring * ring, usbfs_ring_cell * cells, size_t capacity)
 {
-    struct pollfd * pollfds = 0;
-    int pollfds_cap = 0;
-    int i;
-    int r = LIBUSBY_SUCCESS;
+    size_t i;
+    for (i = 0; i < capacity; ++i)
+        cells[i].seq = i;
+    ring->cells = cells;
+    ring->capacity = capacity;
+    ring->push_pos = 0;
+    ring->pop_pos = 0;
+}
 
-    while (ctx->loop_enabled && ctx->loop_locked)
-        pthread_cond_wait(&ctx->ctx_cond, &ctx->ctx_mutex);
-    ctx->loop_locked = 1;
+/* Each cell's sequence number tells whether it is free for the push with
+ * the same position or holds the transfer for the pop with that position.
+ * A thread preempted halfway through can make the ring look empty or full
+ * to the others for a while, callers must cope with that. */
+static int usbfs_ring_push(usbfs_ring * ring, usbyb_transfer * tran)
+{
+    size_t pos = __atomic_load_n(&ring->push_pos, __ATOMIC_RELAXED);
+    usbfs_ring_cell * cell;
 
-    while ((!watch_tran || watch_tran->active) && r >= 0 && ctx->loop_enabled)
+    for (;;)
     {
-        int fdcount = ctx->watched_fd_count;
-
-        if (pollfds_cap < fdcount + 1)
+        size_t seq;
+        cell = &ring->cells[pos % ring->capacity];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos)
         {
-            struct pollfd * newpollfds;
-            newpollfds = realloc(pollfds, sizeof(struct pollfd) * (fdcount + 1));
-            if (!newpollfds)
-            {
-                r = LIBUSBY_ERROR_NO_MEM;
+            if (__atomic_compare_exchange_n(&ring->push_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
                 break;
-            }
-
-            pollfds = newpollfds;
-            pollfds_cap = fdcount + 1;
         }
-
-        pollfds[fdcount].fd = ctx->pipe[0];
-        pollfds[fdcount].events = POLLIN;
-        pollfds[fdcount].revents = 0;
-
-        for (i = 0; i < fdcount; ++i)
+        else if ((ptrdiff_t)(seq - pos) < 0)
+        {
+            return 0;
+        }
+        else
         {
-            pollfds[i].fd = ctx->watched_fds[i].fd;
-            pollfds[i].events = POLLOUT;
-            pollfds[i].revents = 0;
+            pos = __atomic_load_n(&ring->push_pos, __ATOMIC_RELAXED);
         }
+    }
 
-        pthread_mutex_unlock(&ctx->ctx_mutex);
+    cell->tran = tran;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
 
-        if (poll(pollfds, fdcount+1, -1) < 0)
+static usbyb_transfer * usbfs_ring_pop(usbfs_ring * ring)
+{
+    size_t pos = __atomic_load_n(&ring->pop_pos, __ATOMIC_RELAXED);
+    usbfs_ring_cell * cell;
+    usbyb_transfer * tran;
+
+    for (;;)
+    {
+        size_t seq;
+        cell = &ring->cells[pos % ring->capacity];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos + 1)
+        {
+            if (__atomic_compare_exchange_n(&ring->pop_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if ((ptrdiff_t)(seq - (pos + 1)) < 0)
         {
-            r = LIBUSBY_ERROR_IO;
+            return 0;
         }
         else
         {
-            for (i = 0; i < fdcount; ++i)
-            {
-                struct usbdevfs_urb * urb;
-                usbyb_transfer * tran;
-
-                if ((pollfds[i].revents & POLLOUT) == 0)
-                    continue;
-
-                if (ioctl(pollfds[i].fd, USBDEVFS_REAPURBNDELAY, &urb) < 0)
-                    continue;
-
-                tran = urb->usercontext;
-
-                tran->pub.actual_length = tran->req.actual_length;
-                if (tran->pub.type == LIBUSBY_TRANSFER_TYPE_CONTROL)
-                    tran->pub.actual_length += 8;
-
-                if (tran->req.status != 0)
-                    tran->pub.status = LIBUSBY_ERROR_IO;
-
-                pthread_mutex_lock(&ctx->ctx_mutex);
-                tran->active = 2;
-
-                if (tran->pub.callback)
-                {
-                    pthread_mutex_unlock(&ctx->ctx_mutex);
-                    tran->pub.callback(&tran->pub);
-                    pthread_mutex_lock(&ctx->ctx_mutex);
-                }
-
-                if (tran->active == 2)
-                {
-                    tran->active = 0;
-                    pthread_cond_broadcast(&tran->cond);
-                }
-
-                usbfs_unwatch_fd(ctx, i);
-                pthread_mutex_unlock(&ctx->ctx_mutex);
-            }
-
-            if (pollfds[fdcount].revents & POLLIN)
-            {
-                char dummy;
-                if (read(pollfds[fdcount].fd, &dummy, 1) < 0)
-                    r = LIBUSBY_ERROR_IO;
-            }
+            pos = __atomic_load_n(&ring->pop_pos, __ATOMIC_RELAXED);
         }
-
-        pthread_mutex_lock(&ctx->ctx_mutex);
     }
 
-    free(pollfds);
-    ctx->loop_locked = 0;
-    return r;
+    tran = cell->tran;
+    __atomic_store_n(&cell->seq, pos + ring->capacity, __ATOMIC_RELEASE);
+    return tran;
 }
 
-int usbyb_run_event_loop(usbyb_context * ctx)
+static size_t usbfs_transfer_alloc_size(int iso_packets)
 {
-    int r;
-    pthread_mutex_lock(&ctx->ctx_mutex);
-    r = usbfs_run_event_loop_impl(ctx, 0);
-    pthread_mutex_unlock(&ctx->ctx_mutex);
-    return r;
+    return sizeof(usbyb_transfer) + sizeof(libusby_iso_packet_descriptor) * iso_packets - sizeof(libusby_iso_packet_descriptor);
 }
 
-int usbyb_wait_for_transfer(usbyb_transfer * tran)
+/* Pooled transfers are allocated with room for the largest packet count of their class. */
+static usbyb_transfer * usbfs_new_transfer(usbyb_context * ctx, int pool_class, int iso_packets)
 {
-    usbyb_context * ctx = tran->intrn.ctx;
-    int r = LIBUSBY_SUCCESS;
-
-    pthread_mutex_lock(&ctx->ctx_mutex);
-    if (!ctx->loop_locked)
-        r = usbfs_run_event_loop_impl(ctx, tran);
+    int capacity = pool_class >= 0? usbfs_pool_class_packets[pool_class]: iso_packets;
+    size_t alloc_size = usbfs_transfer_alloc_size(capacity);
+    usbyb_transfer * tran = malloc(alloc_size);
+    if (!tran)
+        return 0;
+    memset(tran, 0, alloc_size);
+
+    tran->intrn.ctx = ctx;
+    tran->intrn.num_iso_packets = capacity;
+    if (usbyb_init_transfer(tran) < 0)
+    {
+        free(tran);
+        return 0;
+    }
 
-    while (tran->active)
-        pthread_cond_wait(&tran->cond, &ctx->ctx_mutex);
+    tran->intrn.num_iso_packets = iso_packets;
+    tran->pool_class = pool_class;
+    return tran;
+}
 
-    pthread_mutex_unlock(&ctx->ctx_mutex);
-    return r;
+static void usbfs_delete_transfer(usbyb_transfer * tran)
+{
+    usbyb_clear_transfer(tran);
+    free(tran);
 }
 
-void usbyb_stop_event_loop(usbyb_context * ctx)
+static void usbfs_drain_pools(usbyb_context * ctx)
 {
-    pthread_mutex_lock(&ctx->ctx_mutex);
-    ctx->loop_enabled = 0;
-    if (ctx->loop_locked)
+    int i;
+    for (i = 0; i < USBFS_POOL_CLASSES; ++i)
     {
-        char dummy = 's';
-        write(ctx->pipe[1], &dummy, 1);
+        usbyb_transfer * tran;
+        while ((tran = usbfs_ring_pop(&ctx->pools[i])) != 0)
+            usbfs_delete_transfer(tran);
     }
-    pthread_cond_broadcast(&ctx->ctx_cond);
-    pthread_mutex_unlock(&ctx->ctx_mutex);
 }
 
-void usbyb_reset_event_loop(usbyb_context * ctx)
+static int usbfs_prewarm_pool(usbyb_context * ctx, int count)
 {
-    pthread_mutex_lock(&ctx->ctx_mutex);
-    ctx->loop_enabled = 1;
-    pthread_mutex_unlock(&ctx->ctx_mutex);
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        usbyb_transfer * tran = usbfs_new_transfer(ctx, 0, 0);
+        if (!tran)
+            return LIBUSBY_ERROR_NO_MEM;
+        if (!usbfs_ring_push(&ctx->pools[0], tran))
+        {
+            usbfs_delete_transfer(tran);
+            break;
+        }
+    }
+    return LIBUSBY_SUCCESS;
 }
 
-int usbyb_init(usbyb_context * ctx)
+int usbyb_alloc_transfer(usbyb_context * ctx, int iso_packets, usbyb_transfer ** tran)
 {
-    usbyi_init_devlist_head(&ctx->devlist_head);
+    int pool_class = usbfs_pool_class(iso_packets);
+    usbyb_transfer * res = 0;
 
-    if (pthread_mutex_init(&ctx->ctx_mutex, NULL) < 0)
-        return LIBUSBY_ERROR_NO_MEM;
+    if (pool_class >= 0)
+        res = usbfs_ring_pop(&ctx->pools[pool_class]);
 
-    if (pthread_cond_init(&ctx->ctx_cond, NULL) < 0)
+    if (res)
     {
-        pthread_mutex_destroy(&ctx->ctx_mutex);
-        return LIBUSBY_ERROR_NO_MEM;
+        __atomic_add_fetch(&ctx->pool_hits, 1, __ATOMIC_RELAXED);
+
+        /* The URB buffers survive recycling, only the caller-visible
+         * state is reset. */
+        memset(&res->pub, 0, usbfs_transfer_alloc_size(usbfs_pool_class_packets[pool_class]) - offsetof(usbyb_transfer, pub));
+        res->intrn.num_iso_packets = iso_packets;
+        res->intrn.priv = 0;
+        res->handoff = 0;
+        res->timed_out = 0;
+        res->queue = 0;
     }
-
-    if (pipe(ctx->pipe) < 0)
+    else
     {
-        pthread_cond_destroy(&ctx->ctx_cond);
-        pthread_mutex_destroy(&ctx->ctx_mutex);
-        return LIBUSBY_ERROR_NO_MEM;
+        __atomic_add_fetch(&ctx->pool_misses, 1, __ATOMIC_RELAXED);
+        res = usbfs_new_transfer(ctx, pool_class, iso_packets);
+        if (!res)
+            return LIBUSBY_ERROR_NO_MEM;
     }
 
-    ctx->loop_enabled = 1;
-    ctx->loop_locked = 0;
+    *tran = res;
     return LIBUSBY_SUCCESS;
 }
 
-void usbyb_exit(usbyb_context * ctx)
+int usbyb_free_transfer(usbyb_transfer * tran)
 {
-    assert(ctx->devlist_head.next == &ctx->devlist_head);
-    free(ctx->watched_fds);
-    close(ctx->pipe[0]);
-    close(ctx->pipe[1]);
-    pthread_cond_destroy(&ctx->ctx_cond);
-    pthread_mutex_destroy(&ctx->ctx_mutex);
+    usbyb_context * ctx = tran->intrn.ctx;
+    if (tran->pool_class < 0 || !usbfs_ring_push(&ctx->pools[tran->pool_class], tran))
+        usbfs_delete_transfer(tran);
+    return LIBUSBY_SUCCESS;
 }
 
-int usbyb_get_device_list(usbyb_context * ctx, libusby_device *** list)
+int usbyb_get_transfer_pool_stats(usbyb_context * ctx, libusby_transfer_pool_stats * stats)
 {
-    usbyi_device_list devlist;
-    DIR * dir = 0;
-    DIR * busdir = 0;
-    struct dirent * ent;
-    int fd = -1;
-    int r = LIBUSBY_SUCCESS;
+    stats->hits = __atomic_load_n(&ctx->pool_hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&ctx->pool_misses, __ATOMIC_RELAXED);
+    return LIBUSBY_SUCCESS;
+}
 
-    memset(&devlist, 0, sizeof devlist);
-    dir = opendir("/dev/bus/usb");
-    if (!dir)
-    {
-        *list = NULL;
-        return LIBUSBY_SUCCESS;
-    }
+static void usbfs_signal_transfer(usbyb_transfer * tran)
+{
+    __atomic_add_fetch(&tran->wake_seq, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &tran->wake_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
 
-    while (r >= 0 && (ent = readdir(dir)))
-    {
-        char fname[2*NAME_MAX+32];
-        struct dirent * busent;
-        char * end;
-        int busno = strtol(ent->d_name, &end, 10);
+int usbyb_completion_queue_open(libusby_completion_queue ** queue, usbyb_context * ctx, int capacity)
+{
+    libusby_completion_queue * q;
+    usbfs_ring_cell * cells;
 
-        if (*end != 0)
-            continue;
+    (void)ctx;
+    if (capacity < 1)
+        return LIBUSBY_ERROR_INVALID_PARAM;
 
-        strcpy(fname, "/dev/bus/usb/");
-        strcat(fname, ent->d_name);
+    q = malloc(sizeof *q);
+    cells = malloc(sizeof(usbfs_ring_cell) * capacity);
+    if (!q || !cells)
+        goto error;
+    memset(q, 0, sizeof *q);
 
-        busdir = opendir(fname);
-        if (!busdir)
-            continue;
+    if (pthread_mutex_init(&q->overflow_mutex, 0) != 0)
+        goto error;
 
-        while (r >= 0 && (busent = readdir(busdir)))
-        {
-            int devno = strtol(busent->d_name, &end, 10);
-            usbyi_device_list_node * devnode;
+    usbfs_init_ring(&q->ring, cells, capacity);
+    *queue = q;
+    return LIBUSBY_SUCCESS;
 
-            if (*end != 0)
-                continue;
+error:
+    free(cells);
+    free(q);
+    return LIBUSBY_ERROR_NO_MEM;
+}
 
-            strcpy(fname, "/dev/bus/usb/");
-            strcat(fname, ent->d_name);
-            strcat(fname, "/");
-            strcat(fname, busent->d_name);
+void usbyb_completion_queue_close(libusby_completion_queue * queue)
+{
+    pthread_mutex_destroy(&queue->overflow_mutex);
+    free(queue->ring.cells);
+    free(queue);
+}
 
-            fd = open(fname, O_RDONLY);
-            if (fd == -1)
-                continue;
+int usbyb_set_transfer_queue(usbyb_transfer * tran, libusby_completion_queue * queue)
+{
+    tran->queue = queue;
+    return LIBUSBY_SUCCESS;
+}
 
-            pthread_mutex_lock(&ctx->ctx_mutex);
-            for (devnode = ctx->devlist_head.next; devnode != &ctx->devlist_head; devnode = devnode->next)
-            {
-                usbyb_device * dev = container_of(devnode, usbyb_device, devnode);
-                if (dev->busno == busno && dev->devno == devno)
-                {
-                    r = usbyi_append_device_list(&devlist, &dev->pub);
-                    if (r < 0)
-                        goto error;
-                    libusby_ref_device(&dev->pub);
-                    break;
-                }
-            }
+/* Called by the reaper instead of the callback. The transfer stays active until
+ * it is pulled from the queue by `usbfs_drain_completions`, so that it can't be
+ * resubmitted before it is in the queue, and isn't touched here once it is. */
+static void usbfs_post_completion(usbyb_transfer * tran)
+{
+    libusby_completion_queue * queue = tran->queue;
 
-            if (devnode == &ctx->devlist_head)
-            {
-                usbyb_device * dev;
-                int i;
-                size_t cache_len = 0;
-
-                dev = usbyi_alloc_device(ctx);
-                if (!dev)
-                {
-                    r = LIBUSBY_ERROR_NO_MEM;
-                    goto error;
-                }
-
-                dev->busno = busno;
-                dev->devno = devno;
-                dev->fd = fd;
-                usbyi_insert_before_devlist_node(&dev->devnode, &ctx->devlist_head);
-
-                /* Note that the device descriptor is read in host-endian. */
-                if (read(fd, &dev->pub.device_desc, sizeof dev->pub.device_desc) != sizeof dev->pub.device_desc)
-                    goto error_unref_dev;
-
-                for (i = 0; i < dev->pub.device_desc.bNumConfigurations; ++i)
-                {
-                    uint8_t config_header[4];
-                    uint16_t wTotalLength;
-                    uint8_t * cache;
-
-                    if (read(fd, config_header, sizeof config_header) != sizeof config_header)
-                        goto error_unref_dev;
-                    wTotalLength = config_header[2] | (config_header[3] << 8);
-                    if (wTotalLength < sizeof config_header)
-                        goto error_unref_dev;
-
-                    cache = realloc(dev->desc_cache, cache_len + wTotalLength);
-                    if (!cache)
-                    {
-                        r = LIBUSBY_ERROR_NO_MEM;
-                        goto error_unref_dev;
-                    }
-                    dev->desc_cache = cache;
-
-                    memcpy(dev->desc_cache + cache_len, config_header, sizeof config_header);
-                    if (read(fd, dev->desc_cache + cache_len + sizeof config_header, wTotalLength - sizeof config_header)
-                            != (int)(wTotalLength - sizeof config_header))
-                    {
-                        goto error_unref_dev;
-                    }
-
-                    cache_len += wTotalLength;
-                }
+    __atomic_store_n(&tran->active, 2, __ATOMIC_SEQ_CST);
+    if (!usbfs_ring_push(&queue->ring, tran))
+    {
+        pthread_mutex_lock(&queue->overflow_mutex);
+        tran->completion_next = 0;
+        if (queue->overflow_last)
+            queue->overflow_last->completion_next = tran;
+        else
+            queue->overflow_first = tran;
+        queue->overflow_last = tran;
+        __atomic_add_fetch(&queue->overflow_count, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&queue->overflow_mutex);
+    }
 
-                r = usbyi_append_device_list(&devlist, &dev->pub);
-                if (r < 0)
-                {
-error_unref_dev:
-                    libusby_unref_device(&dev->pub);
-                }
-            }
-            else
-                close(fd);
+    __atomic_add_fetch(&queue->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &queue->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
 
-            pthread_mutex_unlock(&ctx->ctx_mutex);
-        }
+/* Wakes up the thread running the shard's event loop. Wakeups are coalesced,
+ * at most one is pending at any time, and none is needed when called
+ * from the loop thread itself. */
+static void usbfs_wakeup(usbfs_shard * shard)
+{
+    uint64_t value = 1;
 
-        closedir(busdir);
-    }
+    __atomic_add_fetch(&shard->stats.wakeups_requested, 1, __ATOMIC_RELAXED);
 
-    closedir(dir);
+    if (pthread_equal(shard->loop_thread, pthread_self()))
+        return;
 
-    *list = devlist.list;
-    return devlist.count;
+    if (__atomic_exchange_n(&shard->wakeup_pending, 1, __ATOMIC_SEQ_CST))
+        return;
 
-error:
-    pthread_mutex_unlock(&ctx->ctx_mutex);
-    if (fd != -1)
-        close(fd);
-    closedir(busdir);
-    closedir(dir);
-    if (devlist.list)
-        libusby_free_device_list(devlist.list, /*unref_devices=*/1);
-    return r;
+    __atomic_add_fetch(&shard->stats.wakeups_signalled, 1, __ATOMIC_RELAXED);
+    write(shard->evfd, &value, sizeof value);
 }
 
-void usbyb_finalize_device(usbyb_device * dev)
+/* Accounts for a transfer handed back to the user. The handle may be closed
+ * as soon as its count drops to zero, only the shard is touched afterwards. */
+static void usbfs_release_pending(usbyb_device_handle * handle)
 {
-    usbyi_remove_devlist_node(&dev->devnode);
-    free(dev->desc_cache);
-    close(dev->fd);
+    usbfs_shard * shard = handle->shard;
+
+    if (__atomic_sub_fetch(&handle->pending, 1, __ATOMIC_SEQ_CST) == 0
+            && __atomic_load_n(&shard->drainers, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&shard->mutex);
+        pthread_cond_broadcast(&shard->cond);
+        pthread_mutex_unlock(&shard->mutex);
+
+        /* The drainer may be running the loop itself. */
+        usbfs_wakeup(shard);
+    }
 }
 
-static int usbfs_error()
+/* Called after the callback of a transfer has returned. The callback may have
+ * closed the transfer's handle, only the transfer itself is touched. */
+static void usbfs_finish_callback(usbyb_transfer * tran)
 {
-    switch (errno)
+    int expected = 2;
+
+    if (__atomic_compare_exchange_n(&tran->active, &expected, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+            && __atomic_load_n(&tran->waiting, __ATOMIC_SEQ_CST))
     {
-    case ENODEV:
-        return LIBUSBY_ERROR_NO_DEVICE;
-    case EBUSY:
-        return LIBUSBY_ERROR_BUSY;
-    default:
-        return LIBUSBY_ERROR_IO;
+        usbfs_signal_transfer(tran);
     }
 }
 
-int usbyb_submit_transfer(usbyb_transfer * tran)
+static void usbfs_schedule_serial_queue(usbfs_dispatcher * dispatcher, usbfs_serial_queue * serial)
 {
-    usbyb_device_handle * handle = (usbyb_device_handle *)tran->pub.dev_handle;
-    usbyb_context * ctx = (usbyb_context *)handle->pub.dev->pub.ctx;
-    int i;
-    int r = LIBUSBY_SUCCESS;
-
-    assert(ctx == tran->intrn.ctx);
+    serial->scheduled = 1;
+    serial->next_ready = 0;
+    if (dispatcher->ready_last)
+        dispatcher->ready_last->next_ready = serial;
+    else
+        dispatcher->ready_first = serial;
+    dispatcher->ready_last = serial;
+    pthread_cond_signal(&dispatcher->ready_cond);
+}
 
-    memset(&tran->req, 0, sizeof tran->req);
+/* Called by the event loop for transfers already marked as being in their callback. */
+static void usbfs_dispatch_callbacks(usbfs_dispatcher * dispatcher, libusby_transfer ** batch, int count)
+{
+    int i;
 
-    switch (tran->pub.type)
+    pthread_mutex_lock(&dispatcher->mutex);
+    for (i = 0; i < count; ++i)
     {
-    case LIBUSBY_TRANSFER_TYPE_CONTROL:
-        tran->req.type = USBDEVFS_URB_TYPE_CONTROL;
-        break;
-    case LIBUSBY_TRANSFER_TYPE_BULK:
-        tran->req.type = USBDEVFS_URB_TYPE_BULK;
-        break;
-    case LIBUSBY_TRANSFER_TYPE_INTERRUPT:
-        tran->req.type = USBDEVFS_URB_TYPE_INTERRUPT;
-        break;
-    default:
-        return LIBUSBY_ERROR_NOT_SUPPORTED;
-    }
+        usbyb_transfer * tran = usbyi_get_tran(batch[i]);
+        usbyb_device_handle * handle = (usbyb_device_handle *)tran->pub.dev_handle;
+        int index = (tran->pub.endpoint & 0x0f) | ((tran->pub.endpoint & LIBUSBY_ENDPOINT_DIR_MASK) >> 3);
+        usbfs_serial_queue * serial = &handle->serial_queues[index];
+
+        tran->completion_next = 0;
+        if (serial->last)
+            serial->last->completion_next = tran;
+        else
+            serial->first = tran;
+        serial->last = tran;
 
-    tran->req.endpoint = tran->pub.endpoint;
-    tran->req.buffer = tran->pub.buffer;
-    tran->req.buffer_length = tran->pub.length;
-    tran->req.usercontext = tran;
+        if (!serial->scheduled)
+            usbfs_schedule_serial_queue(dispatcher, serial);
+    }
+    pthread_mutex_unlock(&dispatcher->mutex);
+}
 
-    pthread_mutex_lock(&ctx->ctx_mutex);
+/* Each thread takes a whole serial queue from the ready list and runs the callbacks
+ * queued so far, so idle threads naturally pick up endpoints others are not serving. */
+static void * usbfs_dispatcher_thread(void * param)
+{
+    usbfs_dispatcher * dispatcher = param;
 
-    for (i = 0; i != ctx->watched_fd_count; ++i)
+    pthread_mutex_lock(&dispatcher->mutex);
+    for (;;)
     {
-        if (ctx->watched_fds[i].fd == handle->wrfd)
+        usbfs_serial_queue * serial;
+        usbyb_transfer * tran;
+        int closed = 0;
+
+        while (!dispatcher->ready_first && !dispatcher->stopping)
+            pthread_cond_wait(&dispatcher->ready_cond, &dispatcher->mutex);
+
+        serial = dispatcher->ready_first;
+        if (!serial)
             break;
-    }
 
-    if (ctx->watched_fd_count == i)
-    {
-        if (ctx->watched_fd_count == ctx->watched_fd_capacity)
+        dispatcher->ready_first = serial->next_ready;
+        if (!dispatcher->ready_first)
+            dispatcher->ready_last = 0;
+
+        tran = serial->first;
+        serial->first = serial->last = 0;
+        serial->runner = pthread_self();
+        serial->runner_closed = &closed;
+        pthread_mutex_unlock(&dispatcher->mutex);
+
+        while (tran && !__atomic_load_n(&closed, __ATOMIC_SEQ_CST))
         {
-            int newcap = ctx->watched_fd_capacity == 0? 4: ctx->watched_fd_capacity * 3 / 2;
-            struct watched_fd * newfds = realloc(ctx->watched_fds, sizeof(struct watched_fd) * newcap);
-            if (!newfds)
-                r = LIBUSBY_ERROR_NO_MEM;
-            ctx->watched_fds = newfds;
-            ctx->watched_fd_capacity = newcap;
-        }
+            usbyb_transfer * next = tran->completion_next;
+            usbfs_shard * shard = ((usbyb_device_handle *)tran->pub.dev_handle)->shard;
 
-        ++ctx->watched_fd_count;
-        ctx->watched_fds[i].fd = handle->wrfd;
-        ctx->watched_fds[i].refcount = 0;
-    }
+            if (tran->pub.callback)
+                tran->pub.callback(&tran->pub);
+            usbfs_finish_callback(tran);
 
-    if (r >= 0 && ioctl(handle->wrfd, USBDEVFS_SUBMITURB, &tran->req) < 0)
-    {
-        usbfs_unwatch_fd(ctx, i);
-        r = usbfs_error();
-    }
+            /* The loop may be run just to wait for this transfer. */
+            if (__atomic_load_n(&shard->loop_watch, __ATOMIC_SEQ_CST) == tran)
+                usbfs_wakeup(shard);
+            tran = next;
+        }
 
-    if (r >= 0 && ctx->loop_locked)
-    {
-        int dummy = 'u';
-        write(ctx->pipe[1], &dummy, 1);
-        tran->active = 1;
-    }
+        /* A callback closed the handle, which must not have had other transfers
+         * pending. Any left are handed back without their callbacks. */
+        while (tran)
+        {
+            usbyb_transfer * next = tran->completion_next;
+            usbfs_finish_callback(tran);
+            tran = next;
+        }
 
-    pthread_mutex_unlock(&ctx->ctx_mutex);
-    return r;
+        pthread_mutex_lock(&dispatcher->mutex);
+        if (closed)
+        {
+            pthread_cond_broadcast(&dispatcher->idle_cond);
+            continue;
+        }
+        memset(&serial->runner, 0, sizeof serial->runner);
+        if (serial->first)
+        {
+            usbfs_schedule_serial_queue(dispatcher, serial);
+        }
+        else
+        {
+            serial->scheduled = 0;
+            pthread_cond_broadcast(&dispatcher->idle_cond);
+        }
+    }
+    pthread_mutex_unlock(&dispatcher->mutex);
+    return 0;
 }
 
-int usbyb_cancel_transfer(usbyb_transfer * tran)
+/* Runs the queued callbacks to completion and joins the threads. */
+static void usbfs_stop_dispatcher(usbfs_dispatcher * dispatcher)
 {
-    usbyb_device_handle * handle = (usbyb_device_handle *)tran->pub.dev_handle;
+    int i;
 
-    if (ioctl(handle->wrfd, USBDEVFS_DISCARDURB, &tran->req) < 0)
-        return usbfs_error();
+    pthread_mutex_lock(&dispatcher->mutex);
+    dispatcher->stopping = 1;
+    pthread_cond_broadcast(&dispatcher->ready_cond);
+    pthread_mutex_unlock(&dispatcher->mutex);
 
-    return LIBUSBY_SUCCESS;
+    for (i = 0; i < dispatcher->thread_count; ++i)
+        pthread_join(dispatcher->threads[i], 0);
+
+    free(dispatcher->threads);
+    dispatcher->threads = 0;
+    dispatcher->stopping = 0;
+    __atomic_store_n(&dispatcher->thread_count, 0, __ATOMIC_SEQ_CST);
+}
+
+static int usbfs_start_dispatcher(usbfs_dispatcher * dispatcher, int thread_count)
+{
+    int i;
+
+    dispatcher->threads = malloc(sizeof(pthread_t) * thread_count);
+    if (!dispatcher->threads)
+        return LIBUSBY_ERROR_NO_MEM;
+
+    for (i = 0; i < thread_count; ++i)
+    {
+        if (pthread_create(&dispatcher->threads[i], 0, &usbfs_dispatcher_thread, dispatcher) != 0)
+        {
+            dispatcher->thread_count = i;
+            usbfs_stop_dispatcher(dispatcher);
+            return LIBUSBY_ERROR_NO_MEM;
+        }
+    }
+
+    __atomic_store_n(&dispatcher->thread_count, thread_count, __ATOMIC_SEQ_CST);
+    return LIBUSBY_SUCCESS;
+}
+
+/* Waits until no callback of the handle is queued or running, except
+ * for those run by the calling thread itself. */
+static void usbfs_wait_dispatcher_idle(usbfs_dispatcher * dispatcher, usbyb_device_handle * handle)
+{
+    int i;
+
+    pthread_mutex_lock(&dispatcher->mutex);
+    for (i = 0; i < 32; ++i)
+    {
+        usbfs_serial_queue * serial = &handle->serial_queues[i];
+        while (serial->scheduled && !pthread_equal(serial->runner, pthread_self()))
+            pthread_cond_wait(&dispatcher->idle_cond, &dispatcher->mutex);
+        if (serial->scheduled)
+            __atomic_store_n(serial->runner_closed, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&dispatcher->mutex);
+}
+
+/* Marks a transfer pulled from its queue as handed back to the user. */
+static void usbfs_retrieve_completion(usbyb_transfer * tran)
+{
+    __atomic_store_n(&tran->active, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&tran->waiting, __ATOMIC_SEQ_CST))
+        usbfs_signal_transfer(tran);
+}
+
+static int usbfs_drain_completions(libusby_completion_queue * queue, libusby_transfer ** transfers, int max)
+{
+    int count = 0;
+    usbyb_transfer * tran;
+
+    while (count < max && (tran = usbfs_ring_pop(&queue->ring)) != 0)
+    {
+        usbfs_retrieve_completion(tran);
+        transfers[count++] = &tran->pub;
+    }
+
+    if (count < max && __atomic_load_n(&queue->overflow_count, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&queue->overflow_mutex);
+        while (count < max && queue->overflow_first)
+        {
+            tran = queue->overflow_first;
+            queue->overflow_first = tran->completion_next;
+            if (!queue->overflow_first)
+                queue->overflow_last = 0;
+            __atomic_sub_fetch(&queue->overflow_count, 1, __ATOMIC_SEQ_CST);
+            usbfs_retrieve_completion(tran);
+            transfers[count++] = &tran->pub;
+        }
+        pthread_mutex_unlock(&queue->overflow_mutex);
+    }
+
+    return count;
+}
+
+int usbyb_poll_completions(libusby_completion_queue * queue, libusby_transfer ** transfers, int max, int timeout)
+{
+    struct timespec deadline;
+
+    if (max < 1)
+        return LIBUSBY_ERROR_INVALID_PARAM;
+
+    if (timeout > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    for (;;)
+    {
+        /* Sampled before draining, so that a completion posted
+         * in between makes the wait return at once. */
+        int seq = __atomic_load_n(&queue->seq, __ATOMIC_SEQ_CST);
+        struct timespec rel;
+        int count;
+
+        count = usbfs_drain_completions(queue, transfers, max);
+        if (count || timeout == 0)
+            return count;
+
+        if (timeout > 0)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            rel.tv_sec = deadline.tv_sec - now.tv_sec;
+            rel.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (rel.tv_nsec < 0)
+            {
+                --rel.tv_sec;
+                rel.tv_nsec += 1000000000;
+            }
+            if (rel.tv_sec < 0)
+                return 0;
+        }
+
+        __atomic_add_fetch(&queue->waiters, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &queue->seq, FUTEX_WAIT_PRIVATE, seq, timeout > 0? &rel: NULL, NULL, 0);
+        __atomic_sub_fetch(&queue->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static int usbfs_watch_fd(usbfs_shard * shard, int fd, unsigned events, void * token, usbfs_uring_watch ** uring_watch)
+{
+    struct epoll_event ev;
+
+    if (shard->uring)
+    {
+        *uring_watch = usbfs_uring_watch_fd(shard->uring, fd, events, token);
+        return *uring_watch? LIBUSBY_SUCCESS: LIBUSBY_ERROR_NO_MEM;
+    }
+
+    ev.events = events;
+    ev.data.ptr = token;
+    if (epoll_ctl(shard->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return LIBUSBY_ERROR_NO_MEM;
+    return LIBUSBY_SUCCESS;
+}
+
+static int usbfs_watch_handle(usbfs_shard * shard, usbyb_device_handle * handle)
+{
+    int r = usbfs_watch_fd(shard, handle->wrfd, EPOLLOUT, handle, &handle->uring_watch);
+    if (r < 0)
+        return r;
+
+    __atomic_store_n(&handle->shard, shard, __ATOMIC_SEQ_CST);
+    handle->watched = 1;
+    return LIBUSBY_SUCCESS;
+}
+
+static void usbfs_unwatch_handle(usbyb_device_handle * handle)
+{
+    if (!__atomic_exchange_n(&handle->watched, 0, __ATOMIC_SEQ_CST))
+        return;
+
+    if (handle->shard->uring)
+        usbfs_uring_unwatch(handle->shard->uring, handle->uring_watch);
+    else
+        epoll_ctl(handle->shard->epfd, EPOLL_CTL_DEL, handle->wrfd, 0);
+}
+
+static int usbfs_error()
+{
+    switch (errno)
+    {
+    case ENODEV:
+        return LIBUSBY_ERROR_NO_DEVICE;
+    case EBUSY:
+        return LIBUSBY_ERROR_BUSY;
+    default:
+        return LIBUSBY_ERROR_IO;
+    }
+}
+
+/* Discards every URB of the transfer that is still owned by the kernel. */
+static int usbfs_discard_urbs(usbyb_device_handle * handle, usbyb_transfer * tran)
+{
+    int r = LIBUSBY_ERROR_NOT_FOUND;
+    int i;
+
+    if (tran->urb_count == 1)
+        return ioctl(handle->wrfd, USBDEVFS_DISCARDURB, tran->req) < 0? usbfs_error(): LIBUSBY_SUCCESS;
+
+    for (i = 0; i < tran->urb_count; ++i)
+    {
+        if (ioctl(handle->wrfd, USBDEVFS_DISCARDURB, &tran->urbs[i]) == 0)
+            r = LIBUSBY_SUCCESS;
+        else if (r < 0)
+            r = usbfs_error();
+    }
+
+    return r;
+}
+
+/* Lists the transfer among the handle's in-flight ones, unless the handle is being closed. */
+static int usbfs_track_transfer(usbyb_device_handle * handle, usbyb_transfer * tran)
+{
+    int index = (tran->pub.endpoint & 0x0f) | ((tran->pub.endpoint & LIBUSBY_ENDPOINT_DIR_MASK) >> 3);
+
+    pthread_mutex_lock(&handle->inflight_mutex);
+    if (handle->closing || handle->moving)
+    {
+        pthread_mutex_unlock(&handle->inflight_mutex);
+        return handle->closing? LIBUSBY_ERROR_NO_DEVICE: LIBUSBY_ERROR_BUSY;
+    }
+
+    tran->inflight_prev = 0;
+    tran->inflight_next = handle->inflight_transfers[index];
+    if (tran->inflight_next)
+        tran->inflight_next->inflight_prev = tran;
+    handle->inflight_transfers[index] = tran;
+    pthread_mutex_unlock(&handle->inflight_mutex);
+
+    __atomic_add_fetch(&handle->pending, 1, __ATOMIC_SEQ_CST);
+    return LIBUSBY_SUCCESS;
+}
+
+/* Accounts for a synchronous ioctl about to be issued on the handle. Those
+ * don't involve the shard, so a handle being moved doesn't refuse them. */
+static int usbfs_begin_sync(usbyb_device_handle * handle)
+{
+    int r = LIBUSBY_SUCCESS;
+
+    pthread_mutex_lock(&handle->inflight_mutex);
+    if (handle->closing)
+        r = LIBUSBY_ERROR_NO_DEVICE;
+    else
+        ++handle->sync_calls;
+    pthread_mutex_unlock(&handle->inflight_mutex);
+    return r;
+}
+
+/* Preserves the errno of the ioctl. */
+static void usbfs_end_sync(usbyb_device_handle * handle)
+{
+    int err = errno;
+
+    pthread_mutex_lock(&handle->inflight_mutex);
+    if (--handle->sync_calls == 0 && handle->closing)
+        pthread_cond_broadcast(&handle->sync_cond);
+    pthread_mutex_unlock(&handle->inflight_mutex);
+    errno = err;
+}
+
+/* Refuses further synchronous ioctls and waits for those in progress to return,
+ * which neither cancellation nor the event loop can hurry. */
+static void usbfs_wait_sync(usbyb_device_handle * handle)
+{
+    pthread_mutex_lock(&handle->inflight_mutex);
+    handle->closing = 1;
+    while (handle->sync_calls)
+        pthread_cond_wait(&handle->sync_cond, &handle->inflight_mutex);
+    pthread_mutex_unlock(&handle->inflight_mutex);
+}
+
+/* Called once the kernel holds none of the transfer's URBs. */
+static void usbfs_untrack_transfer(usbyb_device_handle * handle, usbyb_transfer * tran)
+{
+    int index = (tran->pub.endpoint & 0x0f) | ((tran->pub.endpoint & LIBUSBY_ENDPOINT_DIR_MASK) >> 3);
+
+    pthread_mutex_lock(&handle->inflight_mutex);
+    if (tran->inflight_next)
+        tran->inflight_next->inflight_prev = tran->inflight_prev;
+    if (tran->inflight_prev)
+        tran->inflight_prev->inflight_next = tran->inflight_next;
+    else
+        handle->inflight_transfers[index] = tran->inflight_next;
+    pthread_mutex_unlock(&handle->inflight_mutex);
+}
+
+/* Discards the URBs of the transfers listed at `index` and returns the number
+ * of transfers affected. Must be called with `inflight_mutex` held, which keeps
+ * the reaper from completing, and the user from freeing, any of them meanwhile. */
+static int usbfs_discard_endpoint(usbyb_device_handle * handle, int index)
+{
+    usbyb_transfer * tran;
+    int count = 0;
+
+    for (tran = handle->inflight_transfers[index]; tran; tran = tran->inflight_next)
+    {
+        if (usbfs_discard_urbs(handle, tran) >= 0)
+            ++count;
+    }
+
+    return count;
+}
+
+static int usbfs_discard_all(usbyb_device_handle * handle)
+{
+    int count = 0;
+    int i;
+
+    pthread_mutex_lock(&handle->inflight_mutex);
+    for (i = 0; i < 32; ++i)
+        count += usbfs_discard_endpoint(handle, i);
+    pthread_mutex_unlock(&handle->inflight_mutex);
+    return count;
+}
+
+/* Returns the time in milliseconds, as seen by the context's clock. */
+static uint64_t usbfs_now(usbyb_context * ctx)
+{
+    struct timespec ts;
+
+    if (ctx->clock)
+        return ctx->clock(ctx->clock_user_data);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* The timer functions below must be called with `timer_mutex` held. */
+static void usbfs_place_timer(usbfs_shard * shard, usbyb_transfer * tran, int index)
+{
+    shard->timers[index] = tran;
+    tran->timer_index = index;
+}
+
+static void usbfs_sift_timer_up(usbfs_shard * shard, int index)
+{
+    usbyb_transfer * tran = shard->timers[index];
+
+    while (index > 0)
+    {
+        int parent = (index - 1) / 2;
+        if (shard->timers[parent]->deadline <= tran->deadline)
+            break;
+
+        usbfs_place_timer(shard, shard->timers[parent], index);
+        index = parent;
+    }
+
+    usbfs_place_timer(shard, tran, index);
+}
+
+static void usbfs_sift_timer_down(usbfs_shard * shard, int index)
+{
+    usbyb_transfer * tran = shard->timers[index];
+
+    for (;;)
+    {
+        int child = 2 * index + 1;
+        if (child >= shard->timer_count)
+            break;
+
+        if (child + 1 < shard->timer_count && shard->timers[child + 1]->deadline < shard->timers[child]->deadline)
+            ++child;
+        if (tran->deadline <= shard->timers[child]->deadline)
+            break;
+
+        usbfs_place_timer(shard, shard->timers[child], index);
+        index = child;
+    }
+
+    usbfs_place_timer(shard, tran, index);
+}
+
+/* Arms the timerfd for the earliest deadline. A timer left armed for
+ * a transfer that has since completed only causes a spurious wakeup.
+ * With an injected clock, the timerfd is only armed to fire at once for
+ * a deadline that has passed, `usbyb_clock_advanced` rearms it. */
+static void usbfs_arm_timer(usbfs_shard * shard)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof its);
+    if (shard->timer_count)
+    {
+        uint64_t now = usbfs_now(shard->ctx);
+        uint64_t deadline = shard->timers[0]->deadline;
+        uint64_t delay = deadline > now? deadline - now: 0;
+
+        if (shard->ctx->clock && delay)
+        {
+            timerfd_settime(shard->tfd, 0, &its, 0);
+            return;
+        }
+
+        its.it_value.tv_sec = delay / 1000;
+        its.it_value.tv_nsec = (delay % 1000) * 1000000;
+
+        /* An all-zero value would disarm the timer. */
+        if (delay == 0)
+            its.it_value.tv_nsec = 1;
+    }
+
+    timerfd_settime(shard->tfd, 0, &its, 0);
+}
+
+/* Inserts the transfer into the heap without rearming the timerfd. */
+static int usbfs_insert_timer(usbfs_shard * shard, usbyb_transfer * tran)
+{
+    if (shard->timer_count == shard->timer_capacity)
+    {
+        int newcap = shard->timer_capacity == 0? 16: shard->timer_capacity * 2;
+        usbyb_transfer ** newtimers = realloc(shard->timers, sizeof(usbyb_transfer *) * newcap);
+        if (!newtimers)
+            return LIBUSBY_ERROR_NO_MEM;
+
+        shard->timers = newtimers;
+        shard->timer_capacity = newcap;
+    }
+
+    tran->deadline = usbfs_now(shard->ctx) + tran->pub.timeout;
+    usbfs_place_timer(shard, tran, shard->timer_count++);
+    usbfs_sift_timer_up(shard, tran->timer_index);
+    return LIBUSBY_SUCCESS;
+}
+
+/* Must be called with the timer mutex held. Callbacks resubmitting their transfers
+ * on the loop thread thus cost at most one timerfd update per loop iteration. */
+static void usbfs_rearm_timer(usbfs_shard * shard)
+{
+    if (pthread_equal(shard->loop_thread, pthread_self()))
+        shard->timer_rearm = 1;
+    else
+        usbfs_arm_timer(shard);
+}
+
+static void usbfs_flush_timer_rearm(usbfs_shard * shard)
+{
+    pthread_mutex_lock(&shard->timer_mutex);
+    if (shard->timer_rearm)
+    {
+        shard->timer_rearm = 0;
+        usbfs_arm_timer(shard);
+    }
+    pthread_mutex_unlock(&shard->timer_mutex);
+}
+
+static int usbfs_add_timer(usbfs_shard * shard, usbyb_transfer * tran)
+{
+    int r = usbfs_insert_timer(shard, tran);
+    if (r >= 0 && tran->timer_index == 0)
+        usbfs_rearm_timer(shard);
+    return r;
+}
+
+static void usbfs_remove_timer(usbfs_shard * shard, usbyb_transfer * tran)
+{
+    int index = tran->timer_index;
+    usbyb_transfer * last;
+
+    if (index < 0)
+        return;
+
+    tran->timer_index = -1;
+    last = shard->timers[--shard->timer_count];
+    if (last != tran)
+    {
+        usbfs_place_timer(shard, last, index);
+        usbfs_sift_timer_up(shard, index);
+        usbfs_sift_timer_down(shard, last->timer_index);
+    }
+}
+
+/* Drops the timers of the handle's transfers, which will not be reaped
+ * once the handle is closed. */
+static void usbfs_remove_handle_timers(usbfs_shard * shard, usbyb_device_handle * handle)
+{
+    int count = 0;
+    int i;
+
+    pthread_mutex_lock(&shard->timer_mutex);
+    for (i = 0; i < shard->timer_count; ++i)
+    {
+        usbyb_transfer * tran = shard->timers[i];
+        if (tran->pub.dev_handle == &handle->pub)
+            tran->timer_index = -1;
+        else
+            usbfs_place_timer(shard, tran, count++);
+    }
+
+    if (count != shard->timer_count)
+    {
+        shard->timer_count = count;
+        for (i = count / 2 - 1; i >= 0; --i)
+            usbfs_sift_timer_down(shard, i);
+        usbfs_rearm_timer(shard);
+    }
+    pthread_mutex_unlock(&shard->timer_mutex);
+}
+
+/* Discards the URBs whose deadline has passed. They are reaped as usual
+ * and reported as timed out. Must be called from the shard's loop thread. */
+static void usbfs_expire_timers(usbfs_shard * shard)
+{
+    uint64_t now;
+
+    pthread_mutex_lock(&shard->timer_mutex);
+    now = usbfs_now(shard->ctx);
+    while (shard->timer_count && shard->timers[0]->deadline <= now)
+    {
+        usbyb_transfer * tran = shard->timers[0];
+        usbyb_device_handle * handle = (usbyb_device_handle *)tran->pub.dev_handle;
+
+        /* Timers are only removed by the loop thread as the transfers are reaped,
+         * so the URB is still owned by the kernel. */
+        usbfs_remove_timer(shard, tran);
+        tran->timed_out = 1;
+        usbfs_discard_urbs(handle, tran);
+    }
+
+    shard->timer_rearm = 0;
+    usbfs_arm_timer(shard);
+    pthread_mutex_unlock(&shard->timer_mutex);
+}
+
+static libusby_transfer_status usbfs_urb_status(int status)
+{
+    switch (status)
+    {
+    case 0:
+        return LIBUSBY_TRANSFER_COMPLETED;
+    case -ENOENT:
+    case -ECONNRESET:
+        return LIBUSBY_TRANSFER_CANCELLED;
+    case -EPIPE:
+        return LIBUSBY_TRANSFER_STALL;
+    case -ENODEV:
+    case -ESHUTDOWN:
+        return LIBUSBY_TRANSFER_NO_DEVICE;
+    case -EOVERFLOW:
+        return LIBUSBY_TRANSFER_OVERFLOW;
+    default:
+        return LIBUSBY_TRANSFER_ERROR;
+    }
+}
+
+/* Maps the errno of a synchronous USBDEVFS_CONTROL or USBDEVFS_BULK call. Unlike URB
+ * statuses, ENOENT here means the endpoint does not exist rather than a cancellation. */
+static libusby_transfer_status usbfs_sync_status(int err)
+{
+    switch (err)
+    {
+    case ETIMEDOUT:
+        return LIBUSBY_TRANSFER_TIMED_OUT;
+    case ENOENT:
+        return LIBUSBY_TRANSFER_ERROR;
+    default:
+        return usbfs_urb_status(-err);
+    }
+}
+
+/* The same mapping for callers that return an error rather than a status. */
+static int usbfs_sync_error(int err)
+{
+    switch (err)
+    {
+    case ETIMEDOUT:
+        return LIBUSBY_ERROR_TIMEOUT;
+    case EPIPE:
+        return LIBUSBY_ERROR_PIPE;
+    case ENODEV:
+    case ESHUTDOWN:
+        return LIBUSBY_ERROR_NO_DEVICE;
+    case EOVERFLOW:
+        return LIBUSBY_ERROR_OVERFLOW;
+    case ENOMEM:
+        return LIBUSBY_ERROR_NO_MEM;
+    case EINVAL:
+        return LIBUSBY_ERROR_INVALID_PARAM;
+    case EACCES:
+    case EPERM:
+        return LIBUSBY_ERROR_ACCESS;
+    case EBUSY:
+        return LIBUSBY_ERROR_BUSY;
+    case EINTR:
+        return LIBUSBY_ERROR_INTERRUPTED;
+    default:
+        return LIBUSBY_ERROR_IO;
+    }
+}
+
+static void usbfs_dispatch_batch(usbfs_shard * shard, int count)
+{
+    usbyb_context * ctx = shard->ctx;
+    libusby_transfer ** batch = shard->batch;
+    int callbacks = 0;
+    int i;
+
+    /* Queued completions are posted first and never reach the callbacks. */
+    for (i = 0; i < count; ++i)
+    {
+        usbyb_transfer * tran = usbyi_get_tran(batch[i]);
+        usbyb_device_handle * handle = (usbyb_device_handle *)tran->pub.dev_handle;
+
+        if (tran->queue)
+        {
+            usbfs_post_completion(tran);
+            usbfs_release_pending(handle);
+            continue;
+        }
+
+        __atomic_store_n(&tran->active, 2, __ATOMIC_SEQ_CST);
+        usbfs_release_pending(handle);
+        batch[callbacks++] = batch[i];
+    }
+
+    count = callbacks;
+    if (!count)
+        return;
+
+    if (!ctx->batch_callback && __atomic_load_n(&ctx->dispatcher.thread_count, __ATOMIC_SEQ_CST))
+    {
+        usbfs_dispatch_callbacks(&ctx->dispatcher, batch, count);
+        return;
+    }
+
+    if (ctx->batch_callback)
+    {
+        ctx->batch_callback(batch, count, ctx->batch_user_data);
+    }
+    else
+    {
+        for (i = 0; i < count; ++i)
+        {
+            if (batch[i]->callback)
+                batch[i]->callback(batch[i]);
+        }
+    }
+
+    for (i = 0; i < count; ++i)
+        usbfs_finish_callback(usbyi_get_tran(batch[i]));
+}
+
+/* Accounts for one URB of a split transfer. Returns nonzero once the last one
+ * has been reaped and the transfer is complete. */
+static int usbfs_reap_split_urb(usbyb_transfer * tran, struct usbdevfs_urb * urb)
+{
+    int status = urb->status;
+
+    tran->pub.actual_length += urb->actual_length;
+
+    /* A short packet ends the transfer early, the kernel then cancels
+     * the continuation URBs queued after it. */
+    if (status == -EREMOTEIO)
+    {
+        tran->split_short = 1;
+        status = 0;
+    }
+    else if (tran->split_short && (status == -ENOENT || status == -ECONNRESET))
+    {
+        status = 0;
+    }
+
+    if (status != 0)
+    {
+        int expected = 0;
+        __atomic_compare_exchange_n(&tran->split_status, &expected, status, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+
+    if (__atomic_sub_fetch(&tran->urbs_pending, 1, __ATOMIC_SEQ_CST) != 0)
+        return 0;
+
+    tran->pub.status = usbfs_urb_status(__atomic_load_n(&tran->split_status, __ATOMIC_SEQ_CST));
+    return 1;
+}
+
+/* Reaps every completed URB of the handle, until the kernel reports there is nothing left. */
+static int usbfs_reap_handle(usbfs_shard * shard, usbyb_device_handle * handle, int count)
+{
+    struct usbdevfs_urb * urb;
+    usbyb_transfer * tran;
+
+    /* The handle was moved to another shard after the event was gathered. */
+    if (__atomic_load_n(&handle->shard, __ATOMIC_SEQ_CST) != shard)
+        return count;
+
+    for (;;)
+    {
+        if (count == shard->batch_capacity)
+        {
+            int newcap = shard->batch_capacity == 0? 16: shard->batch_capacity * 2;
+            libusby_transfer ** newbatch = realloc(shard->batch, sizeof(libusby_transfer *) * newcap);
+            if (newbatch)
+            {
+                shard->batch = newbatch;
+                shard->batch_capacity = newcap;
+            }
+            else
+            {
+                usbfs_dispatch_batch(shard, count);
+                count = 0;
+            }
+        }
+
+        if (ioctl(handle->wrfd, USBDEVFS_REAPURBNDELAY, &urb) < 0)
+            break;
+
+        tran = urb->usercontext;
+        __atomic_sub_fetch(&handle->inflight, 1, __ATOMIC_RELAXED);
+
+        if (tran->urb_count > 1)
+        {
+            if (!usbfs_reap_split_urb(tran, urb))
+                continue;
+        }
+        else
+        {
+            tran->pub.actual_length = tran->req->actual_length;
+            if (tran->pub.type == LIBUSBY_TRANSFER_TYPE_CONTROL)
+                tran->pub.actual_length += 8;
+            tran->pub.status = usbfs_urb_status(tran->req->status);
+        }
+
+        if (tran->pub.type == LIBUSBY_TRANSFER_TYPE_ISOCHRONOUS)
+        {
+            int i;
+            for (i = 0; i < tran->pub.num_iso_packets; ++i)
+            {
+                libusby_iso_packet_descriptor * packet = &tran->pub.iso_packet_desc[i];
+                packet->actual_length = tran->req->iso_frame_desc[i].actual_length;
+                packet->status = usbfs_urb_status((int)tran->req->iso_frame_desc[i].status);
+            }
+        }
+
+        if (tran->pub.timeout)
+        {
+            pthread_mutex_lock(&shard->timer_mutex);
+            usbfs_remove_timer(shard, tran);
+            pthread_mutex_unlock(&shard->timer_mutex);
+
+            if (tran->timed_out && tran->pub.status == LIBUSBY_TRANSFER_CANCELLED)
+                tran->pub.status = LIBUSBY_TRANSFER_TIMED_OUT;
+        }
+
+        usbfs_untrack_transfer(handle, tran);
+        shard->batch[count++] = &tran->pub;
+    }
+
+    /* A disconnected device stays readable forever, stop watching it
+     * once there is nothing left to reap. */
+    if (errno == ENODEV)
+        usbfs_unwatch_handle(handle);
+
+    return count;
+}
+
+/* Hands the unlocked loop over to a thread still waiting for its transfer.
+ * Must be called with the shard's mutex held. */
+static void usbfs_handoff_loop(usbfs_shard * shard)
+{
+    usbyb_transfer * waiter = shard->waiters;
+
+    if (!waiter || shard->loop_locked)
+        return;
+
+    __atomic_store_n(&waiter->handoff, 1, __ATOMIC_SEQ_CST);
+    usbfs_signal_transfer(waiter);
+}
+
+/* Blocks until some of the watched fds become ready and stores their tokens. */
+static int usbfs_wait_events(usbfs_shard * shard, void ** tokens)
+{
+    struct epoll_event events[USBFS_MAX_EVENTS];
+    int event_count;
+    int i;
+
+    if (shard->uring)
+        return usbfs_uring_wait(shard->uring, tokens, USBFS_MAX_EVENTS);
+
+    event_count = epoll_wait(shard->epfd, events, USBFS_MAX_EVENTS, -1);
+    if (event_count < 0)
+        return errno == EINTR? 0: LIBUSBY_ERROR_IO;
+
+    for (i = 0; i < event_count; ++i)
+        tokens[i] = events[i].data.ptr;
+    return event_count;
+}
+
+/* Polls the handle of `tran` without blocking for up to `budget_us` microseconds
+ * and returns the number of transfers reaped, which need not include `tran`. */
+static int usbfs_spin_reap(usbfs_shard * shard, usbyb_transfer * tran, int budget_us)
+{
+    usbyb_device_handle * handle = (usbyb_device_handle *)tran->pub.dev_handle;
+    struct timespec start, now;
+    int completed;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;)
+    {
+        completed = usbfs_reap_handle(shard, handle, 0);
+        if (completed || errno == ENODEV)
+            return completed;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000 >= budget_us)
+            return 0;
+    }
+}
+
+/* Must be called with `ctx_mutex` held. */
+static usbyb_device * usbfs_find_device(usbyb_context * ctx, int busno, int devno)
+{
+    usbyi_device_list_node * devnode;
+
+    for (devnode = ctx->devlist_head.next; devnode != &ctx->devlist_head; devnode = devnode->next)
+    {
+        usbyb_device * dev = container_of(devnode, usbyb_device, devnode);
+        if (dev->busno == busno && dev->devno == devno)
+            return dev;
+    }
+
+    return 0;
+}
+
+/* Opens the device's node and adds the device to the list with its descriptors cached.
+ * Returns `LIBUSBY_ERROR_NOT_FOUND` if the node cannot be opened or read.
+ * Must be called with `ctx_mutex` held. */
+static int usbfs_new_device(usbyb_context * ctx, int busno, int devno, usbyb_device ** result)
+{
+    char fname[32];
+    usbyb_device * dev;
+    size_t cache_len = 0;
+    int fd;
+    int i;
+    int r = LIBUSBY_ERROR_NOT_FOUND;
+
+    sprintf(fname, "/dev/bus/usb/%03d/%03d", busno, devno);
+    fd = open(fname, O_RDONLY);
+    if (fd == -1)
+        return LIBUSBY_ERROR_NOT_FOUND;
+
+    dev = usbyi_alloc_device(ctx);
+    if (!dev)
+    {
+        close(fd);
+        return LIBUSBY_ERROR_NO_MEM;
+    }
+
+    dev->busno = busno;
+    dev->devno = devno;
+    dev->fd = fd;
+    usbyi_insert_before_devlist_node(&dev->devnode, &ctx->devlist_head);
+
+    /* Note that the device descriptor is read in host-endian. */
+    if (read(fd, &dev->pub.device_desc, sizeof dev->pub.device_desc) != sizeof dev->pub.device_desc)
+        goto error;
+
+    for (i = 0; i < dev->pub.device_desc.bNumConfigurations; ++i)
+    {
+        uint8_t config_header[4];
+        uint16_t wTotalLength;
+        uint8_t * cache;
+
+        if (read(fd, config_header, sizeof config_header) != sizeof config_header)
+            goto error;
+        wTotalLength = config_header[2] | (config_header[3] << 8);
+        if (wTotalLength < sizeof config_header)
+            goto error;
+
+        cache = realloc(dev->desc_cache, cache_len + wTotalLength);
+        if (!cache)
+        {
+            r = LIBUSBY_ERROR_NO_MEM;
+            goto error;
+        }
+        dev->desc_cache = cache;
+
+        memcpy(dev->desc_cache + cache_len, config_header, sizeof config_header);
+        if (read(fd, dev->desc_cache + cache_len + sizeof config_header, wTotalLength - sizeof config_header)
+                != (int)(wTotalLength - sizeof config_header))
+        {
+            goto error;
+        }
+
+        cache_len += wTotalLength;
+    }
+
+    *result = dev;
+    return LIBUSBY_SUCCESS;
+
+error:
+    libusby_unref_device(&dev->pub);
+    return r;
+}
+
+static int usbfs_hotplug_matches(usbfs_hotplug_callback const * cb, usbyb_device * dev, libusby_hotplug_event event)
+{
+    libusby_device_descriptor const * desc = &dev->pub.device_desc;
+
+    return !cb->deregistered && (cb->events & event)
+        && (cb->vendor_id == LIBUSBY_HOTPLUG_MATCH_ANY || cb->vendor_id == desc->idVendor)
+        && (cb->product_id == LIBUSBY_HOTPLUG_MATCH_ANY || cb->product_id == desc->idProduct)
+        && (cb->dev_class == LIBUSBY_HOTPLUG_MATCH_ANY || cb->dev_class == desc->bDeviceClass);
+}
+
+/* Runs the callback without holding `ctx_mutex`, which must be held on entry. The caller
+ * must have raised `hotplug_dispatching`, so that the callback is not freed meanwhile. */
+static void usbfs_hotplug_call(usbyb_context * ctx, usbfs_hotplug_callback * cb, usbyb_device * dev, libusby_hotplug_event event)
+{
+    int r;
+
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+    r = cb->callback(ctx, &dev->pub, event, cb->user_data);
+    pthread_mutex_lock(&ctx->ctx_mutex);
+
+    if (r)
+        cb->deregistered = 1;
+}
+
+/* Frees the deregistered callbacks. Must be called with `ctx_mutex` held
+ * and no callback being run. */
+static void usbfs_hotplug_sweep(usbyb_context * ctx)
+{
+    usbfs_hotplug_callback ** link = &ctx->hotplug_callbacks;
+
+    while (*link)
+    {
+        usbfs_hotplug_callback * cb = *link;
+        if (cb->deregistered)
+        {
+            *link = cb->next;
+            free(cb);
+        }
+        else
+        {
+            link = &cb->next;
+        }
+    }
+}
+
+/* Must be called with `ctx_mutex` held. */
+static void usbfs_hotplug_notify(usbyb_context * ctx, usbyb_device * dev, libusby_hotplug_event event)
+{
+    usbfs_hotplug_callback * cb;
+
+    ++ctx->hotplug_dispatching;
+    for (cb = ctx->hotplug_callbacks; cb; cb = cb->next)
+    {
+        if (usbfs_hotplug_matches(cb, dev, event))
+            usbfs_hotplug_call(ctx, cb, dev, event);
+    }
+
+    if (--ctx->hotplug_dispatching == 0)
+        usbfs_hotplug_sweep(ctx);
+}
+
+/* Must be called with `ctx_mutex` held. */
+static void usbfs_device_left(usbyb_context * ctx, int busno, int devno)
+{
+    usbyb_device * dev = usbfs_find_device(ctx, busno, devno);
+    if (!dev)
+        return;
+
+    /* Unlinked right away, so that a device that gets the same address later
+     * is not mistaken for it. Finalizing a self-linked node does nothing. */
+    usbyi_remove_devlist_node(&dev->devnode);
+    usbyi_init_devlist_head(&dev->devnode);
+
+    if (!dev->hotplug_ref)
+        return;
+
+    dev->hotplug_ref = 0;
+    usbfs_hotplug_notify(ctx, dev, LIBUSBY_HOTPLUG_EVENT_DEVICE_LEFT);
+    libusby_unref_device(&dev->pub);
+}
+
+/* Whether the node at the device's address is still the one its fd was opened from.
+ * The kernel hands out addresses again, so the device may have been replaced
+ * while its uevents were lost or while nothing was monitoring them. */
+static int usbfs_same_node(usbyb_device * dev)
+{
+    char fname[32];
+    struct stat node_st;
+    struct stat fd_st;
+
+    sprintf(fname, "/dev/bus/usb/%03d/%03d", dev->busno, dev->devno);
+    if (stat(fname, &node_st) < 0 || fstat(dev->fd, &fd_st) < 0)
+        return 0;
+    return node_st.st_dev == fd_st.st_dev && node_st.st_ino == fd_st.st_ino;
+}
+
+/* Like `usbfs_find_device`, but a listed device whose node was replaced is
+ * treated as having left first. Must be called with `ctx_mutex` held. */
+static usbyb_device * usbfs_find_current_device(usbyb_context * ctx, int busno, int devno)
+{
+    usbyb_device * dev;
+
+    /* Leaving unlinks the device, the loop ends. The lock is dropped while
+     * callbacks run, so the address is looked up again each time. */
+    while ((dev = usbfs_find_device(ctx, busno, devno)) != 0 && !usbfs_same_node(dev))
+        usbfs_device_left(ctx, busno, devno);
+    return dev;
+}
+
+/* Must be called with `ctx_mutex` held. */
+static void usbfs_device_arrived(usbyb_context * ctx, int busno, int devno)
+{
+    usbyb_device * dev = usbfs_find_current_device(ctx, busno, devno);
+
+    /* The device may have been listed already, by the user or by a uevent
+     * that raced with the scan made when monitoring started. */
+    if (dev)
+    {
+        if (dev->hotplug_ref)
+            return;
+        libusby_ref_device(&dev->pub);
+    }
+    else if (usbfs_new_device(ctx, busno, devno, &dev) < 0)
+    {
+        return;
+    }
+
+    dev->hotplug_ref = 1;
+    usbfs_hotplug_notify(ctx, dev, LIBUSBY_HOTPLUG_EVENT_DEVICE_ARRIVED);
+}
+
+/* Parses a kernel uevent, a header followed by NUL-terminated KEY=value pairs.
+ * Returns the hotplug event for a USB device being added or removed, zero otherwise. */
+static int usbfs_parse_uevent(char const * msg, size_t len, int * busno, int * devno)
+{
+    char const * end = msg + len;
+    int event = 0;
+    int is_usb_device = 0;
+    int is_usb = 0;
+
+    *busno = -1;
+    *devno = -1;
+
+    for (; msg < end; msg += strlen(msg) + 1)
+    {
+        if (strcmp(msg, "ACTION=add") == 0)
+            event = LIBUSBY_HOTPLUG_EVENT_DEVICE_ARRIVED;
+        else if (strcmp(msg, "ACTION=remove") == 0)
+            event = LIBUSBY_HOTPLUG_EVENT_DEVICE_LEFT;
+        else if (strcmp(msg, "SUBSYSTEM=usb") == 0)
+            is_usb = 1;
+        else if (strcmp(msg, "DEVTYPE=usb_device") == 0)
+            is_usb_device = 1;
+        else if (strncmp(msg, "BUSNUM=", 7) == 0)
+            *busno = atoi(msg + 7);
+        else if (strncmp(msg, "DEVNUM=", 7) == 0)
+            *devno = atoi(msg + 7);
+    }
+
+    if (!is_usb || !is_usb_device || *busno < 0 || *devno < 0)
+        return 0;
+    return event;
+}
+
+/* Called by the first shard's loop whenever the uevent socket is readable. */
+static void usbfs_process_uevents(usbyb_context * ctx)
+{
+    char buf[4096];
+
+    for (;;)
+    {
+        struct sockaddr_nl sender;
+        struct iovec iov;
+        struct msghdr msg;
+        ssize_t len;
+        int busno, devno;
+        int event;
+
+        iov.iov_base = buf;
+        iov.iov_len = sizeof buf - 1;
+        memset(&msg, 0, sizeof msg);
+        memset(&sender, 0, sizeof sender);
+        msg.msg_name = &sender;
+        msg.msg_namelen = sizeof sender;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        len = recvmsg(ctx->hotplug_fd, &msg, MSG_DONTWAIT);
+        if (len < 0)
+        {
+            /* The socket's buffer overflowed and some uevents were lost. */
+            if (errno == ENOBUFS)
+                continue;
+            break;
+        }
+
+        /* On a netlink socket, only the kernel's messages are trusted. */
+        if (msg.msg_namelen == sizeof sender && sender.nl_family == AF_NETLINK && sender.nl_pid != 0)
+            continue;
+
+        buf[len] = 0;
+        event = usbfs_parse_uevent(buf, len, &busno, &devno);
+        if (!event)
+            continue;
+
+        pthread_mutex_lock(&ctx->ctx_mutex);
+        if (event == LIBUSBY_HOTPLUG_EVENT_DEVICE_ARRIVED)
+            usbfs_device_arrived(ctx, busno, devno);
+        else
+            usbfs_device_left(ctx, busno, devno);
+        pthread_mutex_unlock(&ctx->ctx_mutex);
+    }
+}
+
+/* Stops monitoring and drops the context's references. The event loops must have stopped. */
+static void usbfs_stop_hotplug(usbyb_context * ctx)
+{
+    usbyi_device_list_node * devnode;
+
+    if (ctx->hotplug_fd < 0)
+        return;
+
+    if (ctx->shards[0].uring)
+        usbfs_uring_unwatch(ctx->shards[0].uring, ctx->hotplug_watch);
+    else
+        epoll_ctl(ctx->shards[0].epfd, EPOLL_CTL_DEL, ctx->hotplug_fd, 0);
+
+    if (ctx->hotplug_fd != ctx->hotplug_source_fd)
+        close(ctx->hotplug_fd);
+    ctx->hotplug_fd = -1;
+
+    while (ctx->hotplug_callbacks)
+    {
+        usbfs_hotplug_callback * cb = ctx->hotplug_callbacks;
+        ctx->hotplug_callbacks = cb->next;
+        free(cb);
+    }
+
+    devnode = ctx->devlist_head.next;
+    while (devnode != &ctx->devlist_head)
+    {
+        usbyb_device * dev = container_of(devnode, usbyb_device, devnode);
+        devnode = devnode->next;
+
+        if (dev->hotplug_ref)
+        {
+            dev->hotplug_ref = 0;
+            libusby_unref_device(&dev->pub);
+        }
+    }
+}
+
+/* Tells whether the loop is still needed, either until `watch_tran` completes,
+ * until `watch_handle` has no pending transfers, or until it is stopped. */
+static int usbfs_loop_wanted(usbyb_context * ctx, usbyb_transfer * watch_tran, usbyb_device_handle * watch_handle)
+{
+    if (watch_tran)
+        return __atomic_load_n(&watch_tran->active, __ATOMIC_SEQ_CST);
+    if (watch_handle)
+        return __atomic_load_n(&watch_handle->pending, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ctx->loop_enabled, __ATOMIC_SEQ_CST);
+}
+
+/* Must be called with the shard's mutex held and its loop unlocked. When `watch_tran`
+ * is set, the loop is run until the transfer completes, regardless of whether
+ * the loop was stopped, and likewise with `watch_handle` until it has no pending transfers. */
+static int usbfs_run_event_loop_impl(usbfs_shard * shard, usbyb_transfer * watch_tran, usbyb_device_handle * watch_handle)
+{
+    usbyb_context * ctx = shard->ctx;
+    void * tokens[USBFS_MAX_EVENTS];
+    int spin_us = watch_tran? __atomic_load_n(&ctx->spin_wait_us, __ATOMIC_RELAXED): 0;
+    int i;
+    int r = LIBUSBY_SUCCESS;
+
+    assert(!shard->loop_locked);
+    shard->loop_locked = 1;
+    shard->loop_thread = pthread_self();
+    __atomic_store_n(&shard->loop_watch, watch_tran, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&shard->mutex);
+
+    while (r >= 0 && usbfs_loop_wanted(ctx, watch_tran, watch_handle))
+    {
+        int event_count;
+        int completed = 0;
+        int uevents = 0;
+
+        __atomic_add_fetch(&shard->loop_epoch, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&shard->quiescers, __ATOMIC_SEQ_CST))
+        {
+            pthread_mutex_lock(&shard->mutex);
+            pthread_cond_broadcast(&shard->cond);
+            pthread_mutex_unlock(&shard->mutex);
+        }
+
+        /* Spin only once, events for other handles are held up meanwhile. */
+        if (spin_us)
+        {
+            completed = usbfs_spin_reap(shard, watch_tran, spin_us);
+            spin_us = 0;
+            if (completed)
+            {
+                usbfs_dispatch_batch(shard, completed);
+                continue;
+            }
+        }
+
+        if (shard->timer_rearm)
+            usbfs_flush_timer_rearm(shard);
+
+        event_count = usbfs_wait_events(shard, tokens);
+        if (event_count < 0)
+            r = event_count;
+
+        for (i = 0; i < event_count; ++i)
+        {
+            if (tokens[i] == &shard->evfd)
+            {
+                uint64_t value;
+                __atomic_store_n(&shard->wakeup_pending, 0, __ATOMIC_SEQ_CST);
+                if (read(shard->evfd, &value, sizeof value) < 0 && errno != EAGAIN)
+                    r = LIBUSBY_ERROR_IO;
+                __atomic_add_fetch(&shard->stats.wakeups_received, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+
+            if (tokens[i] == &shard->tfd)
+            {
+                uint64_t value;
+                if (read(shard->tfd, &value, sizeof value) < 0 && errno != EAGAIN)
+                    r = LIBUSBY_ERROR_IO;
+                usbfs_expire_timers(shard);
+                continue;
+            }
+
+            /* Hotplug callbacks may close handles, they are run
+             * only once no token of this wait is left to be handled. */
+            if (tokens[i] == &ctx->hotplug_fd)
+            {
+                uevents = 1;
+                continue;
+            }
+
+            completed = usbfs_reap_handle(shard, tokens[i], completed);
+        }
+
+        if (completed)
+            usbfs_dispatch_batch(shard, completed);
+        if (uevents)
+            usbfs_process_uevents(ctx);
+    }
+
+    /* The next loop thread must find the timerfd armed. */
+    usbfs_flush_timer_rearm(shard);
+
+    pthread_mutex_lock(&shard->mutex);
+    shard->loop_locked = 0;
+    memset(&shard->loop_thread, 0, sizeof shard->loop_thread);
+    __atomic_store_n(&shard->loop_watch, 0, __ATOMIC_SEQ_CST);
+
+    pthread_cond_broadcast(&shard->cond);
+    usbfs_handoff_loop(shard);
+    return r;
+}
+
+static int usbfs_run_shard(usbfs_shard * shard)
+{
+    usbyb_context * ctx = shard->ctx;
+    int r = LIBUSBY_SUCCESS;
+
+    pthread_mutex_lock(&shard->mutex);
+    while (ctx->loop_enabled && shard->loop_locked)
+        pthread_cond_wait(&shard->cond, &shard->mutex);
+    if (ctx->loop_enabled)
+        r = usbfs_run_event_loop_impl(shard, 0, 0);
+    pthread_mutex_unlock(&shard->mutex);
+    return r;
+}
+
+static void * usbfs_shard_thread(void * param)
+{
+    return (void *)(intptr_t)usbfs_run_shard(param);
+}
+
+int usbyb_run_event_loop(usbyb_context * ctx)
+{
+    pthread_t * threads = 0;
+    int shard_count;
+    int started = 0;
+    int i;
+    int r = LIBUSBY_SUCCESS;
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    ++ctx->running_loops;
+    shard_count = ctx->shard_count;
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+
+    /* The calling thread serves the first shard, the others get a thread each. */
+    if (shard_count > 1)
+    {
+        threads = malloc(sizeof(pthread_t) * (shard_count - 1));
+        if (!threads)
+            r = LIBUSBY_ERROR_NO_MEM;
+    }
+
+    for (i = 1; r >= 0 && i < shard_count; ++i)
+    {
+        if (pthread_create(&threads[i-1], 0, &usbfs_shard_thread, &ctx->shards[i]) != 0)
+            r = LIBUSBY_ERROR_NO_MEM;
+        else
+            ++started;
+    }
+
+    if (r >= 0)
+        r = usbfs_run_shard(&ctx->shards[0]);
+    else
+        usbyb_stop_event_loop(ctx);
+
+    for (i = 0; i < started; ++i)
+    {
+        void * res;
+        pthread_join(threads[i], &res);
+        if (r >= 0 && (intptr_t)res < 0)
+            r = (intptr_t)res;
+    }
+
+    free(threads);
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    --ctx->running_loops;
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+    return r;
+}
+
+int usbyb_wait_for_transfer(usbyb_transfer * tran)
+{
+    usbyb_device_handle * handle = (usbyb_device_handle *)tran->pub.dev_handle;
+    usbfs_shard * shard = handle->shard;
+    int r = LIBUSBY_SUCCESS;
+
+    pthread_mutex_lock(&shard->mutex);
+    while (r >= 0 && __atomic_load_n(&tran->active, __ATOMIC_SEQ_CST))
+    {
+        if (!shard->loop_locked)
+        {
+            r = usbfs_run_event_loop_impl(shard, tran, 0);
+            continue;
+        }
+
+        /* Someone else is reaping, wait for them to either complete
+         * the transfer or to give up the loop. */
+        tran->intrn.prev = 0;
+        tran->intrn.next = shard->waiters;
+        if (shard->waiters)
+            shard->waiters->intrn.prev = tran;
+        shard->waiters = tran;
+        __atomic_store_n(&tran->handoff, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&shard->mutex);
+
+        /* The sequence is sampled before the conditions are checked,
+         * so a wakeup sent in between makes the wait return at once. */
+        __atomic_store_n(&tran->waiting, 1, __ATOMIC_SEQ_CST);
+        for (;;)
+        {
+            int seq = __atomic_load_n(&tran->wake_seq, __ATOMIC_SEQ_CST);
+            if (!__atomic_load_n(&tran->active, __ATOMIC_SEQ_CST) || __atomic_load_n(&tran->handoff, __ATOMIC_SEQ_CST))
+                break;
+            syscall(SYS_futex, &tran->wake_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+        }
+        __atomic_store_n(&tran->waiting, 0, __ATOMIC_SEQ_CST);
+
+        pthread_mutex_lock(&shard->mutex);
+        if (tran->intrn.next)
+            tran->intrn.next->intrn.prev = tran->intrn.prev;
+        if (tran->intrn.prev)
+            tran->intrn.prev->intrn.next = tran->intrn.next;
+        else
+            shard->waiters = tran->intrn.next;
+    }
+
+    /* We might have been handed the loop just as our transfer completed. */
+    usbfs_handoff_loop(shard);
+    pthread_mutex_unlock(&shard->mutex);
+
+    return r;
+}
+
+static void * usbfs_event_thread(void * param)
+{
+    return (void *)(intptr_t)usbyb_run_event_loop(param);
+}
+
+static int usbfs_errno_error(int err)
+{
+    switch (err)
+    {
+    case EPERM:
+        return LIBUSBY_ERROR_ACCESS;
+    case EINVAL:
+        return LIBUSBY_ERROR_INVALID_PARAM;
+    case ENOMEM:
+    case EAGAIN:
+        return LIBUSBY_ERROR_NO_MEM;
+    default:
+        return LIBUSBY_ERROR_OTHER;
+    }
+}
+
+/* Whether some of the process's memory is locked already, by the application
+ * or for another context's thread. */
+static int usbfs_memory_already_locked(void)
+{
+    FILE * f = fopen("/proc/self/status", "r");
+    char line[128];
+    long kb = 0;
+
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof line, f))
+    {
+        if (sscanf(line, "VmLck: %ld", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb > 0;
+}
+
+int usbyb_start_event_thread(usbyb_context * ctx, libusby_thread_attrs const * attrs)
+{
+    pthread_attr_t attr;
+    int unlock_memory = 0;
+    int err;
+
+    if (attrs->sched_policy != LIBUSBY_SCHED_OTHER && attrs->sched_policy != LIBUSBY_SCHED_FIFO)
+        return LIBUSBY_ERROR_INVALID_PARAM;
+
+    if (pthread_attr_init(&attr) != 0)
+        return LIBUSBY_ERROR_NO_MEM;
+
+    /* Set on the attributes rather than by the thread itself, so that
+     * a missing privilege surfaces here. Shard threads inherit both. */
+    err = 0;
+    if (attrs->cpu_mask)
+    {
+        cpu_set_t cpus;
+        int i;
+
+        CPU_ZERO(&cpus);
+        for (i = 0; i < 64; ++i)
+        {
+            if (attrs->cpu_mask & ((uint64_t)1 << i))
+                CPU_SET(i, &cpus);
+        }
+        err = pthread_attr_setaffinity_np(&attr, sizeof cpus, &cpus);
+    }
+
+    if (!err)
+    {
+        struct sched_param param;
+        memset(&param, 0, sizeof param);
+        param.sched_priority = attrs->sched_priority;
+
+        err = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        if (!err)
+            err = pthread_attr_setschedpolicy(&attr, attrs->sched_policy == LIBUSBY_SCHED_FIFO? SCHED_FIFO: SCHED_OTHER);
+        if (!err)
+            err = pthread_attr_setschedparam(&attr, &param);
+    }
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    if (ctx->event_thread_started)
+    {
+        pthread_mutex_unlock(&ctx->ctx_mutex);
+        pthread_attr_destroy(&attr);
+        return LIBUSBY_ERROR_BUSY;
+    }
+
+    /* Locked only once nothing else can fail before the thread runs, and unlocked
+     * again by `usbfs_join_event_thread` unless something else had locked memory
+     * before, since `munlockall` would undo those locks too. Beyond RLIMIT_MEMLOCK,
+     * an unprivileged process gets ENOMEM rather than EPERM. */
+    if (!err && attrs->lock_memory)
+    {
+        unlock_memory = !usbfs_memory_already_locked();
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+            err = errno == ENOMEM? EPERM: errno;
+    }
+    if (!err)
+    {
+        err = pthread_create(&ctx->event_thread, &attr, &usbfs_event_thread, ctx);
+        if (err && unlock_memory)
+            munlockall();
+    }
+    if (!err)
+    {
+        ctx->event_thread_started = 1;
+        ctx->memory_locked = unlock_memory;
+    }
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+
+    pthread_attr_destroy(&attr);
+    return err? usbfs_errno_error(err): LIBUSBY_SUCCESS;
+}
+
+/* Joins the thread started by `usbyb_start_event_thread` unless called from it,
+ * in which case it is left for a later stop or for `usbyb_exit`. */
+static void usbfs_join_event_thread(usbyb_context * ctx)
+{
+    pthread_t thread;
+    int join = 0;
+    int unlock_memory = 0;
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    if (ctx->event_thread_started && !pthread_equal(ctx->event_thread, pthread_self()))
+    {
+        thread = ctx->event_thread;
+        ctx->event_thread_started = 0;
+        unlock_memory = ctx->memory_locked;
+        ctx->memory_locked = 0;
+        join = 1;
+    }
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+
+    if (join)
+        pthread_join(thread, 0);
+    if (unlock_memory)
+        munlockall();
+}
+
+void usbyb_stop_event_loop(usbyb_context * ctx)
+{
+    int i;
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    __atomic_store_n(&ctx->loop_enabled, 0, __ATOMIC_SEQ_CST);
+    for (i = 0; i < ctx->shard_count; ++i)
+    {
+        usbfs_shard * shard = &ctx->shards[i];
+
+        pthread_mutex_lock(&shard->mutex);
+        if (shard->loop_locked)
+            usbfs_wakeup(shard);
+        pthread_cond_broadcast(&shard->cond);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+
+    usbfs_join_event_thread(ctx);
+}
+
+void usbyb_set_batch_callback(usbyb_context * ctx, libusby_batch_cb_fn callback, void * user_data)
+{
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    ctx->batch_callback = callback;
+    ctx->batch_user_data = user_data;
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+}
+
+/* The clock is read under the timer mutexes, all of which are held while
+ * it is replaced. Deadlines already in the heaps would be measured against
+ * the wrong clock, so it cannot be replaced while there are any. */
+int usbyb_set_clock(usbyb_context * ctx, libusby_clock_fn clock, void * user_data)
+{
+    int r = LIBUSBY_SUCCESS;
+    int i;
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    for (i = 0; i < ctx->shard_count; ++i)
+    {
+        pthread_mutex_lock(&ctx->shards[i].timer_mutex);
+        if (ctx->shards[i].timer_count)
+            r = LIBUSBY_ERROR_BUSY;
+    }
+
+    if (r >= 0)
+    {
+        ctx->clock_user_data = user_data;
+        ctx->clock = clock;
+    }
+
+    for (i = 0; i < ctx->shard_count; ++i)
+        pthread_mutex_unlock(&ctx->shards[i].timer_mutex);
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+    return r;
+}
+
+int usbyb_clock_advanced(usbyb_context * ctx)
+{
+    int i;
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    for (i = 0; i < ctx->shard_count; ++i)
+    {
+        usbfs_shard * shard = &ctx->shards[i];
+
+        pthread_mutex_lock(&shard->timer_mutex);
+        usbfs_rearm_timer(shard);
+        pthread_mutex_unlock(&shard->timer_mutex);
+    }
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+    return LIBUSBY_SUCCESS;
+}
+
+int usbyb_get_event_loop_stats(usbyb_context * ctx, libusby_event_loop_stats * stats)
+{
+    int i;
+
+    memset(stats, 0, sizeof *stats);
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    for (i = 0; i < ctx->shard_count; ++i)
+    {
+        usbfs_shard * shard = &ctx->shards[i];
+        stats->wakeups_requested += __atomic_load_n(&shard->stats.wakeups_requested, __ATOMIC_RELAXED);
+        stats->wakeups_signalled += __atomic_load_n(&shard->stats.wakeups_signalled, __ATOMIC_RELAXED);
+        stats->wakeups_received += __atomic_load_n(&shard->stats.wakeups_received, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+
+    return LIBUSBY_SUCCESS;
+}
+
+void usbyb_reset_event_loop(usbyb_context * ctx)
+{
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    __atomic_store_n(&ctx->loop_enabled, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+}
+
+static int usbfs_init_engine(usbfs_shard * shard, libusby_event_engine engine)
+{
+    if (engine == LIBUSBY_EVENT_ENGINE_IO_URING)
+    {
+        int r;
+
+        shard->epfd = -1;
+        shard->uring = malloc(sizeof(usbfs_uring));
+        if (!shard->uring)
+            return LIBUSBY_ERROR_NO_MEM;
+
+        r = usbfs_uring_init(shard->uring, USBFS_URING_ENTRIES);
+        if (r < 0)
+        {
+            free(shard->uring);
+            shard->uring = 0;
+        }
+        return r;
+    }
+
+    shard->epfd = epoll_create1(EPOLL_CLOEXEC);
+    return shard->epfd < 0? LIBUSBY_ERROR_NO_MEM: LIBUSBY_SUCCESS;
+}
+
+static void usbfs_exit_engine(usbfs_shard * shard)
+{
+    if (shard->uring)
+    {
+        usbfs_uring_exit(shard->uring);
+        free(shard->uring);
+    }
+    else
+    {
+        close(shard->epfd);
+    }
+}
+
+static int usbfs_init_shard(usbyb_context * ctx, usbfs_shard * shard, libusby_event_engine engine)
+{
+    usbfs_uring_watch * evfd_watch;
+    usbfs_uring_watch * tfd_watch;
+    int r = LIBUSBY_ERROR_NO_MEM;
+
+    memset(shard, 0, sizeof *shard);
+    shard->ctx = ctx;
+
+    if (pthread_mutex_init(&shard->mutex, NULL) != 0)
+        return LIBUSBY_ERROR_NO_MEM;
+
+    if (pthread_cond_init(&shard->cond, NULL) != 0)
+        goto error_mutex;
+
+    if (pthread_mutex_init(&shard->timer_mutex, NULL) != 0)
+        goto error_cond;
+
+    shard->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard->evfd < 0)
+        goto error_timer_mutex;
+
+    shard->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (shard->tfd < 0)
+        goto error_eventfd;
+
+    r = usbfs_init_engine(shard, engine);
+    if (r < 0)
+        goto error_timerfd;
+
+    /* The eventfd and the timerfd are told apart from the handles by their tokens. */
+    r = usbfs_watch_fd(shard, shard->evfd, EPOLLIN, &shard->evfd, &evfd_watch);
+    if (r < 0)
+        goto error_engine;
+
+    r = usbfs_watch_fd(shard, shard->tfd, EPOLLIN, &shard->tfd, &tfd_watch);
+    if (r < 0)
+        goto error_engine;
+
+    return LIBUSBY_SUCCESS;
+
+error_engine:
+    usbfs_exit_engine(shard);
+
+error_timerfd:
+    close(shard->tfd);
+
+error_eventfd:
+    close(shard->evfd);
+
+error_timer_mutex:
+    pthread_mutex_destroy(&shard->timer_mutex);
+
+error_cond:
+    pthread_cond_destroy(&shard->cond);
+
+error_mutex:
+    pthread_mutex_destroy(&shard->mutex);
+    return r;
+}
+
+static void usbfs_exit_shard(usbfs_shard * shard)
+{
+    assert(shard->handle_count == 0);
+    free(shard->batch);
+    free(shard->timers);
+    usbfs_exit_engine(shard);
+    close(shard->tfd);
+    close(shard->evfd);
+    pthread_mutex_destroy(&shard->timer_mutex);
+    pthread_cond_destroy(&shard->cond);
+    pthread_mutex_destroy(&shard->mutex);
+}
+
+static int usbfs_create_shards(usbyb_context * ctx, int shard_count, libusby_event_engine engine, usbfs_shard ** shards)
+{
+    int i;
+    int r;
+
+    *shards = malloc(sizeof(usbfs_shard) * shard_count);
+    if (!*shards)
+        return LIBUSBY_ERROR_NO_MEM;
+
+    for (i = 0; i < shard_count; ++i)
+    {
+        r = usbfs_init_shard(ctx, &(*shards)[i], engine);
+        if (r < 0)
+        {
+            while (i--)
+                usbfs_exit_shard(&(*shards)[i]);
+            free(*shards);
+            return r;
+        }
+    }
+
+    return LIBUSBY_SUCCESS;
+}
+
+static void usbfs_destroy_shards(usbfs_shard * shards, int shard_count)
+{
+    int i;
+
+    for (i = 0; i < shard_count; ++i)
+        usbfs_exit_shard(&shards[i]);
+    free(shards);
+}
+
+/* Must be called with the context's mutex held. */
+static int usbfs_rebuild_shards(usbyb_context * ctx, int shard_count, libusby_event_engine engine)
+{
+    usbfs_shard * shards;
+    int r;
+
+    if (ctx->open_handles || ctx->running_loops)
+        return LIBUSBY_ERROR_BUSY;
+
+    if (shard_count == ctx->shard_count && engine == ctx->engine)
+        return LIBUSBY_SUCCESS;
+
+    r = usbfs_create_shards(ctx, shard_count, engine, &shards);
+    if (r < 0)
+        return r;
+
+    /* The uevent socket moves to the new first shard. */
+    if (ctx->hotplug_fd >= 0)
+    {
+        r = usbfs_watch_fd(&shards[0], ctx->hotplug_fd, EPOLLIN, &ctx->hotplug_fd, &ctx->hotplug_watch);
+        if (r < 0)
+        {
+            usbfs_destroy_shards(shards, shard_count);
+            return r;
+        }
+    }
+
+    usbfs_destroy_shards(ctx->shards, ctx->shard_count);
+    ctx->shards = shards;
+    ctx->shard_count = shard_count;
+    ctx->engine = engine;
+    return LIBUSBY_SUCCESS;
+}
+
+int usbyb_set_option(usbyb_context * ctx, libusby_option option, int value)
+{
+    int r = LIBUSBY_SUCCESS;
+
+    switch (option)
+    {
+    case LIBUSBY_OPTION_EVENT_LOOP_SHARDS:
+        if (value < 1)
+            return LIBUSBY_ERROR_INVALID_PARAM;
+
+        pthread_mutex_lock(&ctx->ctx_mutex);
+        r = usbfs_rebuild_shards(ctx, value, ctx->engine);
+        pthread_mutex_unlock(&ctx->ctx_mutex);
+        return r;
+
+    case LIBUSBY_OPTION_EVENT_ENGINE:
+        if (value == LIBUSBY_EVENT_ENGINE_DEFAULT)
+            value = LIBUSBY_EVENT_ENGINE_EPOLL;
+        if (value != LIBUSBY_EVENT_ENGINE_EPOLL && value != LIBUSBY_EVENT_ENGINE_IO_URING)
+            return LIBUSBY_ERROR_INVALID_PARAM;
+
+        pthread_mutex_lock(&ctx->ctx_mutex);
+        r = usbfs_rebuild_shards(ctx, ctx->shard_count, value);
+        pthread_mutex_unlock(&ctx->ctx_mutex);
+        return r;
+
+    case LIBUSBY_OPTION_SPIN_WAIT_US:
+        if (value < 0)
+            return LIBUSBY_ERROR_INVALID_PARAM;
+        __atomic_store_n(&ctx->spin_wait_us, value, __ATOMIC_RELAXED);
+        return LIBUSBY_SUCCESS;
+
+    case LIBUSBY_OPTION_CALLBACK_THREADS:
+        if (value < 0)
+            return LIBUSBY_ERROR_INVALID_PARAM;
+
+        pthread_mutex_lock(&ctx->ctx_mutex);
+        if (ctx->open_handles || ctx->running_loops)
+        {
+            r = LIBUSBY_ERROR_BUSY;
+        }
+        else if (value != ctx->dispatcher.thread_count)
+        {
+            usbfs_stop_dispatcher(&ctx->dispatcher);
+            if (value)
+                r = usbfs_start_dispatcher(&ctx->dispatcher, value);
+        }
+        pthread_mutex_unlock(&ctx->ctx_mutex);
+        return r;
+
+    case LIBUSBY_OPTION_TRANSFER_POOL_PREWARM:
+        if (value < 0)
+            return LIBUSBY_ERROR_INVALID_PARAM;
+        return usbfs_prewarm_pool(ctx, value);
+
+    case LIBUSBY_OPTION_HOTPLUG_SOURCE_FD:
+        if (value < -1)
+            return LIBUSBY_ERROR_INVALID_PARAM;
+
+        pthread_mutex_lock(&ctx->ctx_mutex);
+        if (ctx->hotplug_fd >= 0)
+            r = LIBUSBY_ERROR_BUSY;
+        else
+            ctx->hotplug_source_fd = value;
+        pthread_mutex_unlock(&ctx->ctx_mutex);
+        return r;
+
+    default:
+        return LIBUSBY_ERROR_NOT_SUPPORTED;
+    }
+}
+
+int usbyb_init(usbyb_context * ctx)
+{
+    int i;
+
+    usbyi_init_devlist_head(&ctx->devlist_head);
+    for (i = 0; i < USBFS_POOL_CLASSES; ++i)
+        usbfs_init_ring(&ctx->pools[i], ctx->pool_cells[i], USBFS_POOL_CAPACITY);
+
+    if (pthread_mutex_init(&ctx->ctx_mutex, NULL) != 0)
+        return LIBUSBY_ERROR_NO_MEM;
+
+    if (pthread_mutex_init(&ctx->dispatcher.mutex, NULL) != 0)
+        goto error_ctx_mutex;
+    if (pthread_cond_init(&ctx->dispatcher.ready_cond, NULL) != 0)
+        goto error_dispatcher_mutex;
+    if (pthread_cond_init(&ctx->dispatcher.idle_cond, NULL) != 0)
+        goto error_ready_cond;
+
+    if (usbfs_create_shards(ctx, 1, LIBUSBY_EVENT_ENGINE_EPOLL, &ctx->shards) < 0)
+        goto error_idle_cond;
+    ctx->shard_count = 1;
+    ctx->engine = LIBUSBY_EVENT_ENGINE_EPOLL;
+
+    ctx->hotplug_fd = -1;
+    ctx->hotplug_source_fd = -1;
+    ctx->loop_enabled = 1;
+    return LIBUSBY_SUCCESS;
+
+error_idle_cond:
+    pthread_cond_destroy(&ctx->dispatcher.idle_cond);
+error_ready_cond:
+    pthread_cond_destroy(&ctx->dispatcher.ready_cond);
+error_dispatcher_mutex:
+    pthread_mutex_destroy(&ctx->dispatcher.mutex);
+error_ctx_mutex:
+    pthread_mutex_destroy(&ctx->ctx_mutex);
+    return LIBUSBY_ERROR_NO_MEM;
+}
+
+void usbyb_exit(usbyb_context * ctx)
+{
+    if (ctx->event_thread_started)
+        usbyb_stop_event_loop(ctx);
+
+    usbfs_stop_hotplug(ctx);
+    assert(ctx->devlist_head.next == &ctx->devlist_head);
+
+    /* Every handle is closed, only heap buffers may be left. */
+    while (ctx->dev_buffers)
+    {
+        usbfs_dev_buffer * buf = ctx->dev_buffers;
+        ctx->dev_buffers = buf->next;
+        free(buf->buffer);
+        free(buf);
+    }
+
+    usbfs_stop_dispatcher(&ctx->dispatcher);
+    pthread_cond_destroy(&ctx->dispatcher.idle_cond);
+    pthread_cond_destroy(&ctx->dispatcher.ready_cond);
+    pthread_mutex_destroy(&ctx->dispatcher.mutex);
+    usbfs_drain_pools(ctx);
+    usbfs_destroy_shards(ctx->shards, ctx->shard_count);
+    pthread_mutex_destroy(&ctx->ctx_mutex);
+}
+
+static int usbfs_scan_devices(usbyb_context * ctx, libusby_device *** list)
+{
+    usbyi_device_list devlist;
+    DIR * dir = 0;
+    DIR * busdir = 0;
+    struct dirent * ent;
+    int r = LIBUSBY_SUCCESS;
+
+    memset(&devlist, 0, sizeof devlist);
+    dir = opendir("/dev/bus/usb");
+    if (!dir)
+    {
+        *list = NULL;
+        return LIBUSBY_SUCCESS;
+    }
+
+    while (r >= 0 && (ent = readdir(dir)))
+    {
+        char fname[NAME_MAX+32];
+        struct dirent * busent;
+        char * end;
+        int busno = strtol(ent->d_name, &end, 10);
+
+        if (*end != 0)
+            continue;
+
+        strcpy(fname, "/dev/bus/usb/");
+        strcat(fname, ent->d_name);
+
+        busdir = opendir(fname);
+        if (!busdir)
+            continue;
+
+        while (r >= 0 && (busent = readdir(busdir)))
+        {
+            int devno = strtol(busent->d_name, &end, 10);
+            usbyb_device * dev;
+
+            if (*end != 0)
+                continue;
+
+            /* Devices already listed are not opened and read again. */
+            pthread_mutex_lock(&ctx->ctx_mutex);
+            dev = usbfs_find_current_device(ctx, busno, devno);
+            if (dev)
+                libusby_ref_device(&dev->pub);
+            else
+                r = usbfs_new_device(ctx, busno, devno, &dev);
+
+            if (r >= 0)
+            {
+                r = usbyi_append_device_list(&devlist, &dev->pub);
+                if (r < 0)
+                    libusby_unref_device(&dev->pub);
+            }
+            else if (r == LIBUSBY_ERROR_NOT_FOUND)
+            {
+                r = LIBUSBY_SUCCESS;
+            }
+            pthread_mutex_unlock(&ctx->ctx_mutex);
+        }
+
+        closedir(busdir);
+    }
+
+    closedir(dir);
+
+    if (r < 0)
+    {
+        libusby_free_device_list(devlist.list, /*unref_devices=*/1);
+        return r;
+    }
+
+    *list = devlist.list;
+    return devlist.count;
+}
+
+/* Lists the devices hotplug monitoring holds references to. Must be called with `ctx_mutex` held. */
+static int usbfs_list_monitored_devices(usbyb_context * ctx, usbyi_device_list * devlist)
+{
+    usbyi_device_list_node * devnode;
+    int r;
+
+    for (devnode = ctx->devlist_head.next; devnode != &ctx->devlist_head; devnode = devnode->next)
+    {
+        usbyb_device * dev = container_of(devnode, usbyb_device, devnode);
+        if (!dev->hotplug_ref)
+            continue;
+
+        r = usbyi_append_device_list(devlist, &dev->pub);
+        if (r < 0)
+            return r;
+        libusby_ref_device(&dev->pub);
+    }
+
+    return devlist->count;
+}
+
+/* While hotplug monitoring runs, the context's list is kept current
+ * from uevents and returned without scanning `/dev/bus/usb`. */
+int usbyb_get_device_list(usbyb_context * ctx, libusby_device *** list)
+{
+    usbyi_device_list devlist;
+    int r;
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    if (ctx->hotplug_fd < 0)
+    {
+        pthread_mutex_unlock(&ctx->ctx_mutex);
+        return usbfs_scan_devices(ctx, list);
+    }
+
+    memset(&devlist, 0, sizeof devlist);
+    r = usbfs_list_monitored_devices(ctx, &devlist);
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+
+    if (r < 0)
+    {
+        libusby_free_device_list(devlist.list, /*unref_devices=*/1);
+        return r;
+    }
+
+    *list = devlist.list;
+    return r;
+}
+
+void usbyb_finalize_device(usbyb_device * dev)
+{
+    usbyi_remove_devlist_node(&dev->devnode);
+    free(dev->desc_cache);
+    close(dev->fd);
+}
+
+/* Opens the uevent socket unless one was given, and has the first shard watch it.
+ * Must be called with `ctx_mutex` held. */
+static int usbfs_open_uevent_source(usbyb_context * ctx)
+{
+    int fd = ctx->hotplug_source_fd;
+    int r;
+
+    if (fd < 0)
+    {
+        struct sockaddr_nl addr;
+
+        fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+        if (fd < 0)
+            return usbfs_errno_error(errno);
+
+        /* The kernel's own uevents, not the ones udev rebroadcasts. */
+        memset(&addr, 0, sizeof addr);
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = 1;
+        if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0)
+        {
+            r = usbfs_errno_error(errno);
+            close(fd);
+            return r;
+        }
+    }
+
+    /* Set first, the loop may find the socket readable right away. */
+    ctx->hotplug_fd = fd;
+    r = usbfs_watch_fd(&ctx->shards[0], fd, EPOLLIN, &ctx->hotplug_fd, &ctx->hotplug_watch);
+    if (r < 0)
+    {
+        ctx->hotplug_fd = -1;
+        if (fd != ctx->hotplug_source_fd)
+            close(fd);
+        return r;
+    }
+
+    return LIBUSBY_SUCCESS;
+}
+
+/* No uevent announces the devices present when monitoring starts,
+ * the context takes its references to them from a scan instead. */
+static void usbfs_adopt_devices(usbyb_context * ctx)
+{
+    libusby_device ** list;
+    int count = usbfs_scan_devices(ctx, &list);
+    int i;
+
+    if (count < 0)
+        return;
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    for (i = 0; i < count; ++i)
+    {
+        usbyb_device * dev = (usbyb_device *)list[i];
+
+        /* Devices that left during the scan are no longer linked. */
+        if (!dev->hotplug_ref && dev->devnode.next != &dev->devnode)
+        {
+            dev->hotplug_ref = 1;
+            libusby_ref_device(&dev->pub);
+        }
+    }
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+
+    libusby_free_device_list(list, /*unref_devices=*/1);
+}
+
+/* Calls the callback for the listed devices that are still monitored.
+ * Must be called with `ctx_mutex` held. */
+static void usbfs_hotplug_enumerate(usbyb_context * ctx, usbfs_hotplug_callback * cb, usbyi_device_list * devlist)
+{
+    int i;
+
+    ++ctx->hotplug_dispatching;
+    for (i = 0; i < devlist->count; ++i)
+    {
+        usbyb_device * dev = (usbyb_device *)devlist->list[i];
+
+        /* A device that left while a callback ran has been announced as such. */
+        if (dev->hotplug_ref && usbfs_hotplug_matches(cb, dev, LIBUSBY_HOTPLUG_EVENT_DEVICE_ARRIVED))
+            usbfs_hotplug_call(ctx, cb, dev, LIBUSBY_HOTPLUG_EVENT_DEVICE_ARRIVED);
+    }
+
+    if (--ctx->hotplug_dispatching == 0)
+        usbfs_hotplug_sweep(ctx);
+}
+
+int usbyb_hotplug_register_callback(usbyb_context * ctx, int events, int flags, int vendor_id, int product_id, int dev_class,
+    libusby_hotplug_callback_fn callback, void * user_data, libusby_hotplug_callback_handle * handle)
+{
+    usbfs_hotplug_callback * cb;
+    usbfs_hotplug_callback ** link;
+    usbyi_device_list devlist;
+    int start;
+    int r;
+
+    if (!callback || !events || (events & ~(LIBUSBY_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSBY_HOTPLUG_EVENT_DEVICE_LEFT)))
+        return LIBUSBY_ERROR_INVALID_PARAM;
+
+    cb = malloc(sizeof *cb);
+    if (!cb)
+        return LIBUSBY_ERROR_NO_MEM;
+
+    cb->events = events;
+    cb->vendor_id = vendor_id;
+    cb->product_id = product_id;
+    cb->dev_class = dev_class;
+    cb->callback = callback;
+    cb->user_data = user_data;
+    cb->deregistered = 0;
+    cb->next = 0;
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    start = ctx->hotplug_fd < 0;
+    if (start)
+    {
+        r = usbfs_open_uevent_source(ctx);
+        if (r < 0)
+        {
+            pthread_mutex_unlock(&ctx->ctx_mutex);
+            free(cb);
+            return r;
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+
+    if (start)
+        usbfs_adopt_devices(ctx);
+
+    /* The callback is linked and the devices are listed under one hold of the lock,
+     * a device is then either listed or announced by a later uevent, never both.
+     * The devices are referenced, since the list may change while the callback runs. */
+    memset(&devlist, 0, sizeof devlist);
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    cb->handle = ++ctx->hotplug_last_handle;
+    if (handle)
+        *handle = cb->handle;
+
+    for (link = &ctx->hotplug_callbacks; *link; link = &(*link)->next)
+    {
+    }
+    *link = cb;
+
+    if (flags & LIBUSBY_HOTPLUG_ENUMERATE)
+    {
+        usbfs_list_monitored_devices(ctx, &devlist);
+        usbfs_hotplug_enumerate(ctx, cb, &devlist);
+    }
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+
+    libusby_free_device_list(devlist.list, /*unref_devices=*/1);
+    return LIBUSBY_SUCCESS;
+}
+
+/* The callback may still be running on the loop thread when this returns. */
+void usbyb_hotplug_deregister_callback(usbyb_context * ctx, libusby_hotplug_callback_handle handle)
+{
+    usbfs_hotplug_callback * cb;
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    for (cb = ctx->hotplug_callbacks; cb; cb = cb->next)
+    {
+        if (cb->handle == handle)
+            cb->deregistered = 1;
+    }
+
+    if (!ctx->hotplug_dispatching)
+        usbfs_hotplug_sweep(ctx);
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+}
+
+/* Fills in the max packet sizes of the endpoints the configuration describes
+ * in the cached descriptors, and clears the others. Called on open and when the
+ * configuration is set, with `inflight_mutex` held; submissions only read them. */
+static void usbfs_load_max_packet_sizes(usbyb_device_handle * handle, int config_value)
+{
+    usbyb_device * dev = handle->pub.dev;
+    uint8_t * cache_ptr = dev->desc_cache;
+    int i;
+
+    for (i = 0; i < 32; ++i)
+        __atomic_store_n(&handle->max_packet_size[i], 0, __ATOMIC_RELAXED);
+
+    for (i = 0; i < dev->pub.device_desc.bNumConfigurations; ++i)
+    {
+        uint16_t wTotalLength = cache_ptr[2] | (cache_ptr[3] << 8);
+        uint8_t * desc = cache_ptr;
+
+        cache_ptr += wTotalLength;
+        if (wTotalLength < 6 || desc[5] != config_value)
+            continue;
+
+        while (desc + 7 <= cache_ptr && desc[0] >= 2)
+        {
+            if (desc[1] == 5/*ENDPOINT*/)
+            {
+                int index = (desc[2] & 0x0f) | ((desc[2] & LIBUSBY_ENDPOINT_DIR_MASK) >> 3);
+                __atomic_store_n(&handle->max_packet_size[index], (desc[4] | (desc[5] << 8)) & 0x7ff, __ATOMIC_RELAXED);
+            }
+
+            desc += desc[0];
+        }
+        break;
+    }
+}
+
+/* Finds out the active configuration when the handle is opened. The device is only
+ * asked when it has more than one, a single one is assumed to be active. */
+static void usbfs_resolve_active_config(usbyb_device_handle * handle)
+{
+    usbyb_device * dev = handle->pub.dev;
+    int config_value = -1;
+    uint8_t value;
+
+    if (dev->pub.device_desc.bNumConfigurations == 1)
+        config_value = dev->desc_cache[5];
+    else if (usbyb_control_transfer(handle, 0x80, 0x08/*GET_CONFIGURATION*/, 0, 0, &value, 1, 1000) == 1)
+        config_value = value;
+
+    pthread_mutex_lock(&handle->inflight_mutex);
+    if (dev->pub.device_desc.bNumConfigurations != 1)
+        handle->active_config_value = config_value;
+    usbfs_load_max_packet_sizes(handle, config_value);
+    pthread_mutex_unlock(&handle->inflight_mutex);
+}
+
+/* Prepares the URB chain of a bulk transfer and returns the number of URBs. The chunk
+ * size is kept a multiple of the max packet size, so that only the last URB of the chain
+ * can end with a short packet. */
+static int usbfs_split_bulk_transfer(usbyb_device_handle * handle, usbyb_transfer * tran)
+{
+    int is_in = (tran->pub.endpoint & LIBUSBY_ENDPOINT_DIR_MASK) == LIBUSBY_ENDPOINT_IN;
+    int chunk = (handle->caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM)? USBFS_BULK_CHUNK_NO_LIMIT: USBFS_BULK_CHUNK;
+    int index = (tran->pub.endpoint & 0x0f) | ((tran->pub.endpoint & LIBUSBY_ENDPOINT_DIR_MASK) >> 3);
+    int max_packet_size = __atomic_load_n(&handle->max_packet_size[index], __ATOMIC_RELAXED);
+    int count;
+    int i;
+
+    if (max_packet_size > 0 && chunk > max_packet_size)
+        chunk -= chunk % max_packet_size;
+
+    if (tran->pub.length <= chunk)
+        return 1;
+
+    /* Without continuation, the URBs following a short packet would stay queued. */
+    if (is_in && (handle->caps & USBDEVFS_CAP_BULK_CONTINUATION) == 0)
+        return 1;
+
+    count = (tran->pub.length + chunk - 1) / chunk;
+    if (count > tran->urb_capacity)
+    {
+        struct usbdevfs_urb * urbs = realloc(tran->urbs, sizeof(struct usbdevfs_urb) * count);
+        if (!urbs)
+            return LIBUSBY_ERROR_NO_MEM;
+
+        tran->urbs = urbs;
+        tran->urb_capacity = count;
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        struct usbdevfs_urb * urb = &tran->urbs[i];
+
+        memset(urb, 0, sizeof *urb);
+        urb->type = USBDEVFS_URB_TYPE_BULK;
+        urb->endpoint = tran->pub.endpoint;
+        urb->buffer = tran->pub.buffer + i * chunk;
+        urb->buffer_length = i + 1 < count? chunk: tran->pub.length - i * chunk;
+        urb->usercontext = tran;
+
+        if (is_in && i + 1 < count)
+            urb->flags |= USBDEVFS_URB_SHORT_NOT_OK;
+        if (i > 0 && (handle->caps & USBDEVFS_CAP_BULK_CONTINUATION))
+            urb->flags |= USBDEVFS_URB_BULK_CONTINUATION;
+    }
+
+    if (tran->pub.flags & LIBUSBY_TRANSFER_ADD_ZERO_PACKET)
+        tran->urbs[count - 1].flags |= USBDEVFS_URB_ZERO_PACKET;
+
+    return count;
+}
+
+/* Undoes the bookkeeping of a submission none of whose URBs is left in flight. */
+static int usbfs_abort_submit(usbyb_device_handle * handle, usbyb_transfer * tran, int unsubmitted, int r)
+{
+    usbfs_shard * shard = handle->shard;
+
+    if (tran->pub.timeout)
+    {
+        pthread_mutex_lock(&shard->timer_mutex);
+        usbfs_remove_timer(shard, tran);
+        pthread_mutex_unlock(&shard->timer_mutex);
+    }
+
+    usbfs_untrack_transfer(handle, tran);
+    __atomic_sub_fetch(&handle->inflight, unsubmitted, __ATOMIC_RELAXED);
+    __atomic_store_n(&tran->active, 0, __ATOMIC_SEQ_CST);
+    usbfs_release_pending(handle);
+    return r;
+}
+
+/* Validates the transfer and fills in its URBs. Returns the number of URBs. */
+static int usbfs_prepare_submit(usbyb_device_handle * handle, usbyb_transfer * tran)
+{
+    int urb_count;
+
+    memset(tran->req, 0, sizeof *tran->req);
+
+    switch (tran->pub.type)
+    {
+    case LIBUSBY_TRANSFER_TYPE_CONTROL:
+        tran->req->type = USBDEVFS_URB_TYPE_CONTROL;
+        break;
+    case LIBUSBY_TRANSFER_TYPE_BULK:
+        tran->req->type = USBDEVFS_URB_TYPE_BULK;
+        break;
+    case LIBUSBY_TRANSFER_TYPE_INTERRUPT:
+        tran->req->type = USBDEVFS_URB_TYPE_INTERRUPT;
+        break;
+    case LIBUSBY_TRANSFER_TYPE_ISOCHRONOUS:
+        {
+            int i;
+
+            /* The descriptors were allocated along with the transfer. */
+            if (tran->pub.num_iso_packets <= 0 || tran->pub.num_iso_packets > tran->intrn.num_iso_packets)
+                return LIBUSBY_ERROR_INVALID_PARAM;
+
+            tran->req->type = USBDEVFS_URB_TYPE_ISO;
+            tran->req->flags = USBDEVFS_URB_ISO_ASAP;
+            tran->req->number_of_packets = tran->pub.num_iso_packets;
+            for (i = 0; i < tran->pub.num_iso_packets; ++i)
+            {
+                tran->req->iso_frame_desc[i].length = tran->pub.iso_packet_desc[i].length;
+                tran->req->iso_frame_desc[i].actual_length = 0;
+                tran->req->iso_frame_desc[i].status = 0;
+            }
+        }
+        break;
+    default:
+        return LIBUSBY_ERROR_NOT_SUPPORTED;
+    }
+
+    tran->req->endpoint = tran->pub.endpoint;
+    tran->req->buffer = tran->pub.buffer;
+    tran->req->buffer_length = tran->pub.length;
+    tran->req->usercontext = tran;
+
+    urb_count = 1;
+    if (tran->pub.type == LIBUSBY_TRANSFER_TYPE_BULK)
+    {
+        if (tran->pub.flags & LIBUSBY_TRANSFER_ADD_ZERO_PACKET)
+        {
+            if ((handle->caps & USBDEVFS_CAP_ZERO_PACKET) == 0 || (tran->pub.endpoint & LIBUSBY_ENDPOINT_DIR_MASK) != LIBUSBY_ENDPOINT_OUT)
+                return LIBUSBY_ERROR_NOT_SUPPORTED;
+            tran->req->flags |= USBDEVFS_URB_ZERO_PACKET;
+        }
+
+        urb_count = usbfs_split_bulk_transfer(handle, tran);
+    }
+
+    return urb_count;
+}
+
+/* Hands the prepared URBs to the kernel. The transfer must already be marked
+ * active and, if it has a timeout, be in the timer heap. */
+static int usbfs_issue_urbs(usbyb_device_handle * handle, usbyb_transfer * tran)
+{
+    int urb_count;
+    int i;
+    int r;
+
+    if (tran->urb_count == 1)
+    {
+        if (ioctl(handle->wrfd, USBDEVFS_SUBMITURB, tran->req) < 0)
+            return usbfs_abort_submit(handle, tran, 1, usbfs_error());
+        return LIBUSBY_SUCCESS;
+    }
+
+    urb_count = tran->urb_count;
+    tran->pub.actual_length = 0;
+    tran->split_status = 0;
+    tran->split_short = 0;
+    __atomic_store_n(&tran->urbs_pending, urb_count, __ATOMIC_SEQ_CST);
+
+    for (i = 0; i < urb_count; ++i)
+    {
+        if (ioctl(handle->wrfd, USBDEVFS_SUBMITURB, &tran->urbs[i]) < 0)
+            break;
+    }
+
+    if (i < urb_count)
+    {
+        int unsubmitted = urb_count - i;
+        int expected = 0;
+        int err = errno;
+        r = usbfs_error();
+
+        /* Part of the chain is already in flight, cancel it and let the transfer
+         * fail once it is reaped. If it has all been reaped already, fail right away. */
+        __atomic_compare_exchange_n(&tran->split_status, &expected, -err, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        while (i--)
+            ioctl(handle->wrfd, USBDEVFS_DISCARDURB, &tran->urbs[i]);
+
+        if (__atomic_sub_fetch(&tran->urbs_pending, unsubmitted, __ATOMIC_SEQ_CST) == 0)
+            return usbfs_abort_submit(handle, tran, unsubmitted, r);
+        __atomic_sub_fetch(&handle->inflight, unsubmitted, __ATOMIC_RELAXED);
+    }
+
+    return LIBUSBY_SUCCESS;
+}
+
+/* A drain that started after the transfer was listed may have tried to discard
+ * its URBs before they were submitted. The transfer may be complete by now,
+ * so it is not touched, the whole handle is discarded again instead. */
+static void usbfs_recheck_closing(usbyb_device_handle * handle)
+{
+    if (__atomic_load_n(&handle->closing, __ATOMIC_SEQ_CST))
+        usbfs_discard_all(handle);
+}
+
+int usbyb_submit_transfer(usbyb_transfer * tran)
+{
+    usbyb_device_handle * handle = (usbyb_device_handle *)tran->pub.dev_handle;
+    usbfs_shard * shard;
+    int urb_count;
+    int r;
+
+    assert(handle->pub.dev->pub.ctx == tran->intrn.ctx);
+
+    urb_count = usbfs_prepare_submit(handle, tran);
+    if (urb_count < 0)
+        return urb_count;
+
+    r = usbfs_track_transfer(handle, tran);
+    if (r < 0)
+        return r;
+
+    /* A tracked transfer keeps the handle from moving to another shard. */
+    shard = handle->shard;
+
+    /* The handle has been in the epoll set since it was opened, the loop
+     * will notice the URB completing without being woken up. The transfer
+     * is marked active first, since it may be reaped before the ioctl returns. */
+    tran->urb_count = urb_count;
+    __atomic_store_n(&tran->active, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&handle->inflight, urb_count, __ATOMIC_RELAXED);
+
+    /* The timer is started before the URB is submitted, so that it is
+     * always found in the heap when the URB is reaped. */
+    tran->timed_out = 0;
+    if (tran->pub.timeout)
+    {
+        pthread_mutex_lock(&shard->timer_mutex);
+        r = usbfs_add_timer(shard, tran);
+        pthread_mutex_unlock(&shard->timer_mutex);
+
+        if (r < 0)
+            return usbfs_abort_submit(handle, tran, urb_count, r);
+    }
+
+    r = usbfs_issue_urbs(handle, tran);
+    if (r >= 0)
+        usbfs_recheck_closing(handle);
+    return r;
+}
+
+/* All transfers are validated before any is submitted. Then the timers of all of them
+ * are inserted under a single hold of each shard's timer mutex, with the timerfd
+ * rearmed at most once per shard, and finally the URBs are submitted in order. */
+int usbyb_submit_transfers(libusby_transfer ** transfers, int count, int * submitted)
+{
+    usbfs_shard * locked = 0;
+    int rearm = 0;
+    int i;
+    int r = LIBUSBY_SUCCESS;
+
+    *submitted = 0;
+
+    for (i = 0; i < count; ++i)
+    {
+        usbyb_transfer * tran = usbyi_get_tran(transfers[i]);
+        int urb_count = usbfs_prepare_submit((usbyb_device_handle *)tran->pub.dev_handle, tran);
+        if (urb_count < 0)
+            return urb_count;
+        tran->urb_count = urb_count;
+    }
+
+    for (i = 0; r >= 0 && i < count; ++i)
+    {
+        usbyb_transfer * tran = usbyi_get_tran(transfers[i]);
+        usbyb_device_handle * handle = (usbyb_device_handle *)tran->pub.dev_handle;
+
+        r = usbfs_track_transfer(handle, tran);
+        if (r < 0)
+            break;
+
+        __atomic_store_n(&tran->active, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&handle->inflight, tran->urb_count, __ATOMIC_RELAXED);
+        tran->timed_out = 0;
+        if (!tran->pub.timeout)
+            continue;
+
+        if (locked != handle->shard)
+        {
+            if (locked)
+            {
+                if (rearm)
+                    usbfs_rearm_timer(locked);
+                pthread_mutex_unlock(&locked->timer_mutex);
+            }
+            locked = handle->shard;
+            rearm = 0;
+            pthread_mutex_lock(&locked->timer_mutex);
+        }
+
+        r = usbfs_insert_timer(locked, tran);
+        if (r >= 0 && tran->timer_index == 0)
+            rearm = 1;
+    }
+
+    if (locked)
+    {
+        if (rearm)
+            usbfs_rearm_timer(locked);
+        pthread_mutex_unlock(&locked->timer_mutex);
+    }
+
+    /* If a transfer could not be listed or its timer inserted, nothing has been submitted yet. */
+    if (r < 0)
+    {
+        while (i--)
+        {
+            usbyb_transfer * tran = usbyi_get_tran(transfers[i]);
+            usbfs_abort_submit((usbyb_device_handle *)tran->pub.dev_handle, tran, tran->urb_count, r);
+        }
+        return r;
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        usbyb_transfer * tran = usbyi_get_tran(transfers[i]);
+        usbyb_device_handle * handle = (usbyb_device_handle *)tran->pub.dev_handle;
+
+        r = usbfs_issue_urbs(handle, tran);
+        if (r < 0)
+            break;
+        usbfs_recheck_closing(handle);
+    }
+
+    *submitted = i;
+
+    /* The failed transfer has been aborted already, the ones after it still need to be. */
+    while (++i < count)
+    {
+        usbyb_transfer * tran = usbyi_get_tran(transfers[i]);
+        usbfs_abort_submit((usbyb_device_handle *)tran->pub.dev_handle, tran, tran->urb_count, r);
+    }
+    return r;
+}
+
+int usbyb_cancel_transfer(usbyb_transfer * tran)
+{
+    usbyb_device_handle * handle = (usbyb_device_handle *)tran->pub.dev_handle;
+    return usbfs_discard_urbs(handle, tran);
+}
+
+/* usbfs has no ioctl discarding more than one URB, but the transfers need
+ * not be tracked by the caller and the list is walked under a single lock. */
+int usbyb_cancel_endpoint(usbyb_device_handle * handle, libusby_endpoint_t endpoint)
+{
+    int index = (endpoint & 0x0f) | ((endpoint & LIBUSBY_ENDPOINT_DIR_MASK) >> 3);
+    int count;
+
+    pthread_mutex_lock(&handle->inflight_mutex);
+    count = usbfs_discard_endpoint(handle, index);
+    pthread_mutex_unlock(&handle->inflight_mutex);
+    return count;
+}
+
+int usbyb_cancel_all(usbyb_device_handle * handle)
+{
+    return usbfs_discard_all(handle);
+}
+
+/* Assigns the handle to a shard, or to the least loaded one if `shard_index` is negative.
+ * Must be called with `ctx_mutex` held. */
+static int usbfs_assign_handle(usbyb_context * ctx, usbyb_device_handle * handle, int shard_index)
+{
+    usbfs_shard * shard;
+    int r;
+
+    if (shard_index < 0)
+    {
+        int i;
+        shard_index = 0;
+        for (i = 1; i < ctx->shard_count; ++i)
+        {
+            if (ctx->shards[i].handle_count < ctx->shards[shard_index].handle_count)
+                shard_index = i;
+        }
+    }
+
+    shard = &ctx->shards[shard_index];
+    r = usbfs_watch_handle(shard, handle);
+    if (r < 0)
+        return r;
+
+    ++shard->handle_count;
+    return LIBUSBY_SUCCESS;
+}
+
+static int usbfs_attach_handle(usbyb_context * ctx, usbyb_device_handle * handle, int shard_index)
+{
+    int r;
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    r = usbfs_assign_handle(ctx, handle, shard_index);
+    if (r >= 0)
+        ++ctx->open_handles;
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+    return r;
+}
+
+/* Waits until the shard's loop has handled the events it gathered so far, after
+ * which an fd no longer watched cannot be reported by the current wait either.
+ * Returns at once on the loop thread, which does not wait again before
+ * it has handled the rest of its events. */
+static void usbfs_quiesce_loop(usbfs_shard * shard)
+{
+    unsigned epoch;
+
+    pthread_mutex_lock(&shard->mutex);
+    if (shard->loop_locked && !pthread_equal(shard->loop_thread, pthread_self()))
+    {
+        __atomic_add_fetch(&shard->quiescers, 1, __ATOMIC_SEQ_CST);
+        epoch = __atomic_load_n(&shard->loop_epoch, __ATOMIC_SEQ_CST);
+        usbfs_wakeup(shard);
+        while (shard->loop_locked && __atomic_load_n(&shard->loop_epoch, __ATOMIC_SEQ_CST) == epoch)
+            pthread_cond_wait(&shard->cond, &shard->mutex);
+        __atomic_sub_fetch(&shard->quiescers, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+static void usbfs_detach_handle(usbyb_context * ctx, usbyb_device_handle * handle)
+{
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    usbfs_unwatch_handle(handle);
+    --handle->shard->handle_count;
+    --ctx->open_handles;
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+}
+
+/* Submissions are refused until the handle is watched by its new shard, so that
+ * none of its URBs is reaped by one shard while its timer is in the other's heap. */
+int usbyb_set_handle_shard(usbyb_device_handle * handle, int shard_index)
+{
+    usbyb_context * ctx = handle->pub.dev->pub.ctx;
+    usbfs_shard * old_shard = handle->shard;
+    int r = LIBUSBY_SUCCESS;
+    int i;
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    if (shard_index < 0 || shard_index >= ctx->shard_count)
+    {
+        pthread_mutex_unlock(&ctx->ctx_mutex);
+        return LIBUSBY_ERROR_INVALID_PARAM;
+    }
+
+    if (&ctx->shards[shard_index] == old_shard)
+    {
+        pthread_mutex_unlock(&ctx->ctx_mutex);
+        return LIBUSBY_SUCCESS;
+    }
+
+    pthread_mutex_lock(&handle->inflight_mutex);
+    for (i = 0; i < 32 && !handle->inflight_transfers[i]; ++i)
+    {
+    }
+    if (i < 32 || handle->moving)
+        r = LIBUSBY_ERROR_BUSY;
+    else
+        handle->moving = 1;
+    pthread_mutex_unlock(&handle->inflight_mutex);
+
+    if (r < 0)
+    {
+        pthread_mutex_unlock(&ctx->ctx_mutex);
+        return r;
+    }
+
+    usbfs_unwatch_handle(handle);
+    --old_shard->handle_count;
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+
+    /* The old shard's loop may still hold an event for the handle. */
+    usbfs_quiesce_loop(old_shard);
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    r = usbfs_assign_handle(ctx, handle, shard_index);
+    if (r < 0 && usbfs_assign_handle(ctx, handle, (int)(old_shard - ctx->shards)) < 0)
+    {
+        /* The handle keeps its shard, but will not be reaped. */
+        handle->shard = old_shard;
+        ++old_shard->handle_count;
+    }
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+
+    pthread_mutex_lock(&handle->inflight_mutex);
+    handle->moving = 0;
+    pthread_mutex_unlock(&handle->inflight_mutex);
+    return r;
+}
+
+int usbyb_get_handle_shard(usbyb_device_handle * handle)
+{
+    usbyb_context * ctx = handle->pub.dev->pub.ctx;
+    return (int)(handle->shard - ctx->shards);
 }
 
 int usbyb_open(usbyb_device_handle * handle)
@@ -540,6 +3599,7 @@ int usbyb_open(usbyb_device_handle * handle)
     usbyb_device * dev = handle->pub.dev;
     char fdpath[32];
     int wrfd;
+    int r;
 
     sprintf(fdpath, "/proc/self/fd/%d", dev->fd);
     wrfd = open(fdpath, O_RDWR);
@@ -548,15 +3608,184 @@ int usbyb_open(usbyb_device_handle * handle)
 
     handle->wrfd = wrfd;
     handle->active_config_value = -1;
+    handle->inflight = 0;
+    handle->closing = 0;
+    handle->moving = 0;
+    handle->sync_calls = 0;
+    handle->pending = 0;
+    memset(handle->inflight_transfers, 0, sizeof handle->inflight_transfers);
+
+    if (ioctl(wrfd, USBDEVFS_GET_CAPABILITIES, &handle->caps) < 0)
+        handle->caps = 0;
+
+    if (pthread_mutex_init(&handle->inflight_mutex, 0) != 0)
+    {
+        close(wrfd);
+        return LIBUSBY_ERROR_NO_MEM;
+    }
+
+    if (pthread_cond_init(&handle->sync_cond, 0) != 0)
+    {
+        pthread_mutex_destroy(&handle->inflight_mutex);
+        close(wrfd);
+        return LIBUSBY_ERROR_NO_MEM;
+    }
+
+    r = usbfs_attach_handle(dev->pub.ctx, handle, -1);
+    if (r < 0)
+    {
+        pthread_cond_destroy(&handle->sync_cond);
+        pthread_mutex_destroy(&handle->inflight_mutex);
+        close(wrfd);
+        return r;
+    }
+
+    usbfs_resolve_active_config(handle);
     return LIBUSBY_SUCCESS;
 }
 
+/* Refuses further submissions, cancels everything in flight and runs
+ * the event loop, or waits for whoever runs it, until every transfer
+ * of the handle has been handed back to the user. */
+int usbyb_drain(usbyb_device_handle * handle)
+{
+    usbfs_shard * shard = handle->shard;
+    int r = LIBUSBY_SUCCESS;
+
+    pthread_mutex_lock(&handle->inflight_mutex);
+    handle->closing = 1;
+    pthread_mutex_unlock(&handle->inflight_mutex);
+
+    usbfs_discard_all(handle);
+
+    pthread_mutex_lock(&shard->mutex);
+    __atomic_add_fetch(&shard->drainers, 1, __ATOMIC_SEQ_CST);
+    while (r >= 0 && __atomic_load_n(&handle->pending, __ATOMIC_SEQ_CST))
+    {
+        if (!shard->loop_locked)
+            r = usbfs_run_event_loop_impl(shard, 0, handle);
+        else
+            pthread_cond_wait(&shard->cond, &shard->mutex);
+    }
+    __atomic_sub_fetch(&shard->drainers, 1, __ATOMIC_SEQ_CST);
+
+    usbfs_handoff_loop(shard);
+    pthread_mutex_unlock(&shard->mutex);
+
+    usbfs_wait_sync(handle);
+    return r;
+}
+
 void usbyb_close(usbyb_device_handle * handle)
 {
+    usbyb_context * ctx = handle->pub.dev->pub.ctx;
+    usbfs_dev_buffer ** link;
+
+    usbfs_wait_sync(handle);
+    usbfs_detach_handle(ctx, handle);
+    usbfs_quiesce_loop(handle->shard);
+    usbfs_remove_handle_timers(handle->shard, handle);
+    usbfs_wait_dispatcher_idle(&ctx->dispatcher, handle);
+
+    /* Buffers mapped from the handle go away with its fd, a later
+     * `usbyb_dev_mem_free` then no longer finds them. */
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    link = &ctx->dev_buffers;
+    while (*link)
+    {
+        usbfs_dev_buffer * buf = *link;
+        if (buf->handle == handle)
+        {
+            *link = buf->next;
+            munmap(buf->buffer, buf->length);
+            free(buf);
+        }
+        else
+        {
+            link = &buf->next;
+        }
+    }
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+
+    pthread_cond_destroy(&handle->sync_cond);
+    pthread_mutex_destroy(&handle->inflight_mutex);
     close(handle->wrfd);
     handle->wrfd = -1;
 }
 
+/* Buffers mapped from the usbfs fd are allocated by the kernel in DMA-able
+ * memory. The kernel recognizes them when URBs are submitted and skips
+ * the bounce copy, no change to the URB is needed. */
+int usbyb_dev_mem_alloc(usbyb_device_handle * handle, size_t length, uint8_t ** buffer)
+{
+    usbyb_context * ctx = handle->pub.dev->pub.ctx;
+    usbfs_dev_buffer * buf;
+    void * addr = MAP_FAILED;
+
+    buf = malloc(sizeof *buf);
+    if (!buf)
+        return LIBUSBY_ERROR_NO_MEM;
+
+    if (handle->caps & USBDEVFS_CAP_MMAP)
+        addr = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, handle->wrfd, 0);
+
+    /* The kernel caps the memory usbfs may pin, fall back to the heap. The buffer
+     * is recorded either way, so that it is released the way it was allocated. */
+    buf->handle = handle;
+    if (addr == MAP_FAILED)
+    {
+        buf->handle = 0;
+        addr = malloc(length);
+        if (!addr)
+        {
+            free(buf);
+            return LIBUSBY_ERROR_NO_MEM;
+        }
+    }
+
+    buf->buffer = addr;
+    buf->length = length;
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    buf->next = ctx->dev_buffers;
+    ctx->dev_buffers = buf;
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+
+    *buffer = addr;
+    return LIBUSBY_SUCCESS;
+}
+
+int usbyb_dev_mem_free(usbyb_device_handle * handle, uint8_t * buffer, size_t length)
+{
+    usbyb_context * ctx = handle->pub.dev->pub.ctx;
+    usbfs_dev_buffer ** link;
+    usbfs_dev_buffer * buf = 0;
+
+    pthread_mutex_lock(&ctx->ctx_mutex);
+    for (link = &ctx->dev_buffers; *link; link = &(*link)->next)
+    {
+        if ((*link)->buffer == buffer)
+        {
+            buf = *link;
+            *link = buf->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ctx->ctx_mutex);
+
+    /* Either not ours, or mapped from a handle that has been closed since. */
+    if (!buf)
+        return LIBUSBY_ERROR_NOT_FOUND;
+
+    assert(buf->length == length);
+    if (buf->handle)
+        munmap(buf->buffer, buf->length);
+    else
+        free(buf->buffer);
+    free(buf);
+    return LIBUSBY_SUCCESS;
+}
+
 int usbyb_get_descriptor(usbyb_device_handle * handle, uint8_t desc_type, uint8_t desc_index, uint16_t langid, unsigned char * data, int length)
 {
     return usbyb_get_descriptor_cached(handle->pub.dev, desc_type, desc_index, langid, data, length);
@@ -604,10 +3833,14 @@ int usbyb_perform_transfer(usbyb_transfer * tran)
         req.wValue = tran->pub.buffer[2] | (tran->pub.buffer[3] << 8);
         req.wIndex = tran->pub.buffer[4] | (tran->pub.buffer[5] << 8);
         req.wLength = tran->pub.buffer[6] | (tran->pub.buffer[7] << 8);
-        req.timeout = 0;
+        req.timeout = tran->pub.timeout;
         req.data = tran->pub.buffer + 8;
 
+        r = usbfs_begin_sync(handle);
+        if (r < 0)
+            return r;
         r = ioctl(handle->wrfd, USBDEVFS_CONTROL, &req);
+        usbfs_end_sync(handle);
         if (r >= 0)
         {
             tran->pub.actual_length = r + 8;
@@ -615,17 +3848,44 @@ int usbyb_perform_transfer(usbyb_transfer * tran)
         }
         else
         {
-            switch (errno)
-            {
-            case ENODEV:
-                tran->pub.status = LIBUSBY_TRANSFER_NO_DEVICE;
-                break;
-            case EPIPE:
-                tran->pub.status = LIBUSBY_TRANSFER_STALL;
-                break;
-            default:
-                tran->pub.status = LIBUSBY_TRANSFER_ERROR;
-            }
+            tran->pub.status = usbfs_sync_status(errno);
+        }
+
+        return LIBUSBY_SUCCESS;
+    }
+
+    if (tran->pub.type == LIBUSBY_TRANSFER_TYPE_BULK || tran->pub.type == LIBUSBY_TRANSFER_TYPE_INTERRUPT)
+    {
+        /* The kernel picks the interrupt pipe itself for interrupt endpoints. Transfers
+         * that need more than one URB or a trailing zero-length packet are left
+         * to the asynchronous path, and so are those without a timeout, which
+         * only cancellation could end and cancellation can't reach the ioctl. */
+        int chunk = (handle->caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM)? USBFS_BULK_CHUNK_NO_LIMIT: USBFS_BULK_CHUNK;
+        int r;
+        struct usbdevfs_bulktransfer req;
+
+        if (tran->pub.length > chunk || (tran->pub.flags & LIBUSBY_TRANSFER_ADD_ZERO_PACKET) != 0 || tran->pub.timeout == 0)
+            return LIBUSBY_ERROR_NOT_SUPPORTED;
+
+        req.ep = tran->pub.endpoint;
+        req.len = tran->pub.length;
+        req.timeout = tran->pub.timeout;
+        req.data = tran->pub.buffer;
+
+        r = usbfs_begin_sync(handle);
+        if (r < 0)
+            return r;
+        r = ioctl(handle->wrfd, USBDEVFS_BULK, &req);
+        usbfs_end_sync(handle);
+        if (r >= 0)
+        {
+            tran->pub.actual_length = r;
+            tran->pub.status = LIBUSBY_TRANSFER_COMPLETED;
+        }
+        else
+        {
+            tran->pub.actual_length = 0;
+            tran->pub.status = usbfs_sync_status(errno);
         }
 
         return LIBUSBY_SUCCESS;
@@ -634,6 +3894,31 @@ int usbyb_perform_transfer(usbyb_transfer * tran)
     return LIBUSBY_ERROR_NOT_SUPPORTED;
 }
 
+int usbyb_control_transfer(usbyb_device_handle * handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+    uint8_t * data, uint16_t wLength, libusby_timeout_t timeout)
+{
+    /* usbfs copies the data stage through its own buffer, so the caller's
+     * buffer is used directly and nothing is allocated here. */
+    int r;
+    struct usbdevfs_ctrltransfer req;
+    req.bRequestType = bmRequestType;
+    req.bRequest = bRequest;
+    req.wValue = wValue;
+    req.wIndex = wIndex;
+    req.wLength = wLength;
+    req.timeout = timeout;
+    req.data = data;
+
+    r = usbfs_begin_sync(handle);
+    if (r < 0)
+        return r;
+    r = ioctl(handle->wrfd, USBDEVFS_CONTROL, &req);
+    usbfs_end_sync(handle);
+    if (r < 0)
+        return usbfs_sync_error(errno);
+    return r;
+}
+
 int usbyb_claim_interface(usbyb_device_handle * handle, int interface_number)
 {
     if (ioctl(handle->wrfd, USBDEVFS_CLAIMINTERFACE, &interface_number) < 0)
@@ -650,11 +3935,16 @@ int usbyb_release_interface(usbyb_device_handle * handle, int interface_number)
 
 int usbyb_get_configuration(usbyb_device_handle * handle, int * config_value, int cached_only)
 {
+    int r = LIBUSBY_SUCCESS;
+
     (void)cached_only;
+    pthread_mutex_lock(&handle->inflight_mutex);
     if (handle->active_config_value < 0)
-        return LIBUSBY_ERROR_NOT_SUPPORTED;
-    *config_value = handle->active_config_value;
-    return LIBUSBY_SUCCESS;
+        r = LIBUSBY_ERROR_NOT_SUPPORTED;
+    else
+        *config_value = handle->active_config_value;
+    pthread_mutex_unlock(&handle->inflight_mutex);
+    return r;
 }
 
 int usbyb_set_configuration(usbyb_device_handle * handle, int config_value)
@@ -662,6 +3952,9 @@ int usbyb_set_configuration(usbyb_device_handle * handle, int config_value)
     if (ioctl(handle->wrfd, USBDEVFS_SETCONFIGURATION, &config_value) < 0)
         return usbfs_error();
 
+    pthread_mutex_lock(&handle->inflight_mutex);
     handle->active_config_value = config_value;
+    usbfs_load_max_packet_sizes(handle, config_value);
+    pthread_mutex_unlock(&handle->inflight_mutex);
     return LIBUSBY_SUCCESS;
 }
@@ -16,12 +16,17 @@ extern int const usbyb_transfer_pub_offset;
 
 int usbyb_init(usbyb_context * ctx);
 void usbyb_exit(usbyb_context * ctx);
+int usbyb_set_option(usbyb_context * ctx, libusby_option option, int value);
 
 int usbyb_get_device_list(usbyb_context * ctx, libusby_device *** list);
 void usbyb_finalize_device(usbyb_device * dev);
 
 int usbyb_open(usbyb_device_handle *dev_handle); // opt
 void usbyb_close(usbyb_device_handle *dev_handle); // opt
+int usbyb_set_handle_shard(usbyb_device_handle * dev_handle, int shard); // opt
+int usbyb_get_handle_shard(usbyb_device_handle * dev_handle); // opt
+int usbyb_dev_mem_alloc(usbyb_device_handle * dev_handle, size_t length, uint8_t ** buffer); // opt
+int usbyb_dev_mem_free(usbyb_device_handle * dev_handle, uint8_t * buffer, size_t length); // opt
 
 int usbyb_get_descriptor(usbyb_device_handle * dev_handle, uint8_t desc_type, uint8_t desc_index, uint16_t langid, unsigned char * data, int length); // opt
 int usbyb_get_descriptor_cached(usbyb_device * dev, uint8_t desc_type, uint8_t desc_index, uint16_t langid, unsigned char * data, int length); // opt
@@ -33,15 +38,37 @@ int usbyb_claim_interface(usbyb_device_handle * dev_handle, int interface_number
 int usbyb_release_interface(usbyb_device_handle * dev_handle, int interface_number); // opt
 
 int usbyb_perform_transfer(usbyb_transfer * tran); // opt
+int usbyb_control_transfer(usbyb_device_handle * dev_handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t * data, uint16_t wLength, libusby_timeout_t timeout); // opt
 int usbyb_submit_transfer(usbyb_transfer * tran);
+int usbyb_submit_transfers(libusby_transfer ** transfers, int count, int * submitted);
 int usbyb_cancel_transfer(usbyb_transfer * tran);
+int usbyb_cancel_endpoint(usbyb_device_handle * dev_handle, libusby_endpoint_t endpoint); // opt
+int usbyb_cancel_all(usbyb_device_handle * dev_handle); // opt
+int usbyb_drain(usbyb_device_handle * dev_handle); // opt
+
+int usbyb_completion_queue_open(libusby_completion_queue ** queue, usbyb_context * ctx, int capacity); // opt
+void usbyb_completion_queue_close(libusby_completion_queue * queue); // opt
+int usbyb_set_transfer_queue(usbyb_transfer * tran, libusby_completion_queue * queue); // opt
+int usbyb_poll_completions(libusby_completion_queue * queue, libusby_transfer ** transfers, int max, int timeout); // opt
 
 int usbyb_wait_for_transfer(usbyb_transfer * transfer);
 int usbyb_run_event_loop(usbyb_context * ctx);
+int usbyb_start_event_thread(usbyb_context * ctx, libusby_thread_attrs const * attrs); // opt
 void usbyb_stop_event_loop(usbyb_context * ctx);
 void usbyb_reset_event_loop(usbyb_context * ctx);
+void usbyb_set_batch_callback(usbyb_context * ctx, libusby_batch_cb_fn callback, void * user_data);
+int usbyb_get_event_loop_stats(usbyb_context * ctx, libusby_event_loop_stats * stats); // opt
+int usbyb_set_clock(usbyb_context * ctx, libusby_clock_fn clock, void * user_data); // opt
+int usbyb_clock_advanced(usbyb_context * ctx); // opt
+
+int usbyb_hotplug_register_callback(usbyb_context * ctx, int events, int flags, int vendor_id, int product_id, int dev_class,
+    libusby_hotplug_callback_fn callback, void * user_data, libusby_hotplug_callback_handle * handle); // opt
+void usbyb_hotplug_deregister_callback(usbyb_context * ctx, libusby_hotplug_callback_handle handle); // opt
 
 int usbyb_init_transfer(usbyb_transfer * tran);
 void usbyb_clear_transfer(usbyb_transfer * tran);
+int usbyb_alloc_transfer(usbyb_context * ctx, int iso_packets, usbyb_transfer ** tran); // opt
+int usbyb_free_transfer(usbyb_transfer * tran); // opt
+int usbyb_get_transfer_pool_stats(usbyb_context * ctx, libusby_transfer_pool_stats * stats); // opt
 
 #endif
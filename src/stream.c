@@ -0,0 +1,407 @@
+#include "libusby.h"
+#include "libusbyi.h"
+#include "libusbyi_sync.h"
+#include <stdlib.h>
+
+/* A single-producer single-consumer ring of buffer indices. It is sized
+ * to hold every buffer of the stream, so pushing never fails. */
+typedef struct usbyi_stream_ring
+{
+	int * entries;
+	unsigned capacity;
+	unsigned head;
+	unsigned tail;
+} usbyi_stream_ring;
+
+typedef struct usbyi_stream_slot
+{
+	libusby_stream * stream;
+	libusby_transfer * tran;
+	int buffer;
+} usbyi_stream_slot;
+
+struct libusby_stream
+{
+	libusby_device_handle * handle;
+	libusby_endpoint_t endpoint;
+	int buffer_length;
+
+	libusby_stream_buffer * buffers;
+	int buffer_count;
+	usbyi_stream_slot * slots;
+	int transfer_count;
+
+	/* Completed buffers, from the event loop to the consumer. */
+	usbyi_stream_ring filled;
+	/* Released buffers, from the consumer to the event loop. */
+	usbyi_stream_ring free;
+
+	/* Protects the list of idle transfers, which ran out of buffers or were stopped.
+	 * The event loop only takes it when it has no free buffer to resubmit with. */
+	usbyi_mutex mutex;
+	usbyi_cond cond;
+	int * idle;
+	int idle_count;
+	int running;
+	int stopping;
+	int waiting;
+
+	libusby_stream_stats stats;
+};
+
+static int usbyi_stream_ring_init(usbyi_stream_ring * ring, unsigned capacity)
+{
+	ring->entries = malloc(sizeof(int) * capacity);
+	ring->capacity = capacity;
+	ring->head = 0;
+	ring->tail = 0;
+	return ring->entries? LIBUSBY_SUCCESS: LIBUSBY_ERROR_NO_MEM;
+}
+
+static void usbyi_stream_ring_push(usbyi_stream_ring * ring, int value)
+{
+	unsigned tail = ring->tail;
+	ring->entries[tail % ring->capacity] = value;
+	usbyi_atomic_store(&ring->tail, tail + 1);
+}
+
+static int usbyi_stream_ring_pop(usbyi_stream_ring * ring)
+{
+	unsigned head = ring->head;
+	int value;
+
+	if (head == usbyi_atomic_load(&ring->tail))
+		return -1;
+
+	value = ring->entries[head % ring->capacity];
+	usbyi_atomic_store(&ring->head, head + 1);
+	return value;
+}
+
+/* Wakes up a consumer blocked in `libusby_stream_read`, if there is one. */
+static void usbyi_stream_notify(libusby_stream * stream)
+{
+	if (!usbyi_atomic_load(&stream->waiting))
+		return;
+
+	usbyi_mutex_lock(&stream->mutex);
+	usbyi_cond_broadcast(&stream->cond);
+	usbyi_mutex_unlock(&stream->mutex);
+}
+
+static void usbyi_stream_callback(libusby_transfer * tran);
+
+static int usbyi_stream_submit(usbyi_stream_slot * slot, int buffer)
+{
+	libusby_stream * stream = slot->stream;
+
+	slot->buffer = buffer;
+	libusby_fill_bulk_transfer(slot->tran, stream->handle, stream->endpoint, stream->buffers[buffer].data, stream->buffer_length,
+		usbyi_stream_callback, slot, 0);
+	return libusby_submit_transfer(slot->tran);
+}
+
+/* Must be called with the stream's mutex held. */
+static void usbyi_stream_park(libusby_stream * stream, usbyi_stream_slot * slot)
+{
+	stream->idle[stream->idle_count++] = (int)(slot - stream->slots);
+	usbyi_atomic_add(&stream->running, -1);
+}
+
+/* Runs on the event loop thread. The transfer is resubmitted right away with
+ * a released buffer, without waking anyone up. */
+static void usbyi_stream_callback(libusby_transfer * tran)
+{
+	usbyi_stream_slot * slot = tran->user_data;
+	libusby_stream * stream = slot->stream;
+	libusby_stream_buffer * buffer = &stream->buffers[slot->buffer];
+	int next;
+	int r;
+
+	buffer->length = tran->actual_length;
+	buffer->status = tran->status;
+	usbyi_atomic_add64(&stream->stats.transfers, 1);
+	usbyi_atomic_add64(&stream->stats.bytes, tran->actual_length);
+	usbyi_stream_ring_push(&stream->filled, slot->buffer);
+	slot->buffer = -1;
+
+	next = -1;
+	if (tran->status == LIBUSBY_TRANSFER_COMPLETED && !usbyi_atomic_load(&stream->stopping))
+	{
+		next = usbyi_stream_ring_pop(&stream->free);
+		if (next < 0)
+		{
+			/* The consumer holds every buffer; `libusby_stream_release` restarts the transfer. */
+			usbyi_mutex_lock(&stream->mutex);
+			next = usbyi_stream_ring_pop(&stream->free);
+			if (next < 0)
+			{
+				usbyi_atomic_add64(&stream->stats.overflows, 1);
+				usbyi_stream_park(stream, slot);
+			}
+			usbyi_mutex_unlock(&stream->mutex);
+		}
+	}
+	else
+	{
+		usbyi_mutex_lock(&stream->mutex);
+		usbyi_stream_park(stream, slot);
+		usbyi_mutex_unlock(&stream->mutex);
+	}
+
+	if (next >= 0)
+	{
+		r = usbyi_stream_submit(slot, next);
+		if (r < 0)
+		{
+			/* Report the failure through the buffer that couldn't be used. */
+			stream->buffers[next].length = 0;
+			stream->buffers[next].status = r == LIBUSBY_ERROR_NO_DEVICE? LIBUSBY_TRANSFER_NO_DEVICE: LIBUSBY_TRANSFER_ERROR;
+			usbyi_stream_ring_push(&stream->filled, next);
+			slot->buffer = -1;
+
+			usbyi_mutex_lock(&stream->mutex);
+			usbyi_stream_park(stream, slot);
+			usbyi_mutex_unlock(&stream->mutex);
+		}
+		else if (usbyi_atomic_load(&stream->stopping))
+		{
+			/* The stream was stopped while we were resubmitting, the stopping
+			 * thread may have already tried to cancel this transfer. */
+			libusby_cancel_transfer(tran);
+		}
+	}
+
+	usbyi_stream_notify(stream);
+}
+
+int libusby_stream_open(libusby_stream ** stream, libusby_device_handle * dev_handle, libusby_endpoint_t endpoint, int buffer_length, int buffer_count, int transfer_count)
+{
+	libusby_device_handle * handle = dev_handle;
+	libusby_context * ctx = libusby_get_device(handle)->ctx;
+	libusby_stream * res;
+	int i;
+
+	if ((endpoint & LIBUSBY_ENDPOINT_DIR_MASK) != LIBUSBY_ENDPOINT_IN || buffer_length <= 0 || transfer_count <= 0 || buffer_count < transfer_count)
+		return LIBUSBY_ERROR_INVALID_PARAM;
+
+	res = calloc(1, sizeof *res);
+	if (!res)
+		return LIBUSBY_ERROR_NO_MEM;
+
+	res->handle = handle;
+	res->endpoint = endpoint;
+	res->buffer_length = buffer_length;
+	res->buffer_count = buffer_count;
+	res->transfer_count = transfer_count;
+
+	if (usbyi_mutex_init(&res->mutex) != 0)
+		goto error_free;
+
+	if (usbyi_cond_init(&res->cond) != 0)
+		goto error_mutex;
+
+	res->buffers = calloc(buffer_count, sizeof(libusby_stream_buffer));
+	res->slots = calloc(transfer_count, sizeof(usbyi_stream_slot));
+	res->idle = malloc(sizeof(int) * transfer_count);
+	if (!res->buffers || !res->slots || !res->idle)
+		goto error_arrays;
+
+	if (usbyi_stream_ring_init(&res->filled, buffer_count) < 0 || usbyi_stream_ring_init(&res->free, buffer_count) < 0)
+		goto error_arrays;
+
+	/* Device memory spares the kernel a copy of every buffer. */
+	for (i = 0; i < buffer_count; ++i)
+	{
+		res->buffers[i].data = libusby_dev_mem_alloc(handle, buffer_length);
+		if (!res->buffers[i].data)
+			goto error_buffers;
+		usbyi_stream_ring_push(&res->free, i);
+	}
+
+	for (i = 0; i < transfer_count; ++i)
+	{
+		res->slots[i].stream = res;
+		res->slots[i].buffer = -1;
+		res->slots[i].tran = libusby_alloc_transfer(ctx, 0);
+		if (!res->slots[i].tran)
+			goto error_transfers;
+		res->idle[res->idle_count++] = i;
+	}
+
+	*stream = res;
+	return LIBUSBY_SUCCESS;
+
+error_transfers:
+	while (i--)
+		libusby_free_transfer(res->slots[i].tran);
+	i = buffer_count;
+
+error_buffers:
+	while (i--)
+		libusby_dev_mem_free(handle, res->buffers[i].data, buffer_length);
+
+error_arrays:
+	free(res->free.entries);
+	free(res->filled.entries);
+	free(res->idle);
+	free(res->slots);
+	free(res->buffers);
+	usbyi_cond_destroy(&res->cond);
+
+error_mutex:
+	usbyi_mutex_destroy(&res->mutex);
+
+error_free:
+	free(res);
+	return LIBUSBY_ERROR_NO_MEM;
+}
+
+void libusby_stream_close(libusby_stream * stream)
+{
+	int i;
+
+	libusby_stream_stop(stream);
+
+	for (i = 0; i < stream->transfer_count; ++i)
+		libusby_free_transfer(stream->slots[i].tran);
+	for (i = 0; i < stream->buffer_count; ++i)
+		libusby_dev_mem_free(stream->handle, stream->buffers[i].data, stream->buffer_length);
+
+	free(stream->free.entries);
+	free(stream->filled.entries);
+	free(stream->idle);
+	free(stream->slots);
+	free(stream->buffers);
+	usbyi_cond_destroy(&stream->cond);
+	usbyi_mutex_destroy(&stream->mutex);
+	free(stream);
+}
+
+int libusby_stream_start(libusby_stream * stream)
+{
+	int r = LIBUSBY_SUCCESS;
+
+	usbyi_mutex_lock(&stream->mutex);
+	if (usbyi_atomic_load(&stream->running))
+	{
+		usbyi_mutex_unlock(&stream->mutex);
+		return LIBUSBY_ERROR_BUSY;
+	}
+
+	usbyi_atomic_store(&stream->stopping, 0);
+
+	/* Nothing is running, so the event loop won't pop free buffers concurrently. */
+	while (r >= 0 && stream->idle_count)
+	{
+		usbyi_stream_slot * slot = &stream->slots[stream->idle[stream->idle_count - 1]];
+		int buffer = usbyi_stream_ring_pop(&stream->free);
+		if (buffer < 0)
+			break;
+
+		--stream->idle_count;
+		usbyi_atomic_add(&stream->running, 1);
+		r = usbyi_stream_submit(slot, buffer);
+		if (r < 0)
+		{
+			slot->buffer = -1;
+			usbyi_stream_park(stream, slot);
+			usbyi_stream_ring_push(&stream->free, buffer);
+		}
+	}
+	usbyi_mutex_unlock(&stream->mutex);
+
+	if (r < 0)
+		libusby_stream_stop(stream);
+	return r;
+}
+
+void libusby_stream_stop(libusby_stream * stream)
+{
+	int i;
+
+	usbyi_mutex_lock(&stream->mutex);
+	usbyi_atomic_store(&stream->stopping, 1);
+	usbyi_mutex_unlock(&stream->mutex);
+
+	for (i = 0; i < stream->transfer_count; ++i)
+		libusby_cancel_transfer(stream->slots[i].tran);
+	for (i = 0; i < stream->transfer_count; ++i)
+		libusby_wait_for_transfer(stream->slots[i].tran);
+
+	usbyi_mutex_lock(&stream->mutex);
+	usbyi_cond_broadcast(&stream->cond);
+	usbyi_mutex_unlock(&stream->mutex);
+}
+
+int libusby_stream_read(libusby_stream * stream, libusby_stream_buffer ** buffer, int block)
+{
+	int index = usbyi_stream_ring_pop(&stream->filled);
+
+	if (index < 0)
+	{
+		/* A blocking read waiting for the next buffer is flow control, not an underrun. */
+		if (!block)
+		{
+			usbyi_atomic_add64(&stream->stats.underruns, 1);
+			return LIBUSBY_ERROR_TIMEOUT;
+		}
+
+		usbyi_mutex_lock(&stream->mutex);
+		usbyi_atomic_store(&stream->waiting, 1);
+		while ((index = usbyi_stream_ring_pop(&stream->filled)) < 0 && usbyi_atomic_load(&stream->running))
+			usbyi_cond_wait(&stream->cond, &stream->mutex);
+		usbyi_atomic_store(&stream->waiting, 0);
+		usbyi_mutex_unlock(&stream->mutex);
+
+		/* Nothing is in flight, so nothing will arrive. */
+		if (index < 0)
+			return LIBUSBY_ERROR_INTERRUPTED;
+	}
+
+	*buffer = &stream->buffers[index];
+	return LIBUSBY_SUCCESS;
+}
+
+void libusby_stream_release(libusby_stream * stream, libusby_stream_buffer * buffer)
+{
+	int index = (int)(buffer - stream->buffers);
+	usbyi_stream_slot * slot = 0;
+
+	usbyi_mutex_lock(&stream->mutex);
+	if (stream->idle_count && !usbyi_atomic_load(&stream->stopping))
+	{
+		slot = &stream->slots[stream->idle[--stream->idle_count]];
+		usbyi_atomic_add(&stream->running, 1);
+	}
+	else
+	{
+		usbyi_stream_ring_push(&stream->free, index);
+	}
+	usbyi_mutex_unlock(&stream->mutex);
+
+	if (!slot)
+		return;
+
+	if (usbyi_stream_submit(slot, index) < 0)
+	{
+		usbyi_mutex_lock(&stream->mutex);
+		slot->buffer = -1;
+		usbyi_stream_park(stream, slot);
+		usbyi_stream_ring_push(&stream->free, index);
+		usbyi_mutex_unlock(&stream->mutex);
+		usbyi_stream_notify(stream);
+	}
+	else if (usbyi_atomic_load(&stream->stopping))
+	{
+		libusby_cancel_transfer(slot->tran);
+	}
+}
+
+void libusby_stream_get_stats(libusby_stream * stream, libusby_stream_stats * stats)
+{
+	stats->transfers = usbyi_atomic_load64(&stream->stats.transfers);
+	stats->bytes = usbyi_atomic_load64(&stream->stats.bytes);
+	stats->overflows = usbyi_atomic_load64(&stream->stats.overflows);
+	stats->underruns = usbyi_atomic_load64(&stream->stats.underruns);
+}
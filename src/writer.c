@@ -0,0 +1,379 @@
+#include "libusby.h"
+#include "libusbyi.h"
+#include "libusbyi_sync.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct usbyi_writer_slot
+{
+	libusby_writer * writer;
+	libusby_transfer * tran;
+	uint8_t * data;
+} usbyi_writer_slot;
+
+struct libusby_writer
+{
+	libusby_device_handle * handle;
+	libusby_endpoint_t endpoint;
+	int max_packet_size;
+	int buffer_length;
+	libusby_timeout_t flush_timeout;
+
+	usbyi_writer_slot * slots;
+	int buffer_count;
+
+	/* Protects everything below. The producer holds it while copying
+	 * into the current buffer, the event loop while retiring a transfer. */
+	usbyi_mutex mutex;
+	int * free;
+	int free_count;
+	int current;
+	int fill;
+	uint64_t started;
+	int inflight;
+
+	/* Set when the last transfer ended on a packet boundary without
+	 * a zero-length packet, which a flush then has to send. */
+	int need_zlp;
+
+	/* The first error, after which the writer refuses any more data. */
+	int error;
+
+	/* With a flush timeout, a thread submits the current buffer once its deadline
+	 * passes, even if nothing is written or completed in the meantime. */
+	usbyi_cond cond;
+	usbyi_thread flusher;
+	int closing;
+};
+
+static int usbyi_writer_error(libusby_transfer_status status)
+{
+	switch (status)
+	{
+	case LIBUSBY_TRANSFER_COMPLETED:
+		return LIBUSBY_SUCCESS;
+	case LIBUSBY_TRANSFER_TIMED_OUT:
+		return LIBUSBY_ERROR_TIMEOUT;
+	case LIBUSBY_TRANSFER_STALL:
+		return LIBUSBY_ERROR_PIPE;
+	case LIBUSBY_TRANSFER_NO_DEVICE:
+		return LIBUSBY_ERROR_NO_DEVICE;
+	case LIBUSBY_TRANSFER_OVERFLOW:
+		return LIBUSBY_ERROR_OVERFLOW;
+	case LIBUSBY_TRANSFER_CANCELLED:
+		return LIBUSBY_ERROR_INTERRUPTED;
+	default:
+		return LIBUSBY_ERROR_IO;
+	}
+}
+
+static void usbyi_writer_callback(libusby_transfer * tran);
+
+/* Submits the current buffer. A zero-length packet is added when this is the end
+ * of the data the producer wants delivered. Must be called with the writer's mutex held. */
+static int usbyi_writer_submit(libusby_writer * writer, int end_of_data)
+{
+	usbyi_writer_slot * slot = &writer->slots[writer->current];
+	int aligned = writer->max_packet_size > 0 && writer->fill > 0 && writer->fill % writer->max_packet_size == 0;
+	int r;
+
+	libusby_fill_bulk_transfer(slot->tran, writer->handle, writer->endpoint, slot->data, writer->fill, usbyi_writer_callback, slot, 0);
+	if (end_of_data && aligned)
+		slot->tran->flags |= LIBUSBY_TRANSFER_ADD_ZERO_PACKET;
+
+	r = libusby_submit_transfer(slot->tran);
+	if (r < 0)
+	{
+		writer->error = r;
+		return r;
+	}
+
+	writer->need_zlp = !end_of_data && aligned;
+	writer->current = -1;
+	writer->fill = 0;
+	++writer->inflight;
+	return LIBUSBY_SUCCESS;
+}
+
+/* Must be called with the writer's mutex held. */
+static int usbyi_writer_deadline_passed(libusby_writer * writer)
+{
+	return writer->flush_timeout && usbyi_now_ms() - writer->started >= writer->flush_timeout;
+}
+
+/* Runs on the event loop thread. Data gathered while the transfer was
+ * in flight is sent once the pipe goes idle or its deadline passes. */
+static void usbyi_writer_callback(libusby_transfer * tran)
+{
+	usbyi_writer_slot * slot = tran->user_data;
+	libusby_writer * writer = slot->writer;
+
+	usbyi_mutex_lock(&writer->mutex);
+	--writer->inflight;
+	writer->free[writer->free_count++] = (int)(slot - writer->slots);
+
+	if (tran->status != LIBUSBY_TRANSFER_COMPLETED && writer->error == 0)
+		writer->error = usbyi_writer_error(tran->status);
+
+	if (writer->error == 0 && writer->current >= 0 && writer->fill
+			&& (writer->inflight == 0 || usbyi_writer_deadline_passed(writer)))
+	{
+		usbyi_writer_submit(writer, usbyi_writer_deadline_passed(writer));
+	}
+
+	usbyi_mutex_unlock(&writer->mutex);
+}
+
+static USBYI_THREAD_PROC(usbyi_writer_flusher, arg)
+{
+	libusby_writer * writer = arg;
+
+	usbyi_mutex_lock(&writer->mutex);
+	while (!writer->closing)
+	{
+		uint64_t elapsed;
+
+		if (writer->error || writer->current < 0 || !writer->fill)
+		{
+			usbyi_cond_wait(&writer->cond, &writer->mutex);
+			continue;
+		}
+
+		elapsed = usbyi_now_ms() - writer->started;
+		if (elapsed >= writer->flush_timeout)
+			usbyi_writer_submit(writer, 1);
+		else
+			usbyi_cond_timedwait(&writer->cond, &writer->mutex, writer->flush_timeout - elapsed);
+	}
+	usbyi_mutex_unlock(&writer->mutex);
+	USBYI_THREAD_RETURN;
+}
+
+int libusby_writer_open(libusby_writer ** writer, libusby_device_handle * dev_handle, libusby_endpoint_t endpoint, int buffer_length, int buffer_count, libusby_timeout_t flush_timeout)
+{
+	libusby_device_handle * handle = dev_handle;
+	libusby_device * dev = libusby_get_device(handle);
+	libusby_writer * res;
+	int i;
+
+	if ((endpoint & LIBUSBY_ENDPOINT_DIR_MASK) != LIBUSBY_ENDPOINT_OUT || buffer_length <= 0 || buffer_count <= 0)
+		return LIBUSBY_ERROR_INVALID_PARAM;
+
+	res = calloc(1, sizeof *res);
+	if (!res)
+		return LIBUSBY_ERROR_NO_MEM;
+
+	res->handle = handle;
+	res->endpoint = endpoint;
+	res->buffer_count = buffer_count;
+	res->flush_timeout = flush_timeout;
+	res->current = -1;
+
+	/* Without a known packet size, buffers are used as they are and no zero-length packets are sent. */
+	res->max_packet_size = libusby_get_max_packet_size(dev, endpoint);
+	if (res->max_packet_size < 0)
+		res->max_packet_size = 0;
+	if (res->max_packet_size && buffer_length >= res->max_packet_size)
+		buffer_length -= buffer_length % res->max_packet_size;
+	res->buffer_length = buffer_length;
+
+	if (usbyi_mutex_init(&res->mutex) != 0)
+		goto error_free;
+
+	res->slots = calloc(buffer_count, sizeof(usbyi_writer_slot));
+	res->free = malloc(sizeof(int) * buffer_count);
+	if (!res->slots || !res->free)
+		goto error_arrays;
+
+	for (i = 0; i < buffer_count; ++i)
+	{
+		usbyi_writer_slot * slot = &res->slots[i];
+
+		slot->writer = res;
+		slot->data = libusby_dev_mem_alloc(handle, buffer_length);
+		slot->tran = libusby_alloc_transfer(dev->ctx, 0);
+		if (!slot->data || !slot->tran)
+		{
+			++i;
+			goto error_slots;
+		}
+
+		res->free[res->free_count++] = i;
+	}
+
+	if (flush_timeout)
+	{
+		if (usbyi_cond_init(&res->cond) != 0)
+			goto error_slots;
+		if (usbyi_thread_create(&res->flusher, &usbyi_writer_flusher, res) != 0)
+		{
+			usbyi_cond_destroy(&res->cond);
+			goto error_slots;
+		}
+	}
+
+	*writer = res;
+	return LIBUSBY_SUCCESS;
+
+error_slots:
+	while (i--)
+	{
+		if (res->slots[i].tran)
+			libusby_free_transfer(res->slots[i].tran);
+		if (res->slots[i].data)
+			libusby_dev_mem_free(handle, res->slots[i].data, buffer_length);
+	}
+
+error_arrays:
+	free(res->free);
+	free(res->slots);
+	usbyi_mutex_destroy(&res->mutex);
+
+error_free:
+	free(res);
+	return LIBUSBY_ERROR_NO_MEM;
+}
+
+void libusby_writer_close(libusby_writer * writer)
+{
+	int i;
+
+	libusby_writer_drain(writer);
+
+	if (writer->flush_timeout)
+	{
+		usbyi_mutex_lock(&writer->mutex);
+		writer->closing = 1;
+		usbyi_cond_broadcast(&writer->cond);
+		usbyi_mutex_unlock(&writer->mutex);
+
+		usbyi_thread_join(writer->flusher);
+		usbyi_cond_destroy(&writer->cond);
+	}
+
+	for (i = 0; i < writer->buffer_count; ++i)
+	{
+		libusby_free_transfer(writer->slots[i].tran);
+		libusby_dev_mem_free(writer->handle, writer->slots[i].data, writer->buffer_length);
+	}
+
+	free(writer->free);
+	free(writer->slots);
+	usbyi_mutex_destroy(&writer->mutex);
+	free(writer);
+}
+
+int libusby_writer_write(libusby_writer * writer, uint8_t const * data, int length)
+{
+	int accepted = 0;
+	int r;
+
+	usbyi_mutex_lock(&writer->mutex);
+	while (writer->error == 0 && accepted < length)
+	{
+		int chunk;
+
+		if (writer->current < 0)
+		{
+			if (!writer->free_count)
+				break;
+
+			writer->current = writer->free[--writer->free_count];
+			writer->fill = 0;
+			writer->started = usbyi_now_ms();
+			if (writer->flush_timeout)
+				usbyi_cond_broadcast(&writer->cond);
+		}
+
+		chunk = writer->buffer_length - writer->fill;
+		if (chunk > length - accepted)
+			chunk = length - accepted;
+
+		memcpy(writer->slots[writer->current].data + writer->fill, data + accepted, chunk);
+		writer->fill += chunk;
+		accepted += chunk;
+
+		if (writer->fill == writer->buffer_length)
+			usbyi_writer_submit(writer, 0);
+	}
+
+	if (writer->error == 0 && writer->current >= 0 && writer->fill
+			&& (writer->inflight == 0 || usbyi_writer_deadline_passed(writer)))
+	{
+		usbyi_writer_submit(writer, usbyi_writer_deadline_passed(writer));
+	}
+
+	r = accepted || writer->error == 0? accepted: writer->error;
+	usbyi_mutex_unlock(&writer->mutex);
+	return r;
+}
+
+/* Must be called with the writer's mutex held. */
+static int usbyi_writer_flush(libusby_writer * writer)
+{
+	if (writer->error)
+		return writer->error;
+
+	if (writer->current >= 0 && writer->fill)
+		return usbyi_writer_submit(writer, 1);
+
+	if (!writer->need_zlp)
+		return LIBUSBY_SUCCESS;
+
+	/* The previous transfer ended on a packet boundary, terminate it with an empty one. */
+	if (writer->current < 0)
+	{
+		if (!writer->free_count)
+			return LIBUSBY_ERROR_BUSY;
+		writer->current = writer->free[--writer->free_count];
+		writer->fill = 0;
+	}
+
+	return usbyi_writer_submit(writer, 1);
+}
+
+int libusby_writer_flush(libusby_writer * writer)
+{
+	int r;
+
+	usbyi_mutex_lock(&writer->mutex);
+	r = usbyi_writer_flush(writer);
+	usbyi_mutex_unlock(&writer->mutex);
+	return r;
+}
+
+int libusby_writer_drain(libusby_writer * writer)
+{
+	int r;
+
+	usbyi_mutex_lock(&writer->mutex);
+	for (;;)
+	{
+		r = usbyi_writer_flush(writer);
+		if (r != LIBUSBY_ERROR_BUSY && writer->inflight == 0)
+			break;
+
+		/* Without a loop thread, the transfers have to be reaped from here. */
+		if (writer->inflight)
+		{
+			libusby_transfer * tran = 0;
+			int i;
+
+			for (i = 0; !tran && i < writer->buffer_count; ++i)
+			{
+				int j;
+				int is_free = writer->current == i;
+				for (j = 0; !is_free && j < writer->free_count; ++j)
+					is_free = writer->free[j] == i;
+				if (!is_free)
+					tran = writer->slots[i].tran;
+			}
+
+			usbyi_mutex_unlock(&writer->mutex);
+			libusby_wait_for_transfer(tran);
+			usbyi_mutex_lock(&writer->mutex);
+		}
+	}
+	usbyi_mutex_unlock(&writer->mutex);
+	return r;
+}
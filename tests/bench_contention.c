@@ -0,0 +1,88 @@
+#include "tests.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+/* Threads each drive a device of their own through one context, submitting
+ * a transfer and waiting for it in a loop. With URBs completing during the
+ * submit ioctl, the rate measures the library's own overhead, which is
+ * expected to scale with the thread count up to the number of cores. */
+
+#define CONTENTION_TRANSFERS 20000
+
+typedef struct contention_worker
+{
+    pthread_t thread;
+    libusby_context * ctx;
+    libusby_device_handle * handle;
+    int failed;
+} contention_worker;
+
+static void * contention_thread(void * param)
+{
+    contention_worker * worker = param;
+    libusby_transfer * tran = libusby_alloc_transfer(worker->ctx, 0);
+    uint8_t buf[64];
+    int i;
+
+    if (!tran)
+    {
+        worker->failed = 1;
+        return 0;
+    }
+
+    libusby_fill_bulk_transfer(tran, worker->handle, 0x81, buf, sizeof buf, 0, 0, 0);
+    for (i = 0; i < CONTENTION_TRANSFERS && !worker->failed; ++i)
+    {
+        if (libusby_submit_transfer(tran) < 0 || libusby_wait_for_transfer(tran) < 0
+                || tran->status != LIBUSBY_TRANSFER_COMPLETED)
+        {
+            worker->failed = 1;
+        }
+    }
+
+    libusby_free_transfer(tran);
+    return 0;
+}
+
+int bench_contention(void)
+{
+    static int const thread_counts[] = { 1, 2, 4, 8 };
+    int c;
+
+    for (c = 0; c < 4; ++c)
+    {
+        contention_worker workers[8];
+        libusby_context * ctx = test_init();
+        int count = thread_counts[c];
+        uint64_t start, elapsed;
+        int i;
+
+        TEST_CHECK(ctx != 0);
+        for (i = 0; i < count; ++i)
+        {
+            workers[i].ctx = ctx;
+            workers[i].handle = test_open(ctx, i + 1);
+            workers[i].failed = 0;
+            TEST_CHECK(workers[i].handle != 0);
+        }
+
+        start = test_now_us();
+        for (i = 0; i < count; ++i)
+            TEST_CHECK(pthread_create(&workers[i].thread, 0, &contention_thread, &workers[i]) == 0);
+        for (i = 0; i < count; ++i)
+            pthread_join(workers[i].thread, 0);
+        elapsed = test_now_us() - start;
+
+        for (i = 0; i < count; ++i)
+        {
+            TEST_CHECK(!workers[i].failed);
+            libusby_close(workers[i].handle);
+        }
+        libusby_exit(ctx);
+
+        printf("contention: %d threads, %.0f transfers/s\n", count,
+            (double)count * CONTENTION_TRANSFERS * 1000000 / (elapsed? elapsed: 1));
+    }
+
+    return 0;
+}
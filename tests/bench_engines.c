@@ -0,0 +1,151 @@
+#include "tests.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/* Compares the event engines, first by the round trip of a single transfer
+ * submitted and waited for, then by the CPU time spent per transfer while
+ * several devices stream with their callbacks resubmitting. */
+
+#define ENGINES_ROUNDTRIPS 20000
+#define ENGINES_DEVICES 8
+#define ENGINES_DEPTH 8
+#define ENGINES_STREAMED 200000
+
+typedef struct engines_stream
+{
+    int remaining;
+    int outstanding;
+} engines_stream;
+
+static int engines_compare(void const * a, void const * b)
+{
+    uint32_t x = *(uint32_t const *)a;
+    uint32_t y = *(uint32_t const *)b;
+    return x < y? -1: x > y;
+}
+
+static uint64_t engines_cpu_us(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+        + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void engines_stream_cb(libusby_transfer * tran)
+{
+    engines_stream * stream = tran->user_data;
+
+    if (__atomic_sub_fetch(&stream->remaining, 1, __ATOMIC_SEQ_CST) >= 0 && libusby_submit_transfer(tran) >= 0)
+        return;
+    __atomic_sub_fetch(&stream->outstanding, 1, __ATOMIC_SEQ_CST);
+}
+
+static int engines_roundtrip(uint32_t * samples)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    libusby_transfer * tran;
+    uint8_t buf[64];
+    int i;
+
+    TEST_CHECK(ctx != 0);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+    tran = libusby_alloc_transfer(ctx, 0);
+    TEST_CHECK(tran != 0);
+
+    libusby_fill_bulk_transfer(tran, handle, 0x81, buf, sizeof buf, 0, 0, 0);
+    for (i = 0; i < ENGINES_ROUNDTRIPS; ++i)
+    {
+        uint64_t start = test_now_us();
+        TEST_CHECK(libusby_submit_transfer(tran) == LIBUSBY_SUCCESS);
+        TEST_CHECK(libusby_wait_for_transfer(tran) == LIBUSBY_SUCCESS);
+        samples[i] = (uint32_t)(test_now_us() - start);
+    }
+
+    libusby_free_transfer(tran);
+    libusby_close(handle);
+    libusby_exit(ctx);
+    return 0;
+}
+
+static int engines_streaming(double * cpu_per_transfer, double * rate)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handles[ENGINES_DEVICES];
+    libusby_transfer * trans[ENGINES_DEVICES * ENGINES_DEPTH];
+    libusby_thread_attrs attrs;
+    engines_stream stream;
+    static uint8_t bufs[ENGINES_DEVICES * ENGINES_DEPTH][512];
+    uint64_t start, cpu_start;
+    int i;
+
+    TEST_CHECK(ctx != 0);
+    for (i = 0; i < ENGINES_DEVICES; ++i)
+    {
+        handles[i] = test_open(ctx, i + 1);
+        TEST_CHECK(handles[i] != 0);
+    }
+
+    memset(&attrs, 0, sizeof attrs);
+    TEST_CHECK(libusby_start_event_thread(ctx, &attrs) == LIBUSBY_SUCCESS);
+
+    stream.remaining = ENGINES_STREAMED;
+    stream.outstanding = ENGINES_DEVICES * ENGINES_DEPTH;
+    for (i = 0; i < ENGINES_DEVICES * ENGINES_DEPTH; ++i)
+    {
+        trans[i] = libusby_alloc_transfer(ctx, 0);
+        TEST_CHECK(trans[i] != 0);
+        libusby_fill_bulk_transfer(trans[i], handles[i / ENGINES_DEPTH], 0x81, bufs[i], sizeof bufs[i], &engines_stream_cb, &stream, 0);
+    }
+
+    start = test_now_us();
+    cpu_start = engines_cpu_us();
+    for (i = 0; i < ENGINES_DEVICES * ENGINES_DEPTH; ++i)
+        TEST_CHECK(libusby_submit_transfer(trans[i]) == LIBUSBY_SUCCESS);
+    while (__atomic_load_n(&stream.outstanding, __ATOMIC_SEQ_CST))
+        usleep(1000);
+    *cpu_per_transfer = (double)(engines_cpu_us() - cpu_start) / ENGINES_STREAMED;
+    *rate = (double)ENGINES_STREAMED * 1000000 / (test_now_us() - start);
+
+    libusby_stop_event_loop(ctx);
+    for (i = 0; i < ENGINES_DEVICES * ENGINES_DEPTH; ++i)
+        libusby_free_transfer(trans[i]);
+    for (i = 0; i < ENGINES_DEVICES; ++i)
+        libusby_close(handles[i]);
+    libusby_exit(ctx);
+    return 0;
+}
+
+int bench_engines(void)
+{
+    static libusby_event_engine const engines[] = { LIBUSBY_EVENT_ENGINE_EPOLL, LIBUSBY_EVENT_ENGINE_IO_URING };
+    static char const * const names[] = { "epoll", "io_uring" };
+    uint32_t * samples = malloc(sizeof(uint32_t) * ENGINES_ROUNDTRIPS);
+    int e;
+
+    TEST_CHECK(samples != 0);
+    for (e = 0; e < 2; ++e)
+    {
+        double cpu, rate;
+
+        test_engine = engines[e];
+        if (engines_roundtrip(samples) != 0)
+        {
+            printf("engines: %s is not supported\n", names[e]);
+            continue;
+        }
+        qsort(samples, ENGINES_ROUNDTRIPS, sizeof *samples, &engines_compare);
+        TEST_CHECK(engines_streaming(&cpu, &rate) == 0);
+
+        printf("engines: %s, round trip median %u us, p99 %u us; streaming %.0f transfers/s, %.2f us CPU per transfer\n",
+            names[e], samples[ENGINES_ROUNDTRIPS / 2], samples[ENGINES_ROUNDTRIPS * 99 / 100], rate, cpu);
+    }
+
+    test_engine = LIBUSBY_EVENT_ENGINE_DEFAULT;
+    free(samples);
+    return 0;
+}
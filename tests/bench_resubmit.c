@@ -0,0 +1,97 @@
+#include "tests.h"
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/* Callbacks resubmitting their transfers on the loop thread, with and without
+ * a timeout. Resubmissions with a timeout only mark the shard's timer dirty,
+ * so the timerfd is rearmed at most once per loop iteration rather than
+ * once per transfer. */
+
+#define RESUBMIT_TRANSFERS 8
+#define RESUBMIT_TOTAL 100000
+
+typedef struct resubmit_state
+{
+    int remaining;
+    int outstanding;
+} resubmit_state;
+
+static uint64_t resubmit_cpu_us(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+        + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void resubmit_cb(libusby_transfer * tran)
+{
+    resubmit_state * state = tran->user_data;
+
+    if (__atomic_sub_fetch(&state->remaining, 1, __ATOMIC_SEQ_CST) >= 0 && libusby_submit_transfer(tran) >= 0)
+        return;
+    __atomic_sub_fetch(&state->outstanding, 1, __ATOMIC_SEQ_CST);
+}
+
+static int resubmit_run(libusby_timeout_t timeout, double * cpu_per_transfer, double * rearms_per_transfer)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    libusby_transfer * trans[RESUBMIT_TRANSFERS];
+    libusby_thread_attrs attrs;
+    mock_usbfs_counters before, after;
+    resubmit_state state;
+    static uint8_t bufs[RESUBMIT_TRANSFERS][512];
+    uint64_t cpu_start;
+    int i;
+
+    TEST_CHECK(ctx != 0);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+
+    memset(&attrs, 0, sizeof attrs);
+    TEST_CHECK(libusby_start_event_thread(ctx, &attrs) == LIBUSBY_SUCCESS);
+
+    state.remaining = RESUBMIT_TOTAL;
+    state.outstanding = RESUBMIT_TRANSFERS;
+    for (i = 0; i < RESUBMIT_TRANSFERS; ++i)
+    {
+        trans[i] = libusby_alloc_transfer(ctx, 0);
+        TEST_CHECK(trans[i] != 0);
+        libusby_fill_bulk_transfer(trans[i], handle, 0x81, bufs[i], sizeof bufs[i], &resubmit_cb, &state, timeout);
+    }
+
+    mock_usbfs_get_counters(&before);
+    cpu_start = resubmit_cpu_us();
+    for (i = 0; i < RESUBMIT_TRANSFERS; ++i)
+        TEST_CHECK(libusby_submit_transfer(trans[i]) == LIBUSBY_SUCCESS);
+    while (__atomic_load_n(&state.outstanding, __ATOMIC_SEQ_CST))
+        usleep(1000);
+    *cpu_per_transfer = (double)(resubmit_cpu_us() - cpu_start) / RESUBMIT_TOTAL;
+    mock_usbfs_get_counters(&after);
+    *rearms_per_transfer = (double)(after.timer_rearms - before.timer_rearms) / RESUBMIT_TOTAL;
+
+    libusby_stop_event_loop(ctx);
+    for (i = 0; i < RESUBMIT_TRANSFERS; ++i)
+        libusby_free_transfer(trans[i]);
+    libusby_close(handle);
+    libusby_exit(ctx);
+    return 0;
+}
+
+int bench_resubmit(void)
+{
+    static libusby_timeout_t const timeouts[] = { 0, 1000 };
+    int i;
+
+    mock_usbfs_set_delay_us(0);
+    for (i = 0; i < 2; ++i)
+    {
+        double cpu, rearms;
+        TEST_CHECK(resubmit_run(timeouts[i], &cpu, &rearms) == 0);
+        printf("resubmit: timeout %u ms, %.2f us CPU and %.3f timer rearms per transfer\n", timeouts[i], cpu, rearms);
+    }
+
+    return 0;
+}
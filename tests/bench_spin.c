@@ -0,0 +1,56 @@
+#include "tests.h"
+
+/* Ping-pong latency of a single transfer submitted and waited for in a loop,
+ * completed by the mock's completer thread shortly after the submission,
+ * with and without spinning on the handle before blocking. Spinning only
+ * pays off with a core to spare for whoever completes the transfer. */
+
+#define SPIN_TRANSFERS 10000
+
+static int spin_measure(int spin_us, double * latency_us)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    libusby_transfer * tran;
+    uint8_t buf[64];
+    uint64_t start;
+    int i;
+
+    TEST_CHECK(ctx != 0);
+    TEST_CHECK(libusby_set_option(ctx, LIBUSBY_OPTION_SPIN_WAIT_US, spin_us) == LIBUSBY_SUCCESS);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+    tran = libusby_alloc_transfer(ctx, 0);
+    TEST_CHECK(tran != 0);
+    libusby_fill_bulk_transfer(tran, handle, 0x81, buf, sizeof buf, 0, 0, 0);
+
+    start = test_now_us();
+    for (i = 0; i < SPIN_TRANSFERS; ++i)
+    {
+        TEST_CHECK(libusby_submit_transfer(tran) == LIBUSBY_SUCCESS);
+        TEST_CHECK(libusby_wait_for_transfer(tran) == LIBUSBY_SUCCESS);
+        TEST_CHECK(tran->status == LIBUSBY_TRANSFER_COMPLETED);
+    }
+    *latency_us = (double)(test_now_us() - start) / SPIN_TRANSFERS;
+
+    libusby_free_transfer(tran);
+    libusby_close(handle);
+    libusby_exit(ctx);
+    return 0;
+}
+
+int bench_spin(void)
+{
+    static int const spins[] = { 0, 20, 100 };
+    int i;
+
+    mock_usbfs_set_delay_us(10);
+    for (i = 0; i < 3; ++i)
+    {
+        double latency_us;
+        TEST_CHECK(spin_measure(spins[i], &latency_us) == 0);
+        printf("spin: %d us spin, %.2f us per round trip\n", spins[i], latency_us);
+    }
+
+    return 0;
+}
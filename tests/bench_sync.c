@@ -0,0 +1,57 @@
+#include "tests.h"
+
+/* Compares the latency of a synchronous bulk transfer issued through
+ * USBDEVFS_BULK, taken when it has a timeout, with the same transfer
+ * submitted as a URB and waited for, taken when it has none. URBs
+ * complete during the submit ioctl, so only the library's path differs.
+ * The mock serves USBDEVFS_BULK without entering the kernel, so against
+ * a device the synchronous path costs one more system call than shown. */
+
+#define SYNC_TRANSFERS 20000
+
+static int sync_measure(libusby_transfer * tran, libusby_timeout_t timeout, double * latency_us)
+{
+    uint64_t start;
+    int i;
+
+    tran->timeout = timeout;
+    start = test_now_us();
+    for (i = 0; i < SYNC_TRANSFERS; ++i)
+    {
+        TEST_CHECK(libusby_perform_transfer(tran) == LIBUSBY_SUCCESS);
+        TEST_CHECK(tran->status == LIBUSBY_TRANSFER_COMPLETED);
+    }
+    *latency_us = (double)(test_now_us() - start) / SYNC_TRANSFERS;
+    return 0;
+}
+
+int bench_sync(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    libusby_transfer * tran;
+    mock_usbfs_counters counters;
+    uint8_t buf[64];
+    double sync_us, async_us;
+
+    TEST_CHECK(ctx != 0);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+    tran = libusby_alloc_transfer(ctx, 0);
+    TEST_CHECK(tran != 0);
+    libusby_fill_bulk_transfer(tran, handle, 0x81, buf, sizeof buf, 0, 0, 0);
+
+    TEST_CHECK(sync_measure(tran, 1000, &sync_us) == 0);
+    TEST_CHECK(sync_measure(tran, 0, &async_us) == 0);
+
+    mock_usbfs_get_counters(&counters);
+    TEST_CHECK(counters.sync_bulk == SYNC_TRANSFERS);
+    TEST_CHECK(counters.submits == SYNC_TRANSFERS);
+
+    libusby_free_transfer(tran);
+    libusby_close(handle);
+    libusby_exit(ctx);
+
+    printf("sync: USBDEVFS_BULK %.2f us, URB %.2f us per transfer\n", sync_us, async_us);
+    return 0;
+}
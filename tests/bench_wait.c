@@ -0,0 +1,79 @@
+#include "tests.h"
+#include <pthread.h>
+
+/* Threads share a device, each submitting a transfer and waiting for it
+ * in a loop. One of them runs the event loop at a time, the others sleep
+ * on their transfer until it completes or the loop is handed to them,
+ * so the time is dominated by how waiters are put to sleep and woken. */
+
+#define WAIT_THREADS 8
+#define WAIT_TRANSFERS 40000
+
+typedef struct wait_worker
+{
+    pthread_t thread;
+    libusby_context * ctx;
+    libusby_device_handle * handle;
+    int failed;
+} wait_worker;
+
+static void * wait_thread(void * param)
+{
+    wait_worker * worker = param;
+    libusby_transfer * tran = libusby_alloc_transfer(worker->ctx, 0);
+    uint8_t buf[64];
+    int i;
+
+    if (!tran)
+    {
+        worker->failed = 1;
+        return 0;
+    }
+
+    libusby_fill_bulk_transfer(tran, worker->handle, 0x81, buf, sizeof buf, 0, 0, 0);
+    for (i = 0; i < WAIT_TRANSFERS / WAIT_THREADS && !worker->failed; ++i)
+    {
+        if (libusby_submit_transfer(tran) < 0 || libusby_wait_for_transfer(tran) < 0
+                || tran->status != LIBUSBY_TRANSFER_COMPLETED)
+        {
+            worker->failed = 1;
+        }
+    }
+
+    libusby_free_transfer(tran);
+    return 0;
+}
+
+int bench_wait(void)
+{
+    wait_worker workers[WAIT_THREADS];
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    uint64_t start, elapsed;
+    int i;
+
+    TEST_CHECK(ctx != 0);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+
+    mock_usbfs_set_delay_us(20);
+    start = test_now_us();
+    for (i = 0; i < WAIT_THREADS; ++i)
+    {
+        workers[i].ctx = ctx;
+        workers[i].handle = handle;
+        workers[i].failed = 0;
+        TEST_CHECK(pthread_create(&workers[i].thread, 0, &wait_thread, &workers[i]) == 0);
+    }
+    for (i = 0; i < WAIT_THREADS; ++i)
+        pthread_join(workers[i].thread, 0);
+    elapsed = test_now_us() - start;
+
+    for (i = 0; i < WAIT_THREADS; ++i)
+        TEST_CHECK(!workers[i].failed);
+    libusby_close(handle);
+    libusby_exit(ctx);
+
+    printf("wait: %d threads, %d transfers in %.3f s\n", WAIT_THREADS, WAIT_TRANSFERS, elapsed / 1e6);
+    return 0;
+}
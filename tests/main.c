@@ -0,0 +1,156 @@
+#include "tests.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Runs every test against the mock usbfs, once for each event engine,
+ * or with "bench" as the first argument every benchmark instead.
+ * Further arguments select tests or benchmarks by name. */
+
+typedef struct test_entry
+{
+    char const * name;
+    int (* fn)(void);
+} test_entry;
+
+static test_entry const tests[] = {
+    { "transfer_roundtrip", &test_transfer_roundtrip },
+    { "split_submit_error", &test_split_submit_error },
+    { "close_from_callback", &test_close_from_callback },
+    { "cancel_endpoint", &test_cancel_endpoint },
+    { "handle_shard_move", &test_handle_shard_move },
+    { "fake_clock_timeout", &test_fake_clock_timeout },
+    { "dev_mem_after_close", &test_dev_mem_after_close },
+    { "stream_read", &test_stream_read },
+    { "writer_idle_flush", &test_writer_idle_flush },
+    { "sync_bulk_drain", &test_sync_bulk_drain },
+    { "control_no_alloc", &test_control_no_alloc },
+    { "control_errors", &test_control_errors },
+    { "event_thread_lock_memory", &test_event_thread_lock_memory },
+    { "queue_resubmit", &test_queue_resubmit },
+    { "hotplug_enumerate_race", &test_hotplug_enumerate_race },
+    { "hotplug_replaced_device", &test_hotplug_replaced_device },
+    { "device_list_replaced", &test_device_list_replaced },
+    { 0, 0 }
+};
+
+static test_entry const benches[] = {
+    { "contention", &bench_contention },
+    { "engines", &bench_engines },
+    { "sync", &bench_sync },
+    { "wait", &bench_wait },
+    { "spin", &bench_spin },
+    { "resubmit", &bench_resubmit },
+    { 0, 0 }
+};
+
+libusby_event_engine test_engine = LIBUSBY_EVENT_ENGINE_DEFAULT;
+
+libusby_context * test_init(void)
+{
+    libusby_context * ctx;
+
+    if (libusby_init(&ctx) < 0)
+        return 0;
+
+    if (libusby_set_option(ctx, LIBUSBY_OPTION_EVENT_ENGINE, test_engine) < 0)
+    {
+        libusby_exit(ctx);
+        return 0;
+    }
+    return ctx;
+}
+
+libusby_device_handle * test_open(libusby_context * ctx, int devno)
+{
+    if (mock_usbfs_add_device(1, devno, 0x1234, devno) < 0)
+        return 0;
+    return libusby_open_device_with_vid_pid(ctx, 0x1234, devno);
+}
+
+uint64_t test_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int test_selected(int argc, char ** argv, int first, char const * name)
+{
+    int i;
+
+    if (first >= argc)
+        return 1;
+    for (i = first; i < argc; ++i)
+    {
+        if (strcmp(argv[i], name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int test_engine_supported(libusby_event_engine engine)
+{
+    libusby_context * ctx;
+    int r;
+
+    if (libusby_init(&ctx) < 0)
+        return 0;
+    r = libusby_set_option(ctx, LIBUSBY_OPTION_EVENT_ENGINE, engine);
+    libusby_exit(ctx);
+    return r >= 0;
+}
+
+int main(int argc, char ** argv)
+{
+    static libusby_event_engine const engines[] = { LIBUSBY_EVENT_ENGINE_EPOLL, LIBUSBY_EVENT_ENGINE_IO_URING };
+    static char const * const engine_names[] = { "epoll", "io_uring" };
+    int bench = argc > 1 && strcmp(argv[1], "bench") == 0;
+    int first = bench? 2: 1;
+    int failed = 0;
+    int e;
+    int i;
+
+    mock_usbfs_init();
+
+    if (bench)
+    {
+        for (i = 0; benches[i].name; ++i)
+        {
+            if (!test_selected(argc, argv, first, benches[i].name))
+                continue;
+            mock_usbfs_reset();
+            if (benches[i].fn() != 0)
+            {
+                printf("FAIL %s\n", benches[i].name);
+                ++failed;
+            }
+        }
+    }
+
+    for (e = 0; !bench && e < 2; ++e)
+    {
+        if (!test_engine_supported(engines[e]))
+        {
+            printf("SKIP %s, the engine is not supported\n", engine_names[e]);
+            continue;
+        }
+
+        test_engine = engines[e];
+        for (i = 0; tests[i].name; ++i)
+        {
+            int r;
+
+            if (!test_selected(argc, argv, first, tests[i].name))
+                continue;
+            mock_usbfs_reset();
+            r = tests[i].fn();
+            printf("%s %s (%s)\n", r == 0? "PASS": "FAIL", tests[i].name, engine_names[e]);
+            if (r != 0)
+                ++failed;
+        }
+    }
+
+    mock_usbfs_cleanup();
+    return failed? 1: 0;
+}
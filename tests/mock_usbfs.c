@@ -0,0 +1,709 @@
+#define _GNU_SOURCE
+#include "mock_usbfs.h"
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/usbdevice_fs.h>
+
+#define MOCK_MAX_FDS 4096
+#define MOCK_DEFAULT_CAPS 0x27
+
+typedef struct mock_urb
+{
+    struct usbdevfs_urb * urb;
+    uint64_t due_ns;
+    struct mock_urb * next;
+} mock_urb;
+
+/* The state of an fd standing in for an opened usbfs device. */
+typedef struct mock_handle
+{
+    int busno;
+    int devno;
+    int disconnected;
+    mock_urb * pending_first;
+    mock_urb * pending_last;
+    mock_urb * done_first;
+    mock_urb * done_last;
+} mock_handle;
+
+static pthread_mutex_t mock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mock_cond;
+static pthread_t mock_completer;
+static int mock_stopping;
+static char mock_root[64];
+
+/* Indexed by fd. Descriptor fds map to the device's (busno << 8 | devno) + 1. */
+static mock_handle * mock_handles[MOCK_MAX_FDS];
+static int mock_desc_fds[MOCK_MAX_FDS];
+static int mock_fd_end;
+
+static int mock_delay_us;
+static uint32_t mock_caps = MOCK_DEFAULT_CAPS;
+static int mock_submits_left = -1;
+static int mock_submit_error;
+static int mock_sync_error;
+static int mock_mlock_error;
+static mock_usbfs_counters mock_counters;
+static void (* mock_scan_hook)(void *);
+static void * mock_scan_hook_arg;
+
+static uint64_t mock_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int mock_real_open(char const * path, int flags, mode_t mode)
+{
+    return syscall(SYS_openat, AT_FDCWD, path, flags, mode);
+}
+
+/* The pipe is full while nothing is left to reap, so that it polls writable
+ * exactly when the kernel's usbfs fd would. */
+static void mock_fill(int fd)
+{
+    char buf[4096];
+    memset(buf, 0, sizeof buf);
+    while (write(fd, buf, sizeof buf) > 0)
+    {
+    }
+}
+
+static void mock_drain(int fd)
+{
+    char buf[4096];
+    while (read(fd, buf, sizeof buf) > 0)
+    {
+    }
+}
+
+static void mock_complete(int fd, mock_urb * entry, int status)
+{
+    mock_handle * h = mock_handles[fd];
+    struct usbdevfs_urb * urb = entry->urb;
+    int i;
+
+    urb->status = status;
+    urb->actual_length = status == 0? urb->buffer_length: 0;
+    if (status == 0 && urb->type == USBDEVFS_URB_TYPE_CONTROL)
+        urb->actual_length -= 8;
+    if (urb->type == USBDEVFS_URB_TYPE_ISO)
+    {
+        for (i = 0; i < urb->number_of_packets; ++i)
+        {
+            urb->iso_frame_desc[i].actual_length = status == 0? urb->iso_frame_desc[i].length: 0;
+            urb->iso_frame_desc[i].status = status;
+        }
+    }
+
+    entry->next = 0;
+    if (h->done_last)
+        h->done_last->next = entry;
+    else
+        h->done_first = entry;
+    h->done_last = entry;
+    mock_drain(fd);
+}
+
+/* Unlinks the entry of `urb` from the pending list. */
+static mock_urb * mock_take_pending(mock_handle * h, struct usbdevfs_urb * urb)
+{
+    mock_urb * prev = 0;
+    mock_urb * entry;
+
+    for (entry = h->pending_first; entry; prev = entry, entry = entry->next)
+    {
+        if (urb && entry->urb != urb)
+            continue;
+
+        if (prev)
+            prev->next = entry->next;
+        else
+            h->pending_first = entry->next;
+        if (h->pending_last == entry)
+            h->pending_last = prev;
+        return entry;
+    }
+    return 0;
+}
+
+static void * mock_completer_thread(void * param)
+{
+    (void)param;
+
+    pthread_mutex_lock(&mock_mutex);
+    while (!mock_stopping)
+    {
+        uint64_t now = mock_now_ns();
+        uint64_t next_due = 0;
+        int fd;
+
+        for (fd = 0; fd < mock_fd_end; ++fd)
+        {
+            mock_handle * h = mock_handles[fd];
+            while (h && h->pending_first && h->pending_first->due_ns <= now)
+                mock_complete(fd, mock_take_pending(h, 0), 0);
+            if (h && h->pending_first && (!next_due || h->pending_first->due_ns < next_due))
+                next_due = h->pending_first->due_ns;
+        }
+
+        if (next_due)
+        {
+            struct timespec ts;
+            ts.tv_sec = next_due / 1000000000;
+            ts.tv_nsec = next_due % 1000000000;
+            pthread_cond_timedwait(&mock_cond, &mock_mutex, &ts);
+        }
+        else
+        {
+            pthread_cond_wait(&mock_cond, &mock_mutex);
+        }
+    }
+    pthread_mutex_unlock(&mock_mutex);
+    return 0;
+}
+
+static int mock_new_handle(int desc_fd)
+{
+    char path[32];
+    int pipefd[2];
+    int fd;
+    int key = mock_desc_fds[desc_fd] - 1;
+
+    if (pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) < 0)
+        return -1;
+
+    /* Reopening the pipe read-write yields a single fd for both of its ends. */
+    sprintf(path, "/proc/self/fd/%d", pipefd[1]);
+    fd = mock_real_open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC, 0);
+    syscall(SYS_close, pipefd[0]);
+    syscall(SYS_close, pipefd[1]);
+    if (fd < 0 || fd >= MOCK_MAX_FDS)
+        return -1;
+
+    mock_fill(fd);
+    mock_handles[fd] = calloc(1, sizeof(mock_handle));
+    mock_handles[fd]->busno = key >> 8;
+    mock_handles[fd]->devno = key & 0xff;
+    if (fd >= mock_fd_end)
+        mock_fd_end = fd + 1;
+    return fd;
+}
+
+static int mock_open(char const * path, int flags, mode_t mode)
+{
+    char buf[PATH_MAX];
+    int busno, devno;
+    int fd;
+
+    if (mock_root[0] && strncmp(path, "/dev/bus/usb", 12) == 0)
+    {
+        snprintf(buf, sizeof buf, "%s%s", mock_root, path + 12);
+        fd = mock_real_open(buf, flags, mode);
+        if (fd >= 0 && fd < MOCK_MAX_FDS && sscanf(path, "/dev/bus/usb/%d/%d", &busno, &devno) == 2)
+        {
+            pthread_mutex_lock(&mock_mutex);
+            mock_desc_fds[fd] = (busno << 8 | devno) + 1;
+            pthread_mutex_unlock(&mock_mutex);
+        }
+        return fd;
+    }
+
+    if (sscanf(path, "/proc/self/fd/%d", &fd) == 1 && fd >= 0 && fd < MOCK_MAX_FDS)
+    {
+        pthread_mutex_lock(&mock_mutex);
+        if (mock_desc_fds[fd])
+            fd = mock_new_handle(fd);
+        else
+            fd = -2;
+        pthread_mutex_unlock(&mock_mutex);
+        if (fd != -2)
+            return fd;
+    }
+
+    return mock_real_open(path, flags, mode);
+}
+
+int open(char const * path, int flags, ...)
+{
+    mode_t mode = 0;
+
+    if (flags & (O_CREAT | O_TMPFILE))
+    {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return mock_open(path, flags, mode);
+}
+
+int open64(char const * path, int flags, ...)
+{
+    mode_t mode = 0;
+
+    if (flags & (O_CREAT | O_TMPFILE))
+    {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return mock_open(path, flags, mode);
+}
+
+DIR * opendir(char const * path)
+{
+    static DIR * (* real_opendir)(char const *);
+    char buf[PATH_MAX];
+
+    if (!real_opendir)
+        real_opendir = (DIR * (*)(char const *))dlsym(RTLD_NEXT, "opendir");
+
+    if (mock_root[0] && strncmp(path, "/dev/bus/usb", 12) == 0)
+    {
+        void (* hook)(void *) = 0;
+        void * hook_arg = 0;
+
+        if (path[12] == 0)
+        {
+            pthread_mutex_lock(&mock_mutex);
+            hook = mock_scan_hook;
+            hook_arg = mock_scan_hook_arg;
+            mock_scan_hook = 0;
+            pthread_mutex_unlock(&mock_mutex);
+        }
+        if (hook)
+            hook(hook_arg);
+
+        snprintf(buf, sizeof buf, "%s%s", mock_root, path + 12);
+        return real_opendir(buf);
+    }
+    return real_opendir(path);
+}
+
+static int mock_stat(char const * path, struct stat * st)
+{
+    char buf[PATH_MAX];
+
+    if (mock_root[0] && strncmp(path, "/dev/bus/usb", 12) == 0)
+    {
+        snprintf(buf, sizeof buf, "%s%s", mock_root, path + 12);
+        path = buf;
+    }
+    return fstatat(AT_FDCWD, path, st, 0);
+}
+
+int stat(char const * path, struct stat * st)
+{
+    return mock_stat(path, st);
+}
+
+int stat64(char const * path, struct stat64 * st)
+{
+    return mock_stat(path, (struct stat *)st);
+}
+
+int close(int fd)
+{
+    if (fd >= 0 && fd < MOCK_MAX_FDS)
+    {
+        mock_handle * h;
+
+        pthread_mutex_lock(&mock_mutex);
+        mock_desc_fds[fd] = 0;
+        h = mock_handles[fd];
+        mock_handles[fd] = 0;
+        pthread_mutex_unlock(&mock_mutex);
+
+        /* Like usbfs, closing the fd throws away whatever is still in flight. */
+        if (h)
+        {
+            while (h->pending_first)
+                free(mock_take_pending(h, 0));
+            while (h->done_first)
+            {
+                mock_urb * entry = h->done_first;
+                h->done_first = entry->next;
+                free(entry);
+            }
+            free(h);
+        }
+    }
+    return syscall(SYS_close, fd);
+}
+
+void * mmap(void * addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    if (fd >= 0 && fd < MOCK_MAX_FDS && mock_handles[fd])
+    {
+        __atomic_add_fetch(&mock_counters.mmaps, 1, __ATOMIC_SEQ_CST);
+        return (void *)syscall(SYS_mmap, addr, length, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    return (void *)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+}
+
+int mlockall(int flags)
+{
+    int err = __atomic_load_n(&mock_mlock_error, __ATOMIC_SEQ_CST);
+
+    if (err)
+    {
+        errno = err;
+        return -1;
+    }
+    return (int)syscall(SYS_mlockall, flags);
+}
+
+/* Only counted, for benchmarks that measure how often timers are rearmed. */
+int timerfd_settime(int fd, int flags, struct itimerspec const * new_value, struct itimerspec * old_value)
+{
+    __atomic_add_fetch(&mock_counters.timer_rearms, 1, __ATOMIC_SEQ_CST);
+    return (int)syscall(SYS_timerfd_settime, fd, flags, new_value, old_value);
+}
+
+/* Blocks a synchronous transfer like the kernel would, returns -ETIMEDOUT if
+ * the transfer outlasts its timeout. */
+static int mock_sync_wait(unsigned timeout_ms)
+{
+    int delay_us = __atomic_load_n(&mock_delay_us, __ATOMIC_SEQ_CST);
+    int err = __atomic_load_n(&mock_sync_error, __ATOMIC_SEQ_CST);
+
+    if (delay_us < 0 || (timeout_ms && (unsigned)delay_us > timeout_ms * 1000))
+    {
+        usleep(timeout_ms? timeout_ms * 1000: 1000000);
+        return -ETIMEDOUT;
+    }
+
+    if (delay_us)
+        usleep(delay_us);
+    return err? -err: 0;
+}
+
+static int mock_ioctl(int fd, unsigned long request, void * arg)
+{
+    mock_handle * h = mock_handles[fd];
+    mock_urb * entry;
+    int r;
+
+    switch (request)
+    {
+    case USBDEVFS_GET_CAPABILITIES:
+        *(uint32_t *)arg = mock_caps;
+        return 0;
+
+    case USBDEVFS_SUBMITURB:
+        if (h->disconnected)
+            return -ENODEV;
+        if (mock_submits_left == 0)
+            return -mock_submit_error;
+        if (mock_submits_left > 0)
+            --mock_submits_left;
+
+        entry = malloc(sizeof *entry);
+        if (!entry)
+            return -ENOMEM;
+        ++mock_counters.submits;
+        entry->urb = arg;
+        entry->next = 0;
+
+        if (mock_delay_us == 0)
+        {
+            mock_complete(fd, entry, 0);
+            return 0;
+        }
+
+        entry->due_ns = mock_delay_us < 0? UINT64_MAX: mock_now_ns() + (uint64_t)mock_delay_us * 1000;
+        if (h->pending_last)
+            h->pending_last->next = entry;
+        else
+            h->pending_first = entry;
+        h->pending_last = entry;
+        pthread_cond_signal(&mock_cond);
+        return 0;
+
+    case USBDEVFS_DISCARDURB:
+        ++mock_counters.discards;
+        entry = mock_take_pending(h, arg);
+        if (!entry)
+            return -EINVAL;
+        mock_complete(fd, entry, -ENOENT);
+        return 0;
+
+    case USBDEVFS_REAPURBNDELAY:
+        entry = h->done_first;
+        if (!entry)
+        {
+            if (h->disconnected)
+                return -ENODEV;
+            mock_fill(fd);
+            return -EAGAIN;
+        }
+
+        ++mock_counters.reaps;
+        h->done_first = entry->next;
+        if (!h->done_first)
+            h->done_last = 0;
+        *(struct usbdevfs_urb **)arg = entry->urb;
+        free(entry);
+        return 0;
+
+    case USBDEVFS_BULK:
+        ++mock_counters.sync_bulk;
+        pthread_mutex_unlock(&mock_mutex);
+        r = mock_sync_wait(((struct usbdevfs_bulktransfer *)arg)->timeout);
+        pthread_mutex_lock(&mock_mutex);
+        return r < 0? r: (int)((struct usbdevfs_bulktransfer *)arg)->len;
+
+    case USBDEVFS_CONTROL:
+    {
+        struct usbdevfs_ctrltransfer * ctrl = arg;
+
+        ++mock_counters.sync_control;
+        pthread_mutex_unlock(&mock_mutex);
+        r = mock_sync_wait(ctrl->timeout);
+        pthread_mutex_lock(&mock_mutex);
+        if (r < 0)
+            return r;
+
+        /* GET_CONFIGURATION reports the only configuration. */
+        if (ctrl->bRequestType == 0x80 && ctrl->bRequest == 0x08 && ctrl->wLength >= 1)
+            *(uint8_t *)ctrl->data = 1;
+        return ctrl->wLength;
+    }
+
+    default:
+        return h->disconnected? -ENODEV: 0;
+    }
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    va_list ap;
+    void * arg;
+    int r;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if (fd < 0 || fd >= MOCK_MAX_FDS)
+        return syscall(SYS_ioctl, fd, request, arg);
+
+    pthread_mutex_lock(&mock_mutex);
+    if (!mock_handles[fd])
+    {
+        pthread_mutex_unlock(&mock_mutex);
+        return syscall(SYS_ioctl, fd, request, arg);
+    }
+
+    r = mock_ioctl(fd, request, arg);
+    pthread_mutex_unlock(&mock_mutex);
+
+    if (r < 0)
+    {
+        errno = -r;
+        return -1;
+    }
+    return r;
+}
+
+void mock_usbfs_init(void)
+{
+    pthread_condattr_t attr;
+
+    strcpy(mock_root, "/tmp/libusby-mock-XXXXXX");
+    if (!mkdtemp(mock_root))
+    {
+        perror("mkdtemp");
+        exit(2);
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mock_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_create(&mock_completer, 0, &mock_completer_thread, 0);
+}
+
+void mock_usbfs_cleanup(void)
+{
+    pthread_mutex_lock(&mock_mutex);
+    mock_stopping = 1;
+    pthread_cond_signal(&mock_cond);
+    pthread_mutex_unlock(&mock_mutex);
+    pthread_join(mock_completer, 0);
+
+    mock_usbfs_reset();
+    rmdir(mock_root);
+}
+
+static void mock_node_path(char * buf, size_t size, int busno, int devno)
+{
+    if (devno)
+        snprintf(buf, size, "%s/%03d/%03d", mock_root, busno, devno);
+    else
+        snprintf(buf, size, "%s/%03d", mock_root, busno);
+}
+
+void mock_usbfs_reset(void)
+{
+    DIR * dir;
+    struct dirent * ent;
+    int busno;
+
+    for (busno = 1; busno < 256; ++busno)
+    {
+        char path[PATH_MAX];
+
+        mock_node_path(path, sizeof path, busno, 0);
+        dir = opendir(path);
+        if (!dir)
+            continue;
+        while ((ent = readdir(dir)) != 0)
+        {
+            if (ent->d_name[0] != '.')
+                mock_usbfs_remove_device(busno, atoi(ent->d_name));
+        }
+        closedir(dir);
+        rmdir(path);
+    }
+
+    pthread_mutex_lock(&mock_mutex);
+    mock_delay_us = 0;
+    mock_caps = MOCK_DEFAULT_CAPS;
+    mock_submits_left = -1;
+    mock_submit_error = 0;
+    mock_sync_error = 0;
+    mock_mlock_error = 0;
+    mock_scan_hook = 0;
+    memset(&mock_counters, 0, sizeof mock_counters);
+    pthread_mutex_unlock(&mock_mutex);
+}
+
+int mock_usbfs_add_device(int busno, int devno, uint16_t vendor_id, uint16_t product_id)
+{
+    static uint8_t const config[39] = {
+        9, 2, 39, 0, 1, 1, 0, 0x80, 50,
+        9, 4, 0, 0, 3, 0xff, 0, 0, 0,
+        7, 5, 0x81, 2, 0x00, 0x02, 0,
+        7, 5, 0x02, 2, 0x00, 0x02, 0,
+        7, 5, 0x83, 3, 64, 0, 1,
+    };
+    uint8_t desc[18 + sizeof config];
+    char path[PATH_MAX];
+    int fd;
+    int ok;
+
+    memset(desc, 0, 18);
+    desc[0] = 18;
+    desc[1] = 1;
+    desc[2] = 0x00;
+    desc[3] = 0x02;
+    desc[7] = 64;
+    desc[8] = vendor_id & 0xff;
+    desc[9] = vendor_id >> 8;
+    desc[10] = product_id & 0xff;
+    desc[11] = product_id >> 8;
+    desc[13] = 0x01;
+    desc[17] = 1;
+    memcpy(desc + 18, config, sizeof config);
+
+    mock_node_path(path, sizeof path, busno, 0);
+    mkdir(path, 0755);
+    mock_node_path(path, sizeof path, busno, devno);
+    fd = mock_real_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    ok = write(fd, desc, sizeof desc) == (int)sizeof desc;
+    syscall(SYS_close, fd);
+    return ok? 0: -1;
+}
+
+void mock_usbfs_remove_device(int busno, int devno)
+{
+    char path[PATH_MAX];
+
+    mock_node_path(path, sizeof path, busno, devno);
+    unlink(path);
+}
+
+void mock_usbfs_disconnect(int busno, int devno)
+{
+    int fd;
+
+    pthread_mutex_lock(&mock_mutex);
+    for (fd = 0; fd < mock_fd_end; ++fd)
+    {
+        mock_handle * h = mock_handles[fd];
+        if (h && h->busno == busno && h->devno == devno)
+        {
+            h->disconnected = 1;
+            mock_drain(fd);
+        }
+    }
+    pthread_mutex_unlock(&mock_mutex);
+}
+
+void mock_usbfs_set_scan_hook(void (* hook)(void *), void * arg)
+{
+    pthread_mutex_lock(&mock_mutex);
+    mock_scan_hook = hook;
+    mock_scan_hook_arg = arg;
+    pthread_mutex_unlock(&mock_mutex);
+}
+
+void mock_usbfs_set_delay_us(int delay_us)
+{
+    pthread_mutex_lock(&mock_mutex);
+    mock_delay_us = delay_us;
+    pthread_mutex_unlock(&mock_mutex);
+}
+
+void mock_usbfs_set_caps(uint32_t caps)
+{
+    pthread_mutex_lock(&mock_mutex);
+    mock_caps = caps;
+    pthread_mutex_unlock(&mock_mutex);
+}
+
+void mock_usbfs_fail_submits(int count, int err)
+{
+    pthread_mutex_lock(&mock_mutex);
+    mock_submits_left = count;
+    mock_submit_error = err;
+    pthread_mutex_unlock(&mock_mutex);
+}
+
+void mock_usbfs_set_sync_error(int err)
+{
+    __atomic_store_n(&mock_sync_error, err, __ATOMIC_SEQ_CST);
+}
+
+void mock_usbfs_set_mlock_error(int err)
+{
+    __atomic_store_n(&mock_mlock_error, err, __ATOMIC_SEQ_CST);
+}
+
+void mock_usbfs_get_counters(mock_usbfs_counters * counters)
+{
+    pthread_mutex_lock(&mock_mutex);
+    *counters = mock_counters;
+    pthread_mutex_unlock(&mock_mutex);
+}
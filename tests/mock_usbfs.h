@@ -0,0 +1,65 @@
+#ifndef LIBUSBY_TESTS_MOCK_USBFS_H
+#define LIBUSBY_TESTS_MOCK_USBFS_H
+
+#include <stdint.h>
+
+/* A fake usbfs the Linux backend runs against without hardware. The test
+ * executable interposes the libc calls the backend makes: paths under
+ * /dev/bus/usb are redirected to a temporary directory of descriptor files,
+ * and opening a device for I/O yields a pipe standing in for the usbfs fd.
+ * The pipe is kept full, and drained to make the fd writable, whenever
+ * it has completed URBs to be reaped. */
+
+void mock_usbfs_init(void);
+void mock_usbfs_cleanup(void);
+
+/* Removes every device and restores the default behaviour. */
+void mock_usbfs_reset(void);
+
+/* Creates the node of a device with one configuration, whose value is 1,
+ * holding one interface with a bulk IN endpoint 0x81, a bulk OUT endpoint
+ * 0x02, both with 512 byte packets, and an interrupt IN endpoint 0x83. */
+int mock_usbfs_add_device(int busno, int devno, uint16_t vendor_id, uint16_t product_id);
+void mock_usbfs_remove_device(int busno, int devno);
+
+/* Makes the open fds of the device fail with ENODEV, like usbfs does
+ * once a device is unplugged. */
+void mock_usbfs_disconnect(int busno, int devno);
+
+/* Calls `hook` once, the next time /dev/bus/usb itself is opened, so that
+ * a test can act while the backend scans for devices. */
+void mock_usbfs_set_scan_hook(void (* hook)(void *), void * arg);
+
+/* The time URBs take to complete. Zero completes them during the submit
+ * ioctl itself, a negative value leaves them pending until discarded.
+ * Synchronous transfers block for as long, or until their timeout. */
+void mock_usbfs_set_delay_us(int delay_us);
+
+/* The capabilities reported by USBDEVFS_GET_CAPABILITIES. */
+void mock_usbfs_set_caps(uint32_t caps);
+
+/* Fails every submission with `err` after the next `count` succeed. */
+void mock_usbfs_fail_submits(int count, int err);
+
+/* Fails the synchronous USBDEVFS_BULK and USBDEVFS_CONTROL ioctls with `err`,
+ * or lets them succeed again if zero. */
+void mock_usbfs_set_sync_error(int err);
+
+/* Fails `mlockall` with `err`, like it does without the privilege to lock
+ * memory, or lets it lock memory again if zero. */
+void mock_usbfs_set_mlock_error(int err);
+
+typedef struct mock_usbfs_counters
+{
+    long submits;
+    long discards;
+    long reaps;
+    long sync_bulk;
+    long sync_control;
+    long mmaps;
+    long timer_rearms;
+} mock_usbfs_counters;
+
+void mock_usbfs_get_counters(mock_usbfs_counters * counters);
+
+#endif
@@ -0,0 +1,75 @@
+#include "tests.h"
+
+static uint64_t clock_now;
+
+static uint64_t clock_fake(void * user_data)
+{
+    (void)user_data;
+    return __atomic_load_n(&clock_now, __ATOMIC_SEQ_CST);
+}
+
+/* Timeouts measured against an injected clock expire as soon as the clock
+ * is advanced past them, and not because real time passes. */
+int test_fake_clock_timeout(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    libusby_device_handle * closed;
+    libusby_transfer * short_tran;
+    libusby_transfer * long_tran;
+    libusby_transfer * orphan;
+    uint8_t buf[3][64];
+    uint64_t start = test_now_us();
+
+    TEST_CHECK(ctx != 0);
+    handle = test_open(ctx, 1);
+    closed = test_open(ctx, 2);
+    TEST_CHECK(handle != 0 && closed != 0);
+
+    clock_now = 1000;
+    TEST_CHECK(libusby_set_clock(ctx, &clock_fake, 0) == LIBUSBY_SUCCESS);
+    mock_usbfs_set_delay_us(-1);
+
+    short_tran = libusby_alloc_transfer(ctx, 0);
+    long_tran = libusby_alloc_transfer(ctx, 0);
+    TEST_CHECK(short_tran != 0 && long_tran != 0);
+    libusby_fill_bulk_transfer(short_tran, handle, 0x81, buf[0], sizeof buf[0], 0, 0, 50);
+    libusby_fill_bulk_transfer(long_tran, handle, 0x81, buf[1], sizeof buf[1], 0, 0, 1);
+    TEST_CHECK(libusby_submit_transfer(short_tran) == LIBUSBY_SUCCESS);
+
+    /* The clock cannot be replaced under a pending deadline. */
+    TEST_CHECK(libusby_set_clock(ctx, 0, 0) == LIBUSBY_ERROR_BUSY);
+
+    /* A handle closed with a timed transfer in flight leaves no timer behind. */
+    orphan = libusby_alloc_transfer(ctx, 200);
+    TEST_CHECK(orphan != 0);
+    libusby_fill_bulk_transfer(orphan, closed, 0x81, buf[2], sizeof buf[2], 0, 0, 10);
+    TEST_CHECK(libusby_submit_transfer(orphan) == LIBUSBY_SUCCESS);
+    libusby_close(closed);
+    libusby_free_transfer(orphan);
+
+    __atomic_store_n(&clock_now, 1049, __ATOMIC_SEQ_CST);
+    TEST_CHECK(libusby_clock_advanced(ctx) == LIBUSBY_SUCCESS);
+    long_tran->timeout = 1000;
+    TEST_CHECK(libusby_submit_transfer(long_tran) == LIBUSBY_SUCCESS);
+
+    __atomic_store_n(&clock_now, 1050, __ATOMIC_SEQ_CST);
+    TEST_CHECK(libusby_clock_advanced(ctx) == LIBUSBY_SUCCESS);
+    TEST_CHECK(libusby_wait_for_transfer(short_tran) == LIBUSBY_SUCCESS);
+    TEST_CHECK(short_tran->status == LIBUSBY_TRANSFER_TIMED_OUT);
+
+    /* The later deadline has not passed, so the transfer is merely cancelled. */
+    TEST_CHECK(libusby_cancel_transfer(long_tran) == LIBUSBY_SUCCESS);
+    TEST_CHECK(libusby_wait_for_transfer(long_tran) == LIBUSBY_SUCCESS);
+    TEST_CHECK(long_tran->status == LIBUSBY_TRANSFER_CANCELLED);
+
+    /* Far less real time has passed than the timeouts amount to. */
+    TEST_CHECK(test_now_us() - start < 1000000);
+
+    libusby_free_transfer(short_tran);
+    libusby_free_transfer(long_tran);
+    TEST_CHECK(libusby_set_clock(ctx, 0, 0) == LIBUSBY_SUCCESS);
+    libusby_close(handle);
+    libusby_exit(ctx);
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "tests.h"
+#include <errno.h>
+#include <stdlib.h>
+
+/* Counts the allocations made by the thread while `control_counting` is set.
+ * AddressSanitizer brings its own allocator, which can't be wrapped this way. */
+#ifndef __SANITIZE_ADDRESS__
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t count, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+
+static __thread int control_counting;
+static __thread long control_allocations;
+
+void * malloc(size_t size)
+{
+    if (control_counting)
+        ++control_allocations;
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size)
+{
+    if (control_counting)
+        ++control_allocations;
+    return __libc_calloc(count, size);
+}
+
+void * realloc(void * ptr, size_t size)
+{
+    if (control_counting)
+        ++control_allocations;
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+/* Synchronous control transfers allocate nothing. */
+int test_control_no_alloc(void)
+{
+#ifndef __SANITIZE_ADDRESS__
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    uint8_t data[4];
+    int i;
+
+    TEST_CHECK(ctx != 0);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+
+    control_allocations = 0;
+    control_counting = 1;
+    for (i = 0; i < 20000; ++i)
+    {
+        if (libusby_control_transfer(handle, 0xc0, 0x01, 0, 0, data, sizeof data, 1000) != sizeof data)
+            break;
+    }
+    control_counting = 0;
+    TEST_CHECK(i == 20000);
+    TEST_CHECK(control_allocations == 0);
+
+    libusby_close(handle);
+    libusby_exit(ctx);
+#endif
+    return 0;
+}
+
+/* The errors of synchronous control transfers tell their cause. */
+int test_control_errors(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    uint8_t data[4];
+
+    TEST_CHECK(ctx != 0);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+
+    mock_usbfs_set_sync_error(EPIPE);
+    TEST_CHECK(libusby_control_transfer(handle, 0xc0, 0x01, 0, 0, data, sizeof data, 1000) == LIBUSBY_ERROR_PIPE);
+    mock_usbfs_set_sync_error(ENODEV);
+    TEST_CHECK(libusby_control_transfer(handle, 0xc0, 0x01, 0, 0, data, sizeof data, 1000) == LIBUSBY_ERROR_NO_DEVICE);
+    mock_usbfs_set_sync_error(EOVERFLOW);
+    TEST_CHECK(libusby_control_transfer(handle, 0xc0, 0x01, 0, 0, data, sizeof data, 1000) == LIBUSBY_ERROR_OVERFLOW);
+    mock_usbfs_set_sync_error(0);
+
+    mock_usbfs_set_delay_us(20000);
+    TEST_CHECK(libusby_control_transfer(handle, 0xc0, 0x01, 0, 0, data, sizeof data, 5) == LIBUSBY_ERROR_TIMEOUT);
+
+    libusby_close(handle);
+    libusby_exit(ctx);
+    return 0;
+}
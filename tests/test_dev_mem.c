@@ -0,0 +1,43 @@
+#include "tests.h"
+#include <string.h>
+
+/* Buffers are released the way they were allocated, and one mapped from
+ * a handle that has since been closed is not handed to free(). */
+int test_dev_mem_after_close(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * mapped;
+    libusby_device_handle * heap;
+    mock_usbfs_counters counters;
+    uint8_t * early;
+    uint8_t * late;
+    uint8_t * plain;
+
+    TEST_CHECK(ctx != 0);
+    mapped = test_open(ctx, 1);
+    TEST_CHECK(mapped != 0);
+
+    /* Without USBDEVFS_CAP_MMAP, the second handle falls back to the heap. */
+    mock_usbfs_set_caps(0x07);
+    heap = test_open(ctx, 2);
+    TEST_CHECK(heap != 0);
+
+    early = libusby_dev_mem_alloc(mapped, 4096);
+    late = libusby_dev_mem_alloc(mapped, 4096);
+    plain = libusby_dev_mem_alloc(heap, 4096);
+    TEST_CHECK(early != 0 && late != 0 && plain != 0);
+    mock_usbfs_get_counters(&counters);
+    TEST_CHECK(counters.mmaps == 2);
+    memset(early, 0x55, 4096);
+    memset(plain, 0xaa, 4096);
+
+    TEST_CHECK(libusby_dev_mem_free(mapped, early, 4096) == LIBUSBY_SUCCESS);
+    libusby_close(mapped);
+
+    TEST_CHECK(libusby_dev_mem_free(heap, late, 4096) == LIBUSBY_ERROR_NOT_FOUND);
+    TEST_CHECK(libusby_dev_mem_free(heap, plain, 4096) == LIBUSBY_SUCCESS);
+
+    libusby_close(heap);
+    libusby_exit(ctx);
+    return 0;
+}
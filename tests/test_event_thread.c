@@ -0,0 +1,82 @@
+#include "tests.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* AddressSanitizer's shadow memory is too large to be locked. */
+#ifndef __SANITIZE_ADDRESS__
+/* Returns the VmLck of the process in kB, or -1 if it can't be read. */
+static long event_thread_locked_kb(void)
+{
+    FILE * f = fopen("/proc/self/status", "r");
+    char line[128];
+    long kb = -1;
+
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof line, f))
+    {
+        if (sscanf(line, "VmLck: %ld", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb;
+}
+#endif
+
+/* A start refused as busy leaves the memory unlocked, and stopping the thread
+ * unlocks what starting it locked, but not what was locked before. Lacking the
+ * privilege, whether refused outright or over RLIMIT_MEMLOCK, fails with
+ * `LIBUSBY_ERROR_ACCESS`. */
+int test_event_thread_lock_memory(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_thread_attrs attrs;
+#ifndef __SANITIZE_ADDRESS__
+    static char page[4096] __attribute__((aligned(4096)));
+    int r;
+#endif
+
+    TEST_CHECK(ctx != 0);
+    memset(&attrs, 0, sizeof attrs);
+    attrs.lock_memory = 1;
+
+    mock_usbfs_set_mlock_error(ENOMEM);
+    TEST_CHECK(libusby_start_event_thread(ctx, &attrs) == LIBUSBY_ERROR_ACCESS);
+    mock_usbfs_set_mlock_error(EPERM);
+    TEST_CHECK(libusby_start_event_thread(ctx, &attrs) == LIBUSBY_ERROR_ACCESS);
+    mock_usbfs_set_mlock_error(0);
+
+#ifndef __SANITIZE_ADDRESS__
+    TEST_CHECK(event_thread_locked_kb() == 0);
+
+    attrs.lock_memory = 0;
+    TEST_CHECK(libusby_start_event_thread(ctx, &attrs) == LIBUSBY_SUCCESS);
+    attrs.lock_memory = 1;
+    TEST_CHECK(libusby_start_event_thread(ctx, &attrs) == LIBUSBY_ERROR_BUSY);
+    TEST_CHECK(event_thread_locked_kb() == 0);
+    libusby_stop_event_loop(ctx);
+
+    /* Locking needs a privilege the process may not have. */
+    r = libusby_start_event_thread(ctx, &attrs);
+    TEST_CHECK(r == LIBUSBY_SUCCESS || r == LIBUSBY_ERROR_ACCESS);
+    if (r == LIBUSBY_SUCCESS)
+    {
+        TEST_CHECK(event_thread_locked_kb() > 0);
+        libusby_stop_event_loop(ctx);
+    }
+    TEST_CHECK(event_thread_locked_kb() == 0);
+
+    /* A page the application locked itself stays locked. */
+    if (r == LIBUSBY_SUCCESS && mlock(page, sizeof page) == 0)
+    {
+        TEST_CHECK(libusby_start_event_thread(ctx, &attrs) == LIBUSBY_SUCCESS);
+        libusby_stop_event_loop(ctx);
+        TEST_CHECK(event_thread_locked_kb() > 0);
+        munlockall();
+    }
+#endif
+
+    libusby_exit(ctx);
+    return 0;
+}
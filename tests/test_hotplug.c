@@ -0,0 +1,220 @@
+#include "tests.h"
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HOTPLUG_MAX_EVENTS 8
+
+/* The events a callback saw, written by one thread at a time. */
+typedef struct hotplug_log
+{
+    int count;
+    int events[HOTPLUG_MAX_EVENTS];
+    int product_ids[HOTPLUG_MAX_EVENTS];
+} hotplug_log;
+
+typedef struct hotplug_race
+{
+    libusby_context * ctx;
+    int sock;
+    int listed;
+} hotplug_race;
+
+static int hotplug_record(libusby_context * ctx, libusby_device * dev, libusby_hotplug_event event, void * user_data)
+{
+    hotplug_log * log = user_data;
+    libusby_device_descriptor desc;
+    int i = log->count;
+
+    (void)ctx;
+    if (i < HOTPLUG_MAX_EVENTS && libusby_get_device_descriptor_cached(dev, &desc) == LIBUSBY_SUCCESS)
+    {
+        log->events[i] = event;
+        log->product_ids[i] = desc.idProduct;
+        __atomic_store_n(&log->count, i + 1, __ATOMIC_SEQ_CST);
+    }
+    return 0;
+}
+
+/* Sends the uevent the kernel broadcasts when a USB device is added or removed. */
+static void hotplug_send_uevent(int sock, char const * action, int busno, int devno)
+{
+    char msg[256];
+    int len;
+
+    len = sprintf(msg, "%s@/devices/usb%d/%d-%d", action, busno, busno, devno) + 1;
+    len += sprintf(msg + len, "ACTION=%s", action) + 1;
+    len += sprintf(msg + len, "SUBSYSTEM=usb") + 1;
+    len += sprintf(msg + len, "DEVTYPE=usb_device") + 1;
+    len += sprintf(msg + len, "BUSNUM=%03d", busno) + 1;
+    len += sprintf(msg + len, "DEVNUM=%03d", devno) + 1;
+    send(sock, msg, len, 0);
+}
+
+/* Whether the context lists the device with the product id, within a second. */
+static int hotplug_wait_listed(libusby_context * ctx, int product_id)
+{
+    uint64_t deadline = test_now_us() + 1000000;
+
+    do
+    {
+        libusby_device ** list;
+        int count = libusby_get_device_list(ctx, &list);
+        int found = 0;
+        int i;
+
+        for (i = 0; i < count; ++i)
+        {
+            libusby_device_descriptor desc;
+            if (libusby_get_device_descriptor_cached(list[i], &desc) == LIBUSBY_SUCCESS && desc.idProduct == product_id)
+                found = 1;
+        }
+        if (count >= 0)
+            libusby_free_device_list(list, /*unref_devices=*/1);
+        if (found)
+            return 1;
+
+        usleep(1000);
+    }
+    while (test_now_us() < deadline);
+    return 0;
+}
+
+static int hotplug_wait_count(hotplug_log * log, int count)
+{
+    uint64_t deadline = test_now_us() + 1000000;
+
+    while (__atomic_load_n(&log->count, __ATOMIC_SEQ_CST) < count && test_now_us() < deadline)
+        usleep(1000);
+    return __atomic_load_n(&log->count, __ATOMIC_SEQ_CST) >= count;
+}
+
+/* Runs while the first registration scans for the devices already present:
+ * a device arrives and the event loop handles its uevent meanwhile. */
+static void hotplug_race_hook(void * arg)
+{
+    hotplug_race * race = arg;
+
+    mock_usbfs_add_device(1, 2, 0x1234, 2);
+    hotplug_send_uevent(race->sock, "add", 1, 2);
+    race->listed = hotplug_wait_listed(race->ctx, 2);
+}
+
+/* A device that arrives while a callback is registered with `LIBUSBY_HOTPLUG_ENUMERATE`
+ * is announced to it once, by either the enumeration or its uevent. */
+int test_hotplug_enumerate_race(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_thread_attrs attrs;
+    hotplug_race race;
+    hotplug_log log;
+    int socks[2];
+
+    TEST_CHECK(ctx != 0);
+    TEST_CHECK(mock_usbfs_add_device(1, 1, 0x1234, 1) == 0);
+    TEST_CHECK(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, socks) == 0);
+    TEST_CHECK(libusby_set_option(ctx, LIBUSBY_OPTION_HOTPLUG_SOURCE_FD, socks[1]) == LIBUSBY_SUCCESS);
+
+    memset(&attrs, 0, sizeof attrs);
+    TEST_CHECK(libusby_start_event_thread(ctx, &attrs) == LIBUSBY_SUCCESS);
+
+    race.ctx = ctx;
+    race.sock = socks[0];
+    race.listed = 0;
+    mock_usbfs_set_scan_hook(&hotplug_race_hook, &race);
+
+    memset(&log, 0, sizeof log);
+    TEST_CHECK(libusby_hotplug_register_callback(ctx, LIBUSBY_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSBY_HOTPLUG_ENUMERATE,
+        LIBUSBY_HOTPLUG_MATCH_ANY, LIBUSBY_HOTPLUG_MATCH_ANY, LIBUSBY_HOTPLUG_MATCH_ANY, &hotplug_record, &log, 0) == LIBUSBY_SUCCESS);
+    TEST_CHECK(race.listed);
+
+    libusby_stop_event_loop(ctx);
+    TEST_CHECK(log.count == 2);
+    TEST_CHECK(log.events[0] == LIBUSBY_HOTPLUG_EVENT_DEVICE_ARRIVED && log.events[1] == LIBUSBY_HOTPLUG_EVENT_DEVICE_ARRIVED);
+    TEST_CHECK(log.product_ids[0] != log.product_ids[1]);
+
+    libusby_exit(ctx);
+    close(socks[0]);
+    close(socks[1]);
+    return 0;
+}
+
+/* A device whose node was replaced at the same address, with its remove uevent
+ * lost, is announced as having left before the new one arrives. */
+int test_hotplug_replaced_device(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_thread_attrs attrs;
+    hotplug_log log;
+    int socks[2];
+
+    TEST_CHECK(ctx != 0);
+    TEST_CHECK(mock_usbfs_add_device(1, 1, 0x1234, 1) == 0);
+    TEST_CHECK(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, socks) == 0);
+    TEST_CHECK(libusby_set_option(ctx, LIBUSBY_OPTION_HOTPLUG_SOURCE_FD, socks[1]) == LIBUSBY_SUCCESS);
+
+    memset(&attrs, 0, sizeof attrs);
+    TEST_CHECK(libusby_start_event_thread(ctx, &attrs) == LIBUSBY_SUCCESS);
+
+    memset(&log, 0, sizeof log);
+    TEST_CHECK(libusby_hotplug_register_callback(ctx, LIBUSBY_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSBY_HOTPLUG_EVENT_DEVICE_LEFT,
+        LIBUSBY_HOTPLUG_ENUMERATE, LIBUSBY_HOTPLUG_MATCH_ANY, LIBUSBY_HOTPLUG_MATCH_ANY, LIBUSBY_HOTPLUG_MATCH_ANY,
+        &hotplug_record, &log, 0) == LIBUSBY_SUCCESS);
+    TEST_CHECK(log.count == 1);
+
+    /* However the loop orders the replacement and the repeated uevent,
+     * each device is announced once. */
+    hotplug_send_uevent(socks[0], "add", 1, 1);
+    mock_usbfs_remove_device(1, 1);
+    TEST_CHECK(mock_usbfs_add_device(1, 1, 0x1234, 7) == 0);
+    hotplug_send_uevent(socks[0], "add", 1, 1);
+    TEST_CHECK(hotplug_wait_count(&log, 3));
+
+    libusby_stop_event_loop(ctx);
+    TEST_CHECK(log.count == 3);
+    TEST_CHECK(log.events[0] == LIBUSBY_HOTPLUG_EVENT_DEVICE_ARRIVED && log.product_ids[0] == 1);
+    TEST_CHECK(log.events[1] == LIBUSBY_HOTPLUG_EVENT_DEVICE_LEFT && log.product_ids[1] == 1);
+    TEST_CHECK(log.events[2] == LIBUSBY_HOTPLUG_EVENT_DEVICE_ARRIVED && log.product_ids[2] == 7);
+    TEST_CHECK(hotplug_wait_listed(ctx, 7));
+
+    libusby_exit(ctx);
+    close(socks[0]);
+    close(socks[1]);
+    return 0;
+}
+
+/* Without hotplug monitoring, a rescan lists a new device for a replaced node
+ * and keeps the one whose node is unchanged. */
+int test_device_list_replaced(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_descriptor desc;
+    libusby_device ** list;
+    libusby_device * old_dev;
+    libusby_device * new_dev;
+
+    TEST_CHECK(ctx != 0);
+    TEST_CHECK(mock_usbfs_add_device(1, 1, 0x1234, 1) == 0);
+    TEST_CHECK(libusby_get_device_list(ctx, &list) == 1);
+    old_dev = list[0];
+    libusby_free_device_list(list, /*unref_devices=*/0);
+
+    mock_usbfs_remove_device(1, 1);
+    TEST_CHECK(mock_usbfs_add_device(1, 1, 0x1234, 7) == 0);
+    TEST_CHECK(libusby_get_device_list(ctx, &list) == 1);
+    new_dev = list[0];
+    TEST_CHECK(new_dev != old_dev);
+    TEST_CHECK(libusby_get_device_descriptor_cached(new_dev, &desc) == LIBUSBY_SUCCESS && desc.idProduct == 7);
+    TEST_CHECK(libusby_get_device_descriptor_cached(old_dev, &desc) == LIBUSBY_SUCCESS && desc.idProduct == 1);
+    libusby_free_device_list(list, /*unref_devices=*/0);
+    libusby_unref_device(old_dev);
+
+    TEST_CHECK(libusby_get_device_list(ctx, &list) == 1);
+    TEST_CHECK(list[0] == new_dev);
+    libusby_free_device_list(list, /*unref_devices=*/1);
+    libusby_unref_device(new_dev);
+
+    libusby_exit(ctx);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include "tests.h"
+#include <string.h>
+
+#define QUEUE_TRANSFERS 4
+#define QUEUE_ROUNDS 500
+
+/* Transfers posted to a queue, some of them through its overflow list,
+ * come back one at a time and can be resubmitted as soon as retrieved. */
+int test_queue_resubmit(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    libusby_completion_queue * queue;
+    libusby_transfer * trans[QUEUE_TRANSFERS];
+    libusby_thread_attrs attrs;
+    uint8_t buf[QUEUE_TRANSFERS][64];
+    int completed = 0;
+    int i;
+
+    TEST_CHECK(ctx != 0);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+
+    memset(&attrs, 0, sizeof attrs);
+    TEST_CHECK(libusby_start_event_thread(ctx, &attrs) == LIBUSBY_SUCCESS);
+    TEST_CHECK(libusby_completion_queue_open(&queue, ctx, 2) == LIBUSBY_SUCCESS);
+
+    mock_usbfs_set_delay_us(50);
+    for (i = 0; i < QUEUE_TRANSFERS; ++i)
+    {
+        trans[i] = libusby_alloc_transfer(ctx, 0);
+        TEST_CHECK(trans[i] != 0);
+        libusby_fill_bulk_transfer(trans[i], handle, 0x81, buf[i], sizeof buf[i], 0, 0, 0);
+        TEST_CHECK(libusby_set_transfer_queue(trans[i], queue) == LIBUSBY_SUCCESS);
+        TEST_CHECK(libusby_submit_transfer(trans[i]) == LIBUSBY_SUCCESS);
+    }
+
+    while (completed < QUEUE_ROUNDS * QUEUE_TRANSFERS)
+    {
+        libusby_transfer * tran;
+
+        TEST_CHECK(libusby_poll_completions(queue, &tran, 1, 1000) == 1);
+        TEST_CHECK(tran->status == LIBUSBY_TRANSFER_COMPLETED);
+
+        /* Retrieved transfers are no longer active. */
+        TEST_CHECK(libusby_wait_for_transfer(tran) == LIBUSBY_SUCCESS);
+        if (++completed <= (QUEUE_ROUNDS - 1) * QUEUE_TRANSFERS)
+            TEST_CHECK(libusby_submit_transfer(tran) == LIBUSBY_SUCCESS);
+    }
+
+    for (i = 0; i < QUEUE_TRANSFERS; ++i)
+        libusby_free_transfer(trans[i]);
+    libusby_completion_queue_close(queue);
+    libusby_stop_event_loop(ctx);
+    libusby_close(handle);
+    libusby_exit(ctx);
+    return 0;
+}
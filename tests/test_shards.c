@@ -0,0 +1,86 @@
+#include "tests.h"
+#include <pthread.h>
+#include <sched.h>
+
+typedef struct shards_submitter
+{
+    libusby_context * ctx;
+    libusby_device_handle * handle;
+    int stop;
+    int completed;
+    int failed;
+} shards_submitter;
+
+static void * shards_submit_thread(void * param)
+{
+    shards_submitter * sub = param;
+    libusby_transfer * tran = libusby_alloc_transfer(sub->ctx, 0);
+    uint8_t buf[64];
+
+    libusby_fill_bulk_transfer(tran, sub->handle, 0x81, buf, sizeof buf, 0, 0, 100);
+    while (!__atomic_load_n(&sub->stop, __ATOMIC_SEQ_CST))
+    {
+        int r = libusby_submit_transfer(tran);
+        if (r == LIBUSBY_ERROR_BUSY)
+            continue;
+        if (r < 0 || libusby_wait_for_transfer(tran) < 0 || tran->status != LIBUSBY_TRANSFER_COMPLETED)
+            sub->failed = 1;
+        else
+            __atomic_add_fetch(&sub->completed, 1, __ATOMIC_SEQ_CST);
+    }
+
+    libusby_free_transfer(tran);
+    return 0;
+}
+
+/* A handle with a transfer in flight stays on its shard, and one moved back
+ * and forth while another thread keeps submitting never loses a transfer. */
+int test_handle_shard_move(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    libusby_transfer * tran;
+    shards_submitter sub;
+    pthread_t thread;
+    uint8_t buf[64];
+    uint64_t start;
+    int i;
+
+    TEST_CHECK(ctx != 0);
+    TEST_CHECK(libusby_set_option(ctx, LIBUSBY_OPTION_EVENT_LOOP_SHARDS, 2) == LIBUSBY_SUCCESS);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+
+    mock_usbfs_set_delay_us(-1);
+    tran = libusby_alloc_transfer(ctx, 0);
+    libusby_fill_bulk_transfer(tran, handle, 0x81, buf, sizeof buf, 0, 0, 0);
+    TEST_CHECK(libusby_submit_transfer(tran) == LIBUSBY_SUCCESS);
+    TEST_CHECK(libusby_set_handle_shard(handle, 1 - libusby_get_handle_shard(handle)) == LIBUSBY_ERROR_BUSY);
+    TEST_CHECK(libusby_cancel_transfer(tran) == LIBUSBY_SUCCESS);
+    TEST_CHECK(libusby_wait_for_transfer(tran) == LIBUSBY_SUCCESS);
+    TEST_CHECK(tran->status == LIBUSBY_TRANSFER_CANCELLED);
+    libusby_free_transfer(tran);
+
+    mock_usbfs_set_delay_us(100);
+    sub.ctx = ctx;
+    sub.handle = handle;
+    sub.stop = 0;
+    sub.completed = 0;
+    sub.failed = 0;
+    TEST_CHECK(pthread_create(&thread, 0, &shards_submit_thread, &sub) == 0);
+    start = test_now_us();
+    for (i = 0; __atomic_load_n(&sub.completed, __ATOMIC_SEQ_CST) < 500 && test_now_us() - start < 10000000; ++i)
+    {
+        int r = libusby_set_handle_shard(handle, i % 2);
+        TEST_CHECK(r == LIBUSBY_SUCCESS || r == LIBUSBY_ERROR_BUSY);
+        sched_yield();
+    }
+    __atomic_store_n(&sub.stop, 1, __ATOMIC_SEQ_CST);
+    pthread_join(thread, 0);
+    TEST_CHECK(!sub.failed);
+    TEST_CHECK(sub.completed >= 500);
+
+    libusby_close(handle);
+    libusby_exit(ctx);
+    return 0;
+}
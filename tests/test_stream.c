@@ -0,0 +1,54 @@
+#include "tests.h"
+#include <string.h>
+
+/* A stream, resubmitting from the event thread, keeps its transfers going as buffers are read and released,
+ * and stopping it ends the reads once the filled buffers are consumed. */
+int test_stream_read(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    libusby_stream * stream;
+    libusby_stream_buffer * buffer;
+    libusby_stream_stats stats;
+    libusby_thread_attrs attrs;
+    int i;
+
+    TEST_CHECK(ctx != 0);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+
+    memset(&attrs, 0, sizeof attrs);
+    TEST_CHECK(libusby_start_event_thread(ctx, &attrs) == LIBUSBY_SUCCESS);
+
+    mock_usbfs_set_delay_us(200);
+    TEST_CHECK(libusby_stream_open(&stream, handle, 0x81, 512, 4, 2) == LIBUSBY_SUCCESS);
+    TEST_CHECK(libusby_stream_start(stream) == LIBUSBY_SUCCESS);
+    TEST_CHECK(libusby_stream_start(stream) == LIBUSBY_ERROR_BUSY);
+
+    for (i = 0; i < 50; ++i)
+    {
+        TEST_CHECK(libusby_stream_read(stream, &buffer, 1) == LIBUSBY_SUCCESS);
+        TEST_CHECK(buffer->status == LIBUSBY_TRANSFER_COMPLETED);
+        TEST_CHECK(buffer->length == 512);
+        libusby_stream_release(stream, buffer);
+    }
+
+    libusby_stream_stop(stream);
+    while (libusby_stream_read(stream, &buffer, 1) == LIBUSBY_SUCCESS)
+        libusby_stream_release(stream, buffer);
+
+    /* Only a read that doesn't wait counts as an underrun. */
+    libusby_stream_get_stats(stream, &stats);
+    TEST_CHECK(stats.transfers >= 50);
+    TEST_CHECK(stats.bytes >= 50 * 512);
+    TEST_CHECK(stats.underruns == 0);
+    TEST_CHECK(libusby_stream_read(stream, &buffer, 0) == LIBUSBY_ERROR_TIMEOUT);
+    libusby_stream_get_stats(stream, &stats);
+    TEST_CHECK(stats.underruns == 1);
+
+    libusby_stream_close(stream);
+    libusby_stop_event_loop(ctx);
+    libusby_close(handle);
+    libusby_exit(ctx);
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include "tests.h"
+#include <pthread.h>
+
+typedef struct sync_caller
+{
+    libusby_device_handle * handle;
+    int result;
+    int done;
+} sync_caller;
+
+static void * sync_caller_thread(void * param)
+{
+    sync_caller * caller = param;
+    uint8_t buf[64];
+    int transferred;
+
+    caller->result = libusby_bulk_transfer(caller->handle, 0x81, buf, sizeof buf, &transferred, 1000);
+    __atomic_store_n(&caller->done, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/* A synchronous bulk transfer in progress holds up a draining close
+ * until it returns, and a closing handle refuses new ones. */
+int test_sync_bulk_drain(void)
+{
+    libusby_context * ctx = test_init();
+    mock_usbfs_counters counters;
+    sync_caller caller = { 0, 0, 0 };
+    pthread_t thread;
+    uint64_t start;
+
+    TEST_CHECK(ctx != 0);
+    caller.handle = test_open(ctx, 1);
+    TEST_CHECK(caller.handle != 0);
+
+    mock_usbfs_set_delay_us(100000);
+    TEST_CHECK(pthread_create(&thread, 0, &sync_caller_thread, &caller) == 0);
+
+    start = test_now_us();
+    do
+    {
+        mock_usbfs_get_counters(&counters);
+    }
+    while (counters.sync_bulk == 0 && test_now_us() - start < 1000000);
+    TEST_CHECK(counters.sync_bulk == 1);
+
+    TEST_CHECK(libusby_close_drain(caller.handle) == LIBUSBY_SUCCESS);
+    TEST_CHECK(__atomic_load_n(&caller.done, __ATOMIC_SEQ_CST));
+    pthread_join(thread, 0);
+    TEST_CHECK(caller.result == LIBUSBY_SUCCESS);
+
+    libusby_exit(ctx);
+    return 0;
+}
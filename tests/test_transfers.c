@@ -0,0 +1,160 @@
+#include "tests.h"
+#include <errno.h>
+
+static void transfers_count_cb(libusby_transfer * tran)
+{
+    ++*(int *)tran->user_data;
+}
+
+/* Transfers complete, with or without a delay, and each callback runs once. */
+int test_transfer_roundtrip(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    libusby_transfer * trans[4];
+    uint8_t buf[4][64];
+    int calls = 0;
+    int i;
+
+    TEST_CHECK(ctx != 0);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+
+    mock_usbfs_set_delay_us(1000);
+    for (i = 0; i < 4; ++i)
+    {
+        trans[i] = libusby_alloc_transfer(ctx, 0);
+        TEST_CHECK(trans[i] != 0);
+        libusby_fill_bulk_transfer(trans[i], handle, 0x81, buf[i], sizeof buf[i], &transfers_count_cb, &calls, 0);
+        TEST_CHECK(libusby_submit_transfer(trans[i]) == LIBUSBY_SUCCESS);
+    }
+
+    for (i = 0; i < 4; ++i)
+    {
+        TEST_CHECK(libusby_wait_for_transfer(trans[i]) == LIBUSBY_SUCCESS);
+        TEST_CHECK(trans[i]->status == LIBUSBY_TRANSFER_COMPLETED);
+        TEST_CHECK(trans[i]->actual_length == 64);
+        libusby_free_transfer(trans[i]);
+    }
+    TEST_CHECK(calls == 4);
+
+    libusby_close(handle);
+    libusby_exit(ctx);
+    return 0;
+}
+
+/* A bulk transfer split into several URBs, the second of which the kernel
+ * refuses, fails with the error of the refused submission. */
+int test_split_submit_error(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    libusby_transfer * tran;
+    static uint8_t buf[600 * 1024];
+
+    TEST_CHECK(ctx != 0);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+
+    mock_usbfs_set_delay_us(-1);
+    mock_usbfs_fail_submits(1, ENODEV);
+
+    tran = libusby_alloc_transfer(ctx, 0);
+    TEST_CHECK(tran != 0);
+    libusby_fill_bulk_transfer(tran, handle, 0x81, buf, sizeof buf, 0, 0, 0);
+    TEST_CHECK(libusby_submit_transfer(tran) == LIBUSBY_SUCCESS);
+    TEST_CHECK(libusby_wait_for_transfer(tran) == LIBUSBY_SUCCESS);
+    TEST_CHECK(tran->status == LIBUSBY_TRANSFER_NO_DEVICE);
+
+    libusby_free_transfer(tran);
+    libusby_close(handle);
+    libusby_exit(ctx);
+    return 0;
+}
+
+static void transfers_close_cb(libusby_transfer * tran)
+{
+    libusby_close(tran->dev_handle);
+    *(int *)tran->user_data = 1;
+}
+
+static int transfers_close_from_callback(int callback_threads)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    libusby_transfer * tran;
+    uint8_t buf[64];
+    int closed = 0;
+
+    TEST_CHECK(ctx != 0);
+    TEST_CHECK(libusby_set_option(ctx, LIBUSBY_OPTION_CALLBACK_THREADS, callback_threads) == LIBUSBY_SUCCESS);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+
+    mock_usbfs_set_delay_us(1000);
+    tran = libusby_alloc_transfer(ctx, 0);
+    TEST_CHECK(tran != 0);
+    libusby_fill_bulk_transfer(tran, handle, 0x81, buf, sizeof buf, &transfers_close_cb, &closed, 0);
+    TEST_CHECK(libusby_submit_transfer(tran) == LIBUSBY_SUCCESS);
+    TEST_CHECK(libusby_wait_for_transfer(tran) == LIBUSBY_SUCCESS);
+    TEST_CHECK(closed);
+    TEST_CHECK(tran->status == LIBUSBY_TRANSFER_COMPLETED);
+
+    libusby_free_transfer(tran);
+    libusby_exit(ctx);
+    return 0;
+}
+
+/* A callback may close the handle of its transfer, whether it runs
+ * on the event loop or on a callback thread. */
+int test_close_from_callback(void)
+{
+    TEST_CHECK(transfers_close_from_callback(0) == 0);
+    TEST_CHECK(transfers_close_from_callback(1) == 0);
+    return 0;
+}
+
+/* Cancelling an endpoint cancels only its transfers, cancelling
+ * the handle the rest, and each reports how many it cancelled. */
+int test_cancel_endpoint(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    libusby_transfer * trans[6];
+    uint8_t buf[6][64];
+    int i;
+
+    TEST_CHECK(ctx != 0);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+
+    mock_usbfs_set_delay_us(-1);
+    for (i = 0; i < 6; ++i)
+    {
+        trans[i] = libusby_alloc_transfer(ctx, 0);
+        TEST_CHECK(trans[i] != 0);
+        libusby_fill_bulk_transfer(trans[i], handle, i < 4? 0x81: 0x02, buf[i], sizeof buf[i], 0, 0, 0);
+        TEST_CHECK(libusby_submit_transfer(trans[i]) == LIBUSBY_SUCCESS);
+    }
+
+    TEST_CHECK(libusby_cancel_endpoint(handle, 0x81) == 4);
+    for (i = 0; i < 4; ++i)
+    {
+        TEST_CHECK(libusby_wait_for_transfer(trans[i]) == LIBUSBY_SUCCESS);
+        TEST_CHECK(trans[i]->status == LIBUSBY_TRANSFER_CANCELLED);
+    }
+
+    TEST_CHECK(libusby_cancel_endpoint(handle, 0x81) == 0);
+    TEST_CHECK(libusby_cancel_all(handle) == 2);
+    for (i = 4; i < 6; ++i)
+    {
+        TEST_CHECK(libusby_wait_for_transfer(trans[i]) == LIBUSBY_SUCCESS);
+        TEST_CHECK(trans[i]->status == LIBUSBY_TRANSFER_CANCELLED);
+    }
+
+    for (i = 0; i < 6; ++i)
+        libusby_free_transfer(trans[i]);
+    libusby_close(handle);
+    libusby_exit(ctx);
+    return 0;
+}
@@ -0,0 +1,43 @@
+#include "tests.h"
+#include <string.h>
+
+/* Data written while a transfer is in flight is sent once its flush timeout
+ * passes, without further writes or completions to trigger it. */
+int test_writer_idle_flush(void)
+{
+    libusby_context * ctx = test_init();
+    libusby_device_handle * handle;
+    libusby_writer * writer;
+    libusby_thread_attrs attrs;
+    mock_usbfs_counters counters;
+    uint8_t data[16] = { 0 };
+    uint64_t start;
+
+    TEST_CHECK(ctx != 0);
+    handle = test_open(ctx, 1);
+    TEST_CHECK(handle != 0);
+
+    memset(&attrs, 0, sizeof attrs);
+    TEST_CHECK(libusby_start_event_thread(ctx, &attrs) == LIBUSBY_SUCCESS);
+
+    /* The first write goes out at once and stays in flight for a while. */
+    mock_usbfs_set_delay_us(300000);
+    TEST_CHECK(libusby_writer_open(&writer, handle, 0x02, 4096, 4, 20) == LIBUSBY_SUCCESS);
+    TEST_CHECK(libusby_writer_write(writer, data, sizeof data) == sizeof data);
+    TEST_CHECK(libusby_writer_write(writer, data, sizeof data) == sizeof data);
+
+    start = test_now_us();
+    do
+    {
+        mock_usbfs_get_counters(&counters);
+    }
+    while (counters.submits < 2 && test_now_us() - start < 250000);
+    TEST_CHECK(counters.submits == 2);
+
+    TEST_CHECK(libusby_writer_drain(writer) == LIBUSBY_SUCCESS);
+    libusby_writer_close(writer);
+    libusby_stop_event_loop(ctx);
+    libusby_close(handle);
+    libusby_exit(ctx);
+    return 0;
+}
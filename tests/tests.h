@@ -0,0 +1,54 @@
+#ifndef LIBUSBY_TESTS_TESTS_H
+#define LIBUSBY_TESTS_TESTS_H
+
+#include "libusby.h"
+#include "mock_usbfs.h"
+#include <stdint.h>
+#include <stdio.h>
+
+/* Fails the running test, which returns nonzero. */
+#define TEST_CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return 1; \
+        } \
+    } while (0)
+
+/* The engine `test_init` selects for the context. */
+extern libusby_event_engine test_engine;
+
+libusby_context * test_init(void);
+
+/* Creates device `devno` on bus 1, with product id `devno`, and opens it. */
+libusby_device_handle * test_open(libusby_context * ctx, int devno);
+
+uint64_t test_now_us(void);
+
+int test_transfer_roundtrip(void);
+int test_split_submit_error(void);
+int test_close_from_callback(void);
+int test_cancel_endpoint(void);
+int test_handle_shard_move(void);
+int test_fake_clock_timeout(void);
+int test_dev_mem_after_close(void);
+int test_stream_read(void);
+int test_writer_idle_flush(void);
+int test_sync_bulk_drain(void);
+int test_control_no_alloc(void);
+int test_control_errors(void);
+int test_event_thread_lock_memory(void);
+int test_queue_resubmit(void);
+int test_hotplug_enumerate_race(void);
+int test_hotplug_replaced_device(void);
+int test_device_list_replaced(void);
+
+int bench_contention(void);
+int bench_engines(void);
+int bench_sync(void);
+int bench_wait(void);
+int bench_spin(void);
+int bench_resubmit(void);
+
+#endif
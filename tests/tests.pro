@@ -0,0 +1,35 @@
+# Tests and benchmarks of the Linux backend, run against a mock usbfs.
+# `libusby_tests` runs the tests, `libusby_tests bench` the benchmarks.
+
+TEMPLATE = app
+TARGET = libusby_tests
+CONFIG += console
+CONFIG -= qt app_bundle
+
+include(../libusby.pri)
+
+SOURCES += \
+    $$PWD/main.c \
+    $$PWD/mock_usbfs.c \
+    $$PWD/test_transfers.c \
+    $$PWD/test_shards.c \
+    $$PWD/test_clock.c \
+    $$PWD/test_dev_mem.c \
+    $$PWD/test_stream.c \
+    $$PWD/test_writer.c \
+    $$PWD/test_sync.c \
+    $$PWD/test_control.c \
+    $$PWD/test_event_thread.c \
+    $$PWD/test_queue.c \
+    $$PWD/test_hotplug.c \
+    $$PWD/bench_contention.c \
+    $$PWD/bench_engines.c \
+    $$PWD/bench_sync.c \
+    $$PWD/bench_wait.c \
+    $$PWD/bench_spin.c \
+    $$PWD/bench_resubmit.c
+HEADERS += \
+    $$PWD/mock_usbfs.h \
+    $$PWD/tests.h
+
+LIBS += -lpthread -ldl